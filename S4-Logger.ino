@@ -1,5 +1,5 @@
 
-#define VERSION "0.1.6"
+#define VERSION "0.1.31"
 
 
 /*
@@ -12,6 +12,31 @@
  *  Sofia Fanourakis
  *  
  *  --- Changelog -------------------
+ *  v0.1.31 - PJM -> RAW_FILE made on an allocation unit boundary of the card, in whole AUs read from the SD Status, so no other file shares its erase blocks (O_ALLOC_AU, tools/s4_allocsim.py)
+ *  v0.1.30 - PJM -> Card errors classed (CRC, timeout, gone) and retried in the driver; after a failed write the card is brought back under the same mount in bounded steps, backing off from the event handler, and RAW_FILE carries on from the journal
+ *  v0.1.29 - PJM -> Card driver: CMD13 status check once per 8 block writes and at every sync instead of after each write (SD_WRITE_STATUS_EVERY)
+ *  v0.1.28 - PJM -> Warm remount: a card that kept power and has the cached CID skips init and the MBR/BPB reads (SD.beginWarm(), lemtils/MountCache.h)
+ *  v0.1.27 - PJM -> Card mounts at the fastest SCK its block reads pass CRC checks at (SD.beginAdaptive(), CMD59), remembered per card CID in EEPROM (lemtils/CardRate.h)
+ *  v0.1.26 - PJM -> Card driver: data blocks through SdSpi.h kernels, polled overlap at any SCK and a cycle timed loop at F_CPU/2 (SD/examples/SpiBench)
+ *  v0.1.25 - PJM -> Card driver: chip select fixed at compile time (one sbi/cbi), SPI registers set once instead of an SPI.h transaction per operation
+ *  v0.1.24 - PJM -> SD_LATENCY_STATS (Sd2Card.h): card operations timed into log2 histograms with the worst case and its block, read over the offload link (s4_offload.py --stats)
+ *  v0.1.23 - PJM -> Rest of RAW.LOG erased at the start of a recording session, so appends don't stall on the card erasing. Slowest append traced at the stop.
+ *  v0.1.22 - PJM -> Format card (hold both buttons): whole card erased, FAT16/FAT32 laid out on the card's allocation units, in seconds (lemtils/Format.h)
+ *  v0.1.21 - PJM -> Offload mode: files streamed a block per frame at 1Mbaud with CRC, sequence and resume (lemtils/Offload.h, tools/s4_offload.py)
+ *  v0.1.20 - PJM -> RAW.IDX: first reading time per RAW.LOG block, for finding a time range in a few reads. Raw times carry on across resets.
+ *  v0.1.19 - PJM -> Raw records go to RAW.LOG, a preallocated file of checksummed 512 byte blocks, its end found by binary search at mount (lemtils/BlockLog.h)
+ *  v0.1.18 - PJM -> Raw records and shutdown markers the card can't take go to an EEPROM journal, replayed in order once the card mounts (lemtils/Journal.h)
+ *  v0.1.17 - PJM -> Power-fail shutdown on the analog comparator: card flushed, marker to SHUTDOWN.BIN, timed against the supercap (lemtils/PowerFail.h). Red LED moved to D5.
+ *  v0.1.16 - PJM -> BURST_CAPTURE: ADC runs continuously into a pre-trigger ring, bursts around faults go to BURST.BIN (lemtils/Burst.h)
+ *  v0.1.15 - PJM -> Adaptive sampling: raw readings only logged on change or heartbeat, reading rate drops while steady (lemtils/Deadband.h)
+ *  v0.1.14 - PJM -> Raw readings to RAW.BIN, cascaded 1 min / 15 min / daily aggregates each to their own file (lemtils/Downsample.h)
+ *  v0.1.13 - PJM -> Charge and energy integrated at the sample rate, 1 minute summaries to SUMMARY.BIN (lemtils/Accumulate.h)
+ *  v0.1.12 - PJM -> Battery voltage, load current and power in fixed point (lemtils/Measure.h), no floats
+ *  v0.1.11 - PJM -> Battery and shunt read by the interrupt-driven ADC sampler, 12-bit by oversampling
+ *  v0.1.10 - PJM -> Diagnostics go through a buffered trace (lemtils/Trace.h), strings in flash, never blocks the loop
+ *  v0.1.9 - PJM -> Edge-driven buttons, pin changes are timestamped and debounced once quiet (lemtils/Button.h)
+ *  v0.1.8 - PJM -> Data is read on a drift-free periodic event (absolute deadlines, 32-bit clock)
+ *  v0.1.7 - PJM -> Tickless idle, sleeps until the next event (lemtils/Sleep.h)
  *  v0.1.6 - PJM -> To github, changed Walrus to S4-Logger
  *  v0.1.5 - PJM -> Setting up states
  *  v0.1.3 - PJM -> Skeleton Structure
@@ -25,11 +50,15 @@
  *  //PC4/A4 (SDA)  -> RTC SDA
  *  //PC5/A5 (SCL)  -> RTC SCL
  *  //D2/PD2        -> G of 33N10 (N-channel)
- *  //A3/PC3        -> Voltage at top of AA battery.
- *  //A2/PC2        -> Voltage at GND of AA battery.
+ *  //D2/PD2 (INT0) -> Supply supervisor power-fail output, active low (POWERFAIL_INT0, instead of PD7 and the comparator)
+ *  A3/PC3        -> Voltage at top of AA battery.  (ADC sampler)
+ *  A2/PC2        -> Voltage at GND of AA battery (top of the load/shunt resistor).  (ADC sampler)
  *  //D9 / PB1       -> Red LED
- *  D7 / PD7 / PCINT23       -> Red LED
+ *  //D7 / PD7 / PCINT23       -> Red LED
+ *  D5 / PD5       -> Red LED
+ *  D7 / PD7 (AIN1)       -> Supply rail through a divider, crosses 1.1V when the supply is failing (power-fail comparator)
  *  D3 / PD3       -> Green LED
+ *  D0 / PD0 (RXD) / PCINT16       -> Serial RX, a pin change wakes us from power down so a host can start offload mode
  *  //PD6       -> Blue LED
  *  //D7 / PD7 / PCINT23       -> Button 1 
  *  D9 / PB1 / PCINT1       -> Button 1
@@ -43,6 +72,8 @@
  *  - Need to find two pins that can be pulled up/down to identify unique logging units
  *  - Supercap calc:  http://electronics.stackexchange.com/questions/4951/how-do-i-calculate-how-fast-a-capacitor-will-discharge
  *  - When power dies, write to EEPROM, not SD card.  Then move that to SD card when you ahve power.
+ *    (Power-fail comparator now finishes the card write in flight and leaves a marker, see PowerFail_Shutdown())
+ *    (Records the card can't take go to the EEPROM journal and are replayed to the card once it mounts, see Raw_Write())
  *  - "<CyL> lem: I read a couple of message in the back log, I suggest you to use a comparator instead of a voltage divider."
  *  
  *  
@@ -54,6 +85,11 @@
 #define VREF 5 // 5V operating voltage
 //#define FACTORY_RESET // Not yet implemented
 //#define LIGHTS_ON_BUTTONS // LEDS light up, red on buton 1, green on button 2 press.
+#define TICKLESS_IDLE // Sleep until the next event is due instead of waiting MAIN_LOOP_INTERVAL every loop
+#define TRACE_LEVEL TRACE_LEVEL_INFO // Diagnostics sent: TRACE_LEVEL_OFF, _ERROR, _INFO or _DEBUG
+//#define TRACE_BINARY // Send diagnostics as binary frames for the host to expand (lemtils/Trace.h, tools/s4_offload.py --trace)
+#define ADAPTIVE_SAMPLING // Raw readings only logged when they change (or on the heartbeat), read less often while nothing changes
+//#define BURST_CAPTURE // ADC never stops (~280 readings/s), bursts around faults to BURST_FILE. Costs ~300 bytes RAM and the power down sleep.
 
 // Options
 #define START_PROGRAM_IN_THIS_STATE none
@@ -62,10 +98,46 @@
 #define EVENT_BLINKLEDS_INTERVAL 500 // 500 ms
 #define FLASH_LED_DURATION 500 // 500 ms
 #define CHANGE_STATE_AFTER_THIS_DELAY 1000
-#define MAIN_LOOP_INTERVAL 5 // 5ms in main interval
-#define BUTTON_DEBOUNCE_INTERVAL 5 // repeat times * (main loop interval + 1ms between), so 30ms total for a debounced "press"
-#define BUTTON_DEBOUNCE_REPEAT_TIMES 5
+#define MAIN_LOOP_INTERVAL 5 // 5ms in main interval (only used without TICKLESS_IDLE)
+#define BUTTON_DEBOUNCE_INTERVAL 30 // 30ms without a pin change before a press/release counts
 #define READ_DATA_INTERVAL 1000 // 1 second between successive reading of new data from the connected device (charge controller)
+#define SUMMARY_WINDOW_MS 60000UL // 1 minute summaries (min/max/mean/average/integral) of voltage, current and power
+#define SUMMARY_FILE "SUMMARY.BIN" // struct a_summary_record, back to back
+#define RAW_FILE "RAW.LOG" // struct a_raw_record per reading, 31 to a framed block (lemtils/BlockLog.h)
+#define RAW_INDEX_FILE "RAW.IDX" // uint32_t time of the first struct a_raw_record in each RAW_FILE block
+#define RAW_LOG_BLOCKS 65536UL // 32MB made in one piece on a fresh card, ~23 days of 1 second readings
+#define RAW_WRITE_SLOW_US 20000UL // Appends slower than this are counted (the card stalled, usually erasing)
+#define READ_DATA_INTERVAL_QUIET 5000 // Reading interval once nothing has changed for ADAPTIVE_QUIET_READINGS readings (ADAPTIVE_SAMPLING)
+#define ADAPTIVE_QUIET_READINGS 10 // Readings in band before slowing down
+#define LOG_HEARTBEAT_MS 60000UL // A raw record at least this often, changing or not (ADAPTIVE_SAMPLING)
+#define DEADBAND_MILLIVOLTS 20,  5      // Band [mV], slope [mV/s]: battery
+#define DEADBAND_MILLIAMPS  50,  20     // Band [mA], slope [mA/s]: load current
+#define DEADBAND_MICROWATTS 250000L, 0  // Band [uW], no slope limit: load power
+#define DOWNSAMPLE_VALUES 3 // Battery mV, load mA, load uW
+#define DOWNSAMPLE_TIERS 2 // Window lengths and files in Downsample_Windows[] / Downsample_Files[]
+#define SHUTDOWN_FILE "SHUTDOWN.BIN" // struct a_shutdown_record per power failure
+#define POWER_FAIL_BUDGET_US 50000UL // Supercap hold-up from the comparator tripping to brown-out, measured on the bench. Shutdown over this is an error.
+#define POWER_FAIL_RECOVERED_MS 100 // Supply back this long after a shutdown: it was a glitch, reset and carry on
+#define POWER_FAIL_SLEEP_MS 30 // Longest wait while the card is mounted without POWERFAIL_INT0: powers down a 16ms watchdog period at a time, so the comparator (which can't wake us) is seen within ~20ms of tripping
+//#define POWERFAIL_INT0 // Power-fail warning from a supervisor on INT0 (PD2), wakes us from power down (lemtils/PowerFail.h)
+#define JOURNAL_TYPE_RAW 1 // struct a_raw_record, replayed to RAW_FILE
+#define JOURNAL_TYPE_SHUTDOWN 2 // struct a_shutdown_record, replayed to SHUTDOWN_FILE
+#define JOURNAL_TYPE_RAW_UNTIMED 3 // struct a_raw_record from before the first mount set Log_Time_Offset, added at replay
+#define OFFLOAD_RANGE_RECORDS 8 // struct a_raw_record per DATA frame answering a RANGE request (on the stack)
+#define JOURNAL_EEPROM_END (E2END + 1 - 64) // 45 slots, the mount record (48) and card rates (16) above it
+#define BURST_FILE "BURST.BIN" // struct a_burst_header then pre + post samples of {battery, shunt} raw counts, per burst
+#define BURST_CHANNELS 2 // Battery, shunt
+#define BURST_BATTERY_BELOW_MV 2500 // Trigger: battery (PC3) dropped out
+#define BURST_LOAD_ABOVE_MA 20000 // Trigger: load current over this
+#define BURST_LOAD_STEP_MA 5000 // Trigger: load current jumped this much between two readings (~3.5ms)
+#define SD_KEEP_CRC true // Card CRC checking (CMD59) stays on after the SCK rate search, ~0.3ms more per block each way
+#define CARD_RECOVER_FIRST_MS 50 // First try at bringing the card back after a failed write, and the ACMD41 poll interval
+#define CARD_RECOVER_MAX_MS 30000 // Tries back off doubling up to this while the card stays away
+#define CARD_RECOVER_STEP_MS 20 // Longest one try polls the card for, so the main loop is back well inside READ_DATA_INTERVAL
+#define SERIAL_BAUD 9600 // Diagnostics and the offload HELLO
+#define OFFLOAD_BAUD 1000000UL // Offload mode, exact at 16MHz (U2X, UBRR 1)
+#define OFFLOAD_IDLE_MS 30000UL // Offload mode ends after this long without a frame from the host
+#define OFFLOAD_LISTEN_MS 3000 // Stays out of power down this long after serial activity, so the host's retried HELLO gets through
 #define WDPS_4S     (1<<WDP3 )|(0<<WDP2 )|(0<<WDP1)|(0<<WDP0)
 #define watchdog_clear_status()    MCUSR = 0  // Reset all statuses in the control register of the MCU
 #define watchdog_feed()            wdt_reset()  // This entertains me
@@ -73,6 +145,13 @@
 
 // Measured Variables
 #define LoadResistance 0.010 // [Ohms]
+#define ADC_CHANNEL_BATTERY 3  // PC3, top of the battery
+#define ADC_CHANNEL_SHUNT 2    // PC2, battery GND side, across LoadResistance
+#define ADC_OVERSAMPLE_BITS 2  // 16 conversions per result, 12-bit results (~3.5ms for both channels)
+#define MILLIVOLTS_GAIN MEASURE_GAIN(VREF * 1000.0, 10 + ADC_OVERSAMPLE_BITS, 14)                  // mV per count, Q14 (20000)
+#define MILLIAMPS_GAIN  MEASURE_GAIN(VREF * 1000.0 / LoadResistance, 10 + ADC_OVERSAMPLE_BITS, 8) // mA per count through LoadResistance, Q8 (31250)
+#define COUNTS_FROM_MV(mv) ((uint16_t)((mv) * (double)(1UL << (10 + ADC_OVERSAMPLE_BITS)) / (VREF * 1000.0) + 0.5)) // Raw reading for a voltage, constant folded
+#define COUNTS_FROM_MA(ma) COUNTS_FROM_MV((ma) * LoadResistance)
 
 
 
@@ -82,11 +161,12 @@
 #define PIN_SPI_MISO B,4
 #define PIN_SPI_MOSI B,3
 #define PIN_SPI_SCK B,5
-#define PIN_SPI_SS_SDCARD D,4  // Should change to B,2 eventually
+#define PIN_SPI_SS_SDCARD D,4  // Should change to B,2 eventually (SD_FIXED_CHIP_SELECT_PIN in SD/src/utility/Sd2Card.h with it)
 //#define PIN_I2C_SDA C,4
 //#define PIN_I2C_SCL C,5
 //#define PIN_LED_Red B,1
-#define PIN_LED_Red D,7
+//#define PIN_LED_Red D,7 // PD7 is AIN1 now (power-fail comparator)
+#define PIN_LED_Red D,5
 #define PIN_LED_Green D,3
 //#define PIN_Button_1 D,7
 #define PIN_Button_1 B,1
@@ -114,8 +194,88 @@
 #include "lemtils/Timer.h" // Includes functions for using the on-board timer. Allows delay(ms). REQUIRES: Timer_Timer1_Initialize(); (Or similar)
 #include <avr/wdt.h>
 #include "lemtils/ADC.h" // Includes functions for using the ADC. REQUIRES: ADC_Initialize(); ADC_SetAsInput(pin);
+#include "lemtils/Measure.h" // Fixed-point measurements. REQUIRES: measure_Initialize(); per channel
+#include "lemtils/Accumulate.h" // Running stats and integrals. REQUIRES: accumulate_Initialize(); per value
+#include "lemtils/Downsample.h" // Multi-resolution aggregates. REQUIRES: downsample_Initialize(); per tier
+#include "lemtils/Deadband.h" // Change detection. REQUIRES: deadband_Initialize(); per value
+#include "lemtils/BlockLog.h" // Framed block log with recovery. REQUIRES: blocklog_Open(); after SD.begin()
+#include "lemtils/Offload.h" // Serial offload framing. REQUIRES: offload_Initialize(); for each parser
+#include "lemtils/Format.h" // On-device card format. REQUIRES: the card not mounted (close every file first)
+#include "lemtils/Journal.h" // EEPROM write-ahead journal. REQUIRES: journal_Initialize(); journal_Interrupt(); in ISR(EE_READY_vect)
+#include "lemtils/CardRate.h" // SPI rate per card in EEPROM. REQUIRES: nothing
+#include "lemtils/MountCache.h" // Card mount record in EEPROM. REQUIRES: nothing
+#if (JOURNAL_EEPROM_START + _JOURNAL_SLOTS * _JOURNAL_SLOT_SIZE > MOUNTCACHE_EEPROM_START) || (MOUNTCACHE_EEPROM_START + MOUNTCACHE_SIZE > CARDRATE_EEPROM_START)
+#  error "EEPROM users overlap (journal, mount record, card rates)"
+#endif
+#include "lemtils/PowerFail.h" // Supply outage warning. REQUIRES: powerfail_Initialize(); powerfail_Interrupt(); in ISR(ANALOG_COMP_vect)
+#ifdef BURST_CAPTURE
+#include "lemtils/Burst.h" // Pre-trigger burst capture. REQUIRES: burst_Initialize(); burst_Sample(); from the sampling ISR
+#endif
 #include "lemtils/EventHandler.c"
 #include <avr/interrupt.h>
+#include "lemtils/Sleep.h" // Tickless idle. REQUIRES: sleep_Tick(); in the 1ms ISR, sleep_WatchdogInterrupt(); in ISR(WDT_vect)
+#include "lemtils/Button.h" // Edge-driven buttons. REQUIRES: button_Initialize(); button_QueueEdge(); in the PCINT ISR
+
+// Diagnostic messages, IDs in order from 1 (the host table for TRACE_BINARY is this list)
+#define TRACE_MESSAGES(X) \
+  X(trace_State_Home,              "In state_Handler() for: home") \
+  X(trace_State_Recording,         "In state_Handler() for: record") \
+  X(trace_State_Stop_Recording,    "In state_Handler() for: stop_recording") \
+  X(trace_State_Sleep,             "In state_Handler() for: sleep_until_next_recording") \
+  X(trace_State_Format_Card,       "In state_Handler() for: format_card") \
+  X(trace_State_None,              "In state_Handler() for: none") \
+  X(trace_State_Offload,           "In state_Handler() for: offload") \
+  X(trace_None_To_Recording,       "State 'none' -> 'recording'.") \
+  X(trace_Sleep_To_Stop_Recording, "State 'sleep_until_next_recording' -> 'stop_recording'.") \
+  X(trace_Both_Buttons_Pressed,    "Both buttons pressed.") \
+  X(trace_Button_1_Held,           "B1 millis =") \
+  X(trace_Button_2_Held,           "B2 millis =") \
+  X(trace_In_Recording,            "In state_Recording( void ).") \
+  X(trace_In_Sleep,                "In state_Sleep_until_next_recording().") \
+  X(trace_In_Stop_Recording,       "In state_Stop_recording(). Resetting to state 'none'.") \
+  X(trace_In_Format_Card,          "In state_Format_card(). Resetting to state 'none'.") \
+  X(trace_Format_Failed,           "Format failed:") \
+  X(trace_Format_Au_Blocks,        "Format done, AU blocks =") \
+  X(trace_Idle_Permille,           "Idle permille:") \
+  X(trace_Missed_Readings,         "Missed readings:") \
+  X(trace_CC_Data_Retrieved,       "CC Data retrieved. [ <- Sim ]") \
+  X(trace_CC_Data_Written,         "CC data written to SD Card. [ <- Sim ]") \
+  X(trace_Setting_Sleep,           "Setting sleeping state... [ <- Sim ]") \
+  X(trace_SD_Init_Done,            "Init SD card... init done.") \
+  X(trace_SD_Init_Failed,          "Init SD card... init failed!") \
+  X(trace_SD_Sck_Rate,             "SD card SCK rate (0 is F_CPU/2):") \
+  X(trace_SD_Mount_Us,             "SD card mounted [us]:") \
+  X(trace_SD_Mount_Warm_Us,        "SD card remounted warm [us]:") \
+  X(trace_SD_Error_Class,          "SD card error class (1 CRC, 2 timeout, 3 gone, 4 refused):") \
+  X(trace_SD_Recovered,            "SD card back, SCK rate:") \
+  X(trace_SD_Recover_Failed,       "SD card not back, next try [ms]:") \
+  X(trace_SD_Other_Card,           "SD card swapped, records wait in the journal for the next mount") \
+  X(trace_File_Written,            "Writing to test.txt...done.") \
+  X(trace_File_Open_Failed,        "error opening test.txt") \
+  X(trace_Charge_Total,            "Charge total [mAh]:") \
+  X(trace_Energy_Total,            "Energy total [mWh]:") \
+  X(trace_Summary_Write_Failed,    "error writing " SUMMARY_FILE) \
+  X(trace_Raw_Write_Failed,        "error writing " RAW_FILE) \
+  X(trace_Raw_Open_Failed,         "error opening " RAW_FILE " (not contiguous, or no room to make it)") \
+  X(trace_Raw_Blocks,              RAW_FILE " blocks written:") \
+  X(trace_Raw_Erased,              RAW_FILE " blocks erased ahead:") \
+  X(trace_Raw_Write_Max_Us,        RAW_FILE " slowest append [us]:") \
+  X(trace_Raw_Write_Slow,          RAW_FILE " appends over RAW_WRITE_SLOW_US:") \
+  X(trace_Raw_Dropped,             RAW_FILE " full, raw records dropped:") \
+  X(trace_Tier_Write_Failed,       "error writing downsample tier:") \
+  X(trace_Read_Interval,           "Reading interval [ms]:") \
+  X(trace_Raw_Skipped,             "Raw readings not logged (in band):") \
+  X(trace_Burst_Written,           "Burst written, reason:") \
+  X(trace_Burst_Write_Failed,      "error writing " BURST_FILE) \
+  X(trace_Burst_Manual,            "Burst triggered by button") \
+  X(trace_Shutdown_Us,             "Power fail, shutdown took [us]:") \
+  X(trace_Shutdown_Over_Budget,    "Power fail shutdown over POWER_FAIL_BUDGET_US [us]:") \
+  X(trace_Journal_Pending,         "Journal records to replay:") \
+  X(trace_Journal_Replayed,        "Journal replayed to the card") \
+  X(trace_Journal_Full,            "Journal queue full, record lost") \
+  X(trace_Journal_Replay_Failed,   "error replaying the journal to the card") \
+  X(trace_Offload_Done,            "Offload mode ended, frames sent:")
+#include "lemtils/Trace.h" // Buffered diagnostics. REQUIRES: TRACE_MESSAGES defined before, trace_NextByte() drained to the UART
 
 //#include "lemtils/Terminal.h" // Facilitates terminal communication ( e.g. printf(), scanf(), puts() ) (BAUD 9600). REQUIRES: Terminal_Initialize();
 //#include <errno.h>
@@ -133,7 +293,8 @@ typedef enum aSTATE {
   recording,
   sleep_until_next_recording,
   stop_recording,
-  format_card
+  format_card,
+  offload           // Serial at OFFLOAD_BAUD, files sent on request from the host
   //recording_sd_card_check,
   //recording_
   //error,             //
@@ -141,9 +302,21 @@ typedef enum aSTATE {
 } STATE_t;
 STATE_t state, last_state, next_state;
 
+// DECLARATIONS: Button gestures
+typedef enum aGESTURE {
+  gesture_none,
+  gesture_hold_1,   // Button 1 held alone
+  gesture_hold_2,   // Button 2 held alone
+  gesture_hold_both // Both pressed within BOTH_PRESSED_IF_WITHIN of each other and held
+} GESTURE_t;
+
 
 // DECLARATIONS: Functions
 void events_Tick();
+void events_Advance(unsigned short ms); // Credits every event with ms that passed without the 1ms tick (asleep)
+unsigned short events_NextDeadline( void ); // ms until the next active event is due
+void ButtonGestures( void );
+void Trace_Drain( void ); // Sends what the UART can take right now of the queued diagnostics
 void events_Handler( void ); // Handles the events; If an event is ready, perform appropriate actions.
 void events_Handler_HighPriority( void ); // Handles high priority events (This is ran with the 1ms timer interrupt)
 void state_Handler( void );
@@ -157,10 +330,22 @@ void state_Transition( void );
 void state_Recording( void );
 void event_Test_function( void );
 void ReadDataFromDevice( void );
+void Measurements_Collect( void ); // Takes finished ADC results into the latest measurements
+void Summary_Write( void ); // Closes the accumulator windows and appends their summaries to SUMMARY_FILE
+void Downsample_Write( void ); // Appends the latest reading to RAW_FILE and any finished tier windows to their files
+bool Adaptive_Update( const int32_t *values ); // Whether a raw reading is worth logging, speeds up/slows down the readings
+void Burst_Sample( void ); // Pairs the sampler's results into burst samples, from ISR(ADC_vect)
+void Burst_Write( void ); // Appends a finished burst to BURST_FILE and rearms
+void PowerFail_Shutdown( void ); // Supply is failing: card made consistent, marker written. Doesn't return.
+void Raw_Write( const struct a_raw_record *raw ); // To RAW_FILE, or the EEPROM journal if the card can't take it
+void Journal_ReplayOne( void ); // Oldest journal record to its file on the card
 void StartRecording( void );
 void ReadToConsoleFromFile( void );
 void AppendToFile( void );
 void InitializeSDCard( void );
+uint8_t Card_First_Rate( const cid_t *cid ); // Where SD.beginAdaptive() starts for this card
+void Card_Recover_Start( void ); // A write failed: classify it and schedule the first try at bringing the card back
+void Card_Recover( void ); // One bounded try (SD.recover()), then the next one backed off
 void OpenAndWaitForSerialPort( void );
 void ButtonHandler( void );
 void BlinkLEDs( void );
@@ -175,6 +360,15 @@ void Green_LED_Flash( void );
 void Both_LED_Flash( void );
 void ReadSDCardToConsole( void );
 void state_Format_card( void );
+void state_Offload( void );
+void Offload_Poll( void ); // Host frames in: HELLO starts offload mode, the rest are handled in it
+void Offload_Handle( const struct an_offload_frame *frame );
+void Offload_Frame( uint8_t type, uint16_t sequence, uint32_t offset, const uint8_t *payload, uint16_t length );
+void Offload_List( void );
+void Offload_Read( const char *name, uint32_t offset );
+void Offload_Range( uint32_t from, uint32_t to );
+void Offload_Stats( bool clear );
+void Offload_Leave( void );
 //void event_RedLEDOff( void );
 //void event_GreenLEDOff( void );
 
@@ -188,25 +382,72 @@ bool status_change = false;
 volatile bool state_is_fresh = true;
 bool Red_Is_On = false;
 bool Green_Is_On = false;
-volatile bool Button1_Was_Pressed_With_Interrupt = false;
-volatile bool Button2_Was_Pressed_With_Interrupt = false;
-byte Button1_Debounce_Times = 0;
-byte Button2_Debounce_Times = 0;
-bool Button1 = false; // Was Button 1 pressed and debounced? (1 = Pressed) (Note: Stays true after a press, must be manually set to false when the press is registered)
-bool Button2 = false; // Was Button 2 pressed and debounced? (1 = Pressed) (Note: Stays true after a press, must be manually set to false when the press is registered)
-bool Button2_Is_Actively_Pressed = false;
-bool Button1_Is_Actively_Pressed = false;
-//bool Button1_Press_Has_Been_Used = false;
-//bool Button2_Press_Has_Been_Used = false;
-unsigned long logentry = 0;
+struct a_button Buttons[2];       // Debounced from timestamped pin changes, see ButtonHandler()
+#define Button_1 Buttons[0]
+#define Button_2 Buttons[1]
+GESTURE_t Button_Gesture = gesture_none; // Latest gesture, state_Transition() clears it when used
+bool Button_Gesture_Used = false; // One gesture per press, both buttons must be released before the next
+struct an_offload_parser Offload_Host;
+uint32_t Offload_Heard_At = 0;  // Last serial activity (or the pin change that woke us)
+uint16_t Offload_Frames = 0;    // Sent in this offload session
+volatile bool Serial_Woke = false; // RX pin changed while powered down
+uint32_t Sample_Time = 0;  // Nominal time [ms] of the latest reading, phase-locked to READ_DATA_INTERVAL
+const uint8_t ADC_Channels[] = { ADC_CHANNEL_BATTERY, ADC_CHANNEL_SHUNT };
+uint16_t Battery_Raw = 0;  // Latest result, 10 + ADC_OVERSAMPLE_BITS bits of VREF
+uint16_t Shunt_Raw = 0;
+
+// Written to SHUTDOWN_FILE when the supply fails (16 bytes). Times are from the comparator tripping.
+// Journaled (no card) only the first two are written, the rest stay 0xFFFFFFFF (erased EEPROM costs nothing to write).
+struct a_shutdown_record {
+  uint32_t tripped_at;  // [ms] event clock
+  uint32_t stopped_us;  // Acquisition stopped and the card write in flight finished (back in the main loop)
+  uint32_t flushed_us;  // Volume cache on the card
+  uint32_t budget_us;   // POWER_FAIL_BUDGET_US at the time
+};
+static_assert(sizeof(struct a_shutdown_record) == JOURNAL_PAYLOAD_SIZE, "a_shutdown_record is journaled as is");
+bool Card_Is_Ready = false; // Mounted and the last write worked, otherwise records go to the journal
+cid_t Card_Cid;                // Of the card being mounted, for CardRate.h
+unsigned short Card_Recover_Wait = CARD_RECOVER_FIRST_MS; // Before the next try, doubles up to CARD_RECOVER_MAX_MS per failure, back down once a write works
+bool Reading_Pending = false; // A reading is due, the next battery + shunt pair from the sampler is taken as it
+struct a_measure_channel Measure_Battery;        // PC3 in mV
+struct a_measure_channel Measure_Shunt;          // PC2 in mV
+struct a_measure_channel Measure_Load_Current;   // PC2 in mA through LoadResistance
+int32_t Battery_Millivolts = 0; // Across the battery (PC3 - PC2)
+int32_t Load_Milliamps = 0;
+int32_t Load_Microwatts = 0;
+struct an_accumulator Acc_Battery_Millivolts;
+struct an_accumulator Acc_Load_Milliamps;    // Integral is charge [mA*ms]
+struct an_accumulator Acc_Load_Microwatts;   // Integral is energy [uW*ms]
+
+// One summary window of all three, as written to SUMMARY_FILE (84 bytes)
+struct a_summary_record {
+  struct an_accumulator_summary millivolts;
+  struct an_accumulator_summary milliamps;
+  struct an_accumulator_summary microwatts;
+};
+
+// One reading, as written to RAW_FILE (16 bytes)
+struct a_raw_record {
+  uint32_t time; // Sample_Time + Log_Time_Offset, goes up through the whole log (the index needs that)
+  int32_t values[DOWNSAMPLE_VALUES]; // Same order as the tiers
+};
+static_assert(sizeof(struct a_raw_record) == JOURNAL_PAYLOAD_SIZE, "a_raw_record is journaled as is");
+struct a_blocklog Raw_Log; // RAW_FILE, reopened (and its end found) on every mount
+uint32_t Log_Time_Offset = 0; // Added to Sample_Time for raw records: no RTC, so log time carries on from the last record logged before the reset
+bool Log_Time_Is_Set = false; // Offset taken from RAW_FILE at the first mount after a reset
+uint32_t Raw_Last_Time = 0; // Of the newest record in RAW_FILE, replayed records never go back past it (the index needs that)
+struct a_downsample_tier Downsample_Tiers[DOWNSAMPLE_TIERS];
+const uint32_t Downsample_Windows[DOWNSAMPLE_TIERS] = {900000UL, 86400000UL}; // 15 min, 1 day: each a multiple of the last. 1 min is SUMMARY_FILE.
+const char *const Downsample_Files[DOWNSAMPLE_TIERS] = {"MIN15.BIN", "DAY.BIN"}; // struct a_downsample_record, back to back
+struct a_deadband Deadbands[DOWNSAMPLE_VALUES]; // Same order as a_raw_record.values
+uint32_t Raw_Logged_At = 0;   // Sample_Time of the last raw record
+uint32_t Raw_Skipped = 0;     // Raw readings not logged because nothing changed
+uint32_t Raw_Write_Max_Us = 0; // Slowest RAW_FILE append this session
+uint16_t Raw_Write_Slow = 0;   // Appends this session over RAW_WRITE_SLOW_US
+uint32_t Raw_Dropped = 0;     // Raw records this session with RAW_FILE full
+uint8_t Quiet_Readings = 0;   // Readings in a row with every value in band
 unsigned long time;
-unsigned long Button1_HeldTime = 0;         // Resets to zero on button up
-unsigned long Button2_HeldTime = 0;         // Resets to zero on button up
-unsigned long Button1_HeldTime_Latest = 0;  // Does not reset on button up, will always be larger than 0
-unsigned long Button2_HeldTime_Latest = 0;  // Does not reset on button up, will always be larger than 0
-volatile bool ButtonActivity = false;
-bool Button1P = false;
-bool Button2P = false;
+uint32_t Sleep_Started_At = 0; // Clock when the last power down started, edges stamped after it get the slept time added
 bool Red_LED_Blink_On = false;
 bool Green_LED_Blink_On = false;
 bool Should_I_Be_Sleeping = false;
@@ -217,11 +458,13 @@ int Green_FlashCountdown = 0;
 // Create events and set up event ticker
 struct an_event event_Test ;
 struct an_event event_ChangeStateAfterDelay ;
-struct an_event event_ReadDataFromDevice ;
+struct a_periodic_event event_ReadDataFromDevice ;
 struct an_event event_ButtonDebounce ;
+struct an_event event_ButtonHold ;
 struct an_event event_BlinkLEDs ;
 struct an_event event_RedLEDOff ;
 struct an_event event_GreenLEDOff ;
+struct an_event event_CardRecover ;
 
 
 
@@ -233,15 +476,16 @@ void setup() {
   // Initialize events and start relevant ones
   event_Initialize(&event_Test,EVENT_TEST_INTERVAL);
   event_Initialize(&event_ChangeStateAfterDelay, CHANGE_STATE_AFTER_THIS_DELAY);
-  event_Initialize(&event_ReadDataFromDevice,READ_DATA_INTERVAL);
+  event_PeriodicInitialize(&event_ReadDataFromDevice, READ_DATA_INTERVAL, EVENT_SKIP_MISSED);
   event_Initialize(&event_ButtonDebounce,BUTTON_DEBOUNCE_INTERVAL);
+  event_Initialize(&event_ButtonHold,BOTH_PRESSED_IF_WITHIN + 1);
   event_Initialize(&event_BlinkLEDs,EVENT_BLINKLEDS_INTERVAL);
   event_Initialize(&event_RedLEDOff,FLASH_LED_DURATION);
   event_Initialize(&event_GreenLEDOff,FLASH_LED_DURATION);
+  event_Initialize(&event_CardRecover,CARD_RECOVER_FIRST_MS);
  
-  event_StartNow(&event_ReadDataFromDevice);
+  event_PeriodicStartNow(&event_ReadDataFromDevice);
   event_StartNow(&event_Test); // Sets it at a count of zero and "is_planned" to true
-  event_StartNow(&event_ButtonDebounce);
   event_StartNow(&event_BlinkLEDs);
 
   PIN_SET_AS_OUTPUT(PIN_SPI_SCK);
@@ -253,6 +497,24 @@ void setup() {
   PIN_SET_AS_OUTPUT(PIN_LED_Green);
 
   PIN_SET_AS_INPUT(PIN_Potentiometer);
+
+  measure_Initialize(&Measure_Battery, MILLIVOLTS_GAIN, 14);
+  measure_Initialize(&Measure_Shunt, MILLIVOLTS_GAIN, 14);
+  measure_Initialize(&Measure_Load_Current, MILLIAMPS_GAIN, 8);
+  //measure_Calibrate(&Measure_Load_Current, offset, trim_ppm); // Per unit, once it's been measured against a meter
+  accumulate_Initialize(&Acc_Battery_Millivolts, SUMMARY_WINDOW_MS, 0);
+  accumulate_Initialize(&Acc_Load_Milliamps, SUMMARY_WINDOW_MS, 0);
+  accumulate_Initialize(&Acc_Load_Microwatts, SUMMARY_WINDOW_MS, 0);
+  for (uint8_t i = 0; i < DOWNSAMPLE_TIERS; i++) downsample_Initialize(&Downsample_Tiers[i], Downsample_Windows[i], 0);
+  deadband_Initialize(&Deadbands[0], DEADBAND_MILLIVOLTS);
+  deadband_Initialize(&Deadbands[1], DEADBAND_MILLIAMPS);
+  deadband_Initialize(&Deadbands[2], DEADBAND_MICROWATTS);
+  #ifdef BURST_CAPTURE
+  burst_SetTrigger(0, COUNTS_FROM_MV(BURST_BATTERY_BELOW_MV), 0, 0);
+  burst_SetTrigger(1, 0, COUNTS_FROM_MA(BURST_LOAD_ABOVE_MA), COUNTS_FROM_MA(BURST_LOAD_STEP_MA));
+  burst_Initialize();
+  ADC_SamplerStart(ADC_Channels, sizeof(ADC_Channels), ADC_OVERSAMPLE_BITS, ADC_FREE_RUNNING); // Never stops, readings are taken from the stream
+  #endif
   PIN_SET_AS_INPUT(PIN_Button_1);
   PIN_SET_AS_INPUT(PIN_Button_2);
   
@@ -295,13 +557,23 @@ void setup() {
   //PCMSK0 |= (1<<PCINT0);   // Enable the mask bits for PCINT0
   //PCMSK2 |= (1<<PCINT23);   // Enable the mask bit for PCINT23
 
-  PCICR |= (1<<PCIE0);    // Enable PCINT0 and PCINT2 vector (PCINT23 pin / Button 1) (Had these as defines but it gets screwy because of PCINT23)
-  PCMSK0 |= (1<<PCINT0) | (1<<PCINT1);   // Enable the mask bits for PCINT0
+  button_Initialize(&Button_1, _BV(PB1), PINB); // PIN_Button_1
+  button_Initialize(&Button_2, _BV(PB0), PINB); // PIN_Button_2
+  PCICR |= (1<<PCIE0);    // Enable the PCINT0 vector (PCINT0-7, port B). Both buttons are in this group.
+  PCMSK0 |= (1<<PCINT0) | (1<<PCINT1);   // Enable the mask bits for PB0 (Button 2) and PB1 (Button 1)
+  PCICR |= (1<<PCIE2);    // PCINT16 (RXD) vector, its mask bit is only set while powered down
+  offload_Initialize(&Offload_Host);
+  powerfail_Initialize(); // Comparator interrupt when the supply rail (PD7) drops (or INT0 with POWERFAIL_INT0)
+  journal_Initialize(); // Picks up where the EEPROM journal left off, anything not replayed waits for the card
   //PCMSK2 |= (1<<PCINT23);   // Enable the mask bit for PCINT23
  
   // Enable global interrupts (starts the 1ms timer)
   sei();          // Enable interrupts
 
+  #ifdef TICKLESS_IDLE
+  sleep_CalibrateWatchdog(); // Watchdog oscillator is ~10% off, measure it so long sleeps stay on schedule
+  #endif
+
   //state_SetNext(none); // actually handled above by the state = START_PROGRAM_IN_THIS_STATE;
   watchdog_feed();
   //logentry++; Serial.print(logentry); Serial.println("%d - Entering Main Loop...",logentry);
@@ -313,6 +585,7 @@ void setup() {
   //Serial.println(time);
 
   Serial.println(VERSION);
+  if (journal_Pending()) TRACE_INFO_VALUE(trace_Journal_Pending, journal_Pending());
   //InitializeSDCard();
   
   while(1)
@@ -321,9 +594,28 @@ void setup() {
     events_Handler();   // Check and act on any events
     state_Handler();    // Call relevant functions for the current state
     state_Transition();   // Transition to a new state if relevant
+    Offload_Poll();       // Host frames, and the file streams they ask for
     watchdog_feed();    // Watchdog timer resets (but not the count)
     watchdog_entertain(); // Re-enables the interrupt bit (so it doesn't reset but instead interrupts)
+    Trace_Drain();        // Diagnostics out, as much as fits without waiting
+    #ifdef TICKLESS_IDLE
+    unsigned short deadline = events_NextDeadline();
+    if (trace_IsPending() || ADC_SamplerIsBusy() || journal_IsBusy()) { deadline = min(deadline, SLEEP_POWER_DOWN_MIN_MS - 1); } // UART, ADC and EEPROM interrupts don't run in power down, idle until they're done
+    if ((state == offload) || ((event_Now() - Offload_Heard_At) < OFFLOAD_LISTEN_MS)) { deadline = min(deadline, SLEEP_POWER_DOWN_MIN_MS - 1); } // A host is talking, the UART can't receive in power down
+    if (Card_Is_Ready && !powerfail_WakesFromPowerDown()) { deadline = min(deadline, POWER_FAIL_SLEEP_MS); } // A trip is only seen once awake, keep the lag inside POWER_FAIL_BUDGET_US
+    if (deadline >= SLEEP_POWER_DOWN_MIN_MS) { // UART stops in power down, finish sending first and wake on the RX pin instead
+      Serial.flush();
+      PCIFR = (1<<PCIF2);
+      PCMSK2 |= (1<<PCINT16);
+    }
+    Sleep_Started_At = event_Now();
+    unsigned short slept = sleep_UntilDeadline(deadline); // Sleep until the next event
+    events_Advance(slept); // Credit the time the 1ms tick missed
+    if (slept && powerfail_IsPending() && !powerfail_WakesFromPowerDown()) { powerfail_Backdate(slept * 1000UL); } // Tripped while powered down, micros() stood still: count from the worst case
+    button_ShiftTimes(Buttons, 2, Sleep_Started_At, slept); // Edges that woke us were stamped with the clock still behind
+    #else
     _delay_ms(MAIN_LOOP_INTERVAL);     // 5ms keeps the program from cycling too fast but isn't necessarily what it is set to
+    #endif
   }
 }
 
@@ -331,10 +623,21 @@ void setup() {
 
 
 
+// Sends what the UART can take right now of the queued diagnostics (the TX interrupt does the rest)
+void Trace_Drain( void )
+{
+  int c;
+  if (state == offload) return; // The line carries frames, diagnostics wait (or drop) until it's done
+  while ((Serial.availableForWrite() > 0) && ((c = trace_NextByte()) >= 0)) {
+    Serial.write((uint8_t)c);
+  }
+}
+
+
 void OpenAndWaitForSerialPort( void )
 {
   // Open serial communications and wait for port to open:
-  Serial.begin(9600);
+  Serial.begin(SERIAL_BAUD);
   while (!Serial) {
     ; // wait for serial port to connect. Needed for native USB port only
   }
@@ -343,35 +646,85 @@ void OpenAndWaitForSerialPort( void )
 
 void InitializeSDCard( void )
 {
-   //if(root.isOpen()) root.close();
-  Serial.print("Init SD card... ");
-  if (!SD.begin(4)) {
-    Serial.println("init failed!");
+  struct a_raw_record last;
+  struct a_journal_entry newest;
+  sd_mount_t mount;
+  uint32_t started = micros();
+  bool warm = false;
+
+  if (!journal_IsBusy() && mountcache_Load(&mount, sizeof(mount))) {
+    warm = SD.beginWarm(SD_CHIP_SELECT_PIN, &mount); // Same card, powered since: no init wait, no MBR/BPB reads
+  }
+  if (!warm) {
+    if (!SD.beginAdaptive(SD_CHIP_SELECT_PIN, Card_First_Rate, SD_KEEP_CRC)) {
+      Card_Is_Ready = false;
+      TRACE_ERROR(trace_SD_Init_Failed);
+      Red_LED_Flash();
+      return;
+    }
+    TRACE_INFO_VALUE(trace_SD_Sck_Rate, SD.sckRate());
+    if (!journal_IsBusy()) { // Skipped while the journal writes, next mount tries again
+      cardrate_Remember(&Card_Cid, SD.sckRate()); // Next boot starts here
+      if (SD.mountRecord(&mount)) mountcache_Save(&mount, sizeof(mount));
+    }
+    TRACE_INFO_VALUE(trace_SD_Mount_Us, micros() - started);
+  } else {
+    TRACE_INFO_VALUE(trace_SD_Mount_Warm_Us, micros() - started);
+  }
+  if (!blocklog_Open(&Raw_Log, SD.rootDirectory(), RAW_FILE, RAW_INDEX_FILE, RAW_LOG_BLOCKS)) {
+    Card_Is_Ready = false; // Raw records keep going to the journal
+    TRACE_ERROR(trace_Raw_Open_Failed);
     Red_LED_Flash();
     return;
   }
-  Serial.println("init done.");
+  TRACE_INFO_VALUE(trace_Raw_Blocks, blocklog_Blocks(&Raw_Log));
+  Raw_Last_Time = 0;
+  if (blocklog_Last(&Raw_Log, &last, sizeof(last))) {
+    Raw_Last_Time = last.time;
+    if (!Log_Time_Is_Set) Log_Time_Offset = last.time + 1; // Readings since the reset start from 0
+  }
+  if (!Log_Time_Is_Set) { // Past the newest journaled record too, it goes on the card before them
+    if (journal_Newest(&newest) && (newest.type == JOURNAL_TYPE_RAW)) {
+      memcpy(&last, newest.payload, sizeof(last));
+      if (last.time >= Log_Time_Offset) Log_Time_Offset = last.time + 1;
+    }
+    Log_Time_Is_Set = true; // Records journaled before this (JOURNAL_TYPE_RAW_UNTIMED) get it added at replay
+  }
+  Card_Is_Ready = true; // The journal replays from the event handler now
+  event_Cancel(&event_CardRecover); // Mounted afresh, nothing to bring back
+  TRACE_INFO(trace_SD_Init_Done);
   Green_LED_Flash();
 }
 
 
+// Where SD.beginAdaptive() starts the rate search for this card: the rate it got last time, full speed for a new one
+uint8_t Card_First_Rate( const cid_t *cid )
+{
+  uint8_t rate = CARDRATE_UNKNOWN;
+
+  Card_Cid = *cid;
+  if (!journal_IsBusy()) rate = cardrate_Lookup(cid);
+  return (rate == CARDRATE_UNKNOWN) ? SPI_FULL_SPEED : rate;
+}
+
+
 void AppendToFile( void )
 {
+  if (powerfail_IsPending()) return; // Card is being shut down
   // open the file. note that only one file can be open at a time,
   // so you have to close this one before opening another.
   myFile = SD.open("test.txt", FILE_WRITE);
 
   // if the file opened okay, write to it:
   if (myFile) {
-    Serial.print("Writing to test.txt...");
     myFile.println("test 1, 2, 3.");
     // close the file:
     myFile.close();
-    Serial.println("done.");
+    TRACE_INFO(trace_File_Written);
     Green_LED_Flash();
   } else {
     // if the file didn't open, print an error:
-    Serial.println("error opening test.txt");
+    TRACE_ERROR(trace_File_Open_Failed);
     Red_LED_Flash();
   }
 }
@@ -392,7 +745,7 @@ void ReadToConsoleFromFile( void )
     myFile.close();
   } else {
     // if the file didn't open, print an error:
-    Serial.println("error opening test.txt");
+    TRACE_ERROR(trace_File_Open_Failed);
   }
 }
 
@@ -421,11 +774,46 @@ void loop() {
 void events_Tick(){
     event_Tick(&event_Test);
     event_Tick(&event_ChangeStateAfterDelay);
-    event_Tick(&event_ReadDataFromDevice);
     event_Tick(&event_ButtonDebounce);
+    event_Tick(&event_ButtonHold);
     event_Tick(&event_BlinkLEDs);
     event_Tick(&event_RedLEDOff);
     event_Tick(&event_GreenLEDOff);
+    event_Tick(&event_CardRecover);
+}
+
+// Credits each event with ms that passed without the 1ms tick (powered down)
+void events_Advance(unsigned short ms){
+    if (ms == 0) return;
+    event_ClockAdvance(ms);
+    cli(); // The 1ms ISR ticks these too
+    event_Advance(&event_Test, ms);
+    event_Advance(&event_ChangeStateAfterDelay, ms);
+    event_Advance(&event_ButtonDebounce, ms);
+    event_Advance(&event_ButtonHold, ms);
+    event_Advance(&event_BlinkLEDs, ms);
+    event_Advance(&event_RedLEDOff, ms);
+    event_Advance(&event_GreenLEDOff, ms);
+    event_Advance(&event_CardRecover, ms);
+    sei();
+}
+
+// Returns ms until the next active event is due (EVENT_NOT_PLANNED if none are)
+unsigned short events_NextDeadline( void ){
+    unsigned short next = EVENT_NOT_PLANNED;
+    next = min((uint32_t)next, event_PeriodicTimeRemaining(&event_ReadDataFromDevice));
+    cli();
+    next = min(next, event_TimeRemaining(&event_Test));
+    next = min(next, event_TimeRemaining(&event_ChangeStateAfterDelay));
+    next = min(next, event_TimeRemaining(&event_ButtonDebounce));
+    next = min(next, event_TimeRemaining(&event_ButtonHold));
+    next = min(next, event_TimeRemaining(&event_BlinkLEDs));
+    next = min(next, event_TimeRemaining(&event_RedLEDOff));
+    next = min(next, event_TimeRemaining(&event_GreenLEDOff));
+    next = min(next, event_TimeRemaining(&event_CardRecover));
+    sei();
+    if (state_is_fresh || status_change) next = 0; // State work pending, don't sleep
+    return next;
 }
 
 void LogCCDataToSDCard( void );
@@ -436,12 +824,12 @@ void LogCCDataToSDCard( void )
 
   
   //_delay_ms(500);
-  Serial.println("CC Data retrieved. [ <- Sim ]"); // Put here something that gets the data (have to have error check everywhere so this is likely to be split up)
+  TRACE_DEBUG(trace_CC_Data_Retrieved); // Put here something that gets the data (have to have error check everywhere so this is likely to be split up)
   //_delay_ms(500);
   InitializeSDCard();
   AppendToFile();
   //_delay_ms(500);
-  Serial.println("CC data written to SD Card. [ <- Sim ]"); // Put here something that writes it, including compression if the compression flagi s on. make that flag.
+  TRACE_DEBUG(trace_CC_Data_Written); // Put here something that writes it, including compression if the compression flagi s on. make that flag.
   //_delay_ms(500);
   
 }
@@ -450,12 +838,16 @@ void state_Recording( void )
 {
   // Delete this line once there is no way anything can get stuck in this function (e.g. have proper error handling)
   
-  logentry++; Serial.print(logentry); Serial.println(" - In state_Recording( void ). ");
+  TRACE_INFO(trace_In_Recording);
   
   // REDO THIS WITH ERROR HANDLING
   LogCCDataToSDCard();
+  if (Card_Is_Ready) TRACE_INFO_VALUE(trace_Raw_Erased, blocklog_Erase(&Raw_Log)); // Appends go into erased blocks
+  Raw_Write_Max_Us = 0;
+  Raw_Write_Slow = 0;
+  Raw_Dropped = 0;
   
-  Serial.println("Setting sleeping state... [ <- Sim ]");
+  TRACE_DEBUG(trace_Setting_Sleep);
   
   state_SetNext(sleep_until_next_recording);
 }
@@ -467,25 +859,27 @@ void state_Handler()
 {  
    if (state_is_fresh || status_change){
     state_is_fresh = false;
-    logentry++; Serial.print(logentry); Serial.print(" - In state_Handler() for: ");
      switch(state) {
       case home:
-        Serial.println("home");
+        TRACE_INFO(trace_State_Home);
         state_Home(); break;
       case recording:
-        Serial.println("record");
+        TRACE_INFO(trace_State_Recording);
         state_Recording(); break;
       case stop_recording:
-        Serial.println("stop_recording");
+        TRACE_INFO(trace_State_Stop_Recording);
         state_Stop_recording(); break;
       case sleep_until_next_recording:
-        Serial.println("sleep_until_next_recording");
+        TRACE_INFO(trace_State_Sleep);
         state_Sleep_until_next_recording(); break;
       case format_card:
-        Serial.println("format_card");
+        TRACE_INFO(trace_State_Format_Card);
         state_Format_card(); break;
+      case offload:
+        TRACE_INFO(trace_State_Offload);
+        state_Offload(); break;
       case none:
-        Serial.println("none");
+        TRACE_INFO(trace_State_None);
         break;
       default: break;
      }
@@ -493,54 +887,54 @@ void state_Handler()
    }
 }
 
-bool Next_Button_Set_Is_Valid = true;
-bool Both_Buttons_Were_Held = false;
 // Handles the transitions between states based upon current system inputs and states
 void state_Transition()
 {
-  if((Button1_Is_Actively_Pressed == false) && (Button2_Is_Actively_Pressed == false))// && (Both_Buttons_Were_Held == true))
+  if ((state == none) && (Button_Gesture == gesture_hold_1))
+    {
+      state_SetNext(recording);
+      TRACE_INFO(trace_None_To_Recording);
+      Button_Gesture = gesture_none;
+      return;
+    }
+
+  if ((state == sleep_until_next_recording) && (Button_Gesture == gesture_hold_2))
     {
-      Next_Button_Set_Is_Valid = true;
-      Both_Buttons_Were_Held = false;
-      //return;
+      state_SetNext(stop_recording);
+      TRACE_INFO(trace_Sleep_To_Stop_Recording);
+      Button_Gesture = gesture_none;
+      return;
     }
-    
-   if((Button1_Is_Actively_Pressed == true) && (Button2_Is_Actively_Pressed == true))// && (Both_Buttons_Were_Held == true))
+
+  #ifdef BURST_CAPTURE
+  if ((state == sleep_until_next_recording) && (Button_Gesture == gesture_hold_1))
     {
-      Both_Buttons_Were_Held = true;
-      //Next_Button_Set_Is_Valid = false;
-      //return;
+      burst_Trigger(1);
+      TRACE_INFO(trace_Burst_Manual);
+      Button_Gesture = gesture_none;
+      return;
     }
-  
-  if ((state == none) && (Button1_Is_Actively_Pressed == true) && (Button1_HeldTime > BOTH_PRESSED_IF_WITHIN) && (Button2_Is_Actively_Pressed == false) && (Next_Button_Set_Is_Valid == true) && (Both_Buttons_Were_Held == false))
+  #endif
+
+  if ((state == none) && (Button_Gesture == gesture_hold_2))
     {
-      state_SetNext(recording);
-      //Button1 = false; // If you only check if actively pressed, you can press both and then keep holding one to trigger antoher state. This forces unpressing a button before triggering another state.
-      //Button2 = false;
-      logentry++; Serial.print(logentry); Serial.println(" - State 'none' -> 'recording'.");
-      Next_Button_Set_Is_Valid = false;
+      state_SetNext(offload); // Host tool started with --button, already at OFFLOAD_BAUD
+      Button_Gesture = gesture_none;
       return;
     }
 
-  if ((state == sleep_until_next_recording) && (Button2_Is_Actively_Pressed == true) && (Button2_HeldTime > BOTH_PRESSED_IF_WITHIN) && (Button1_Is_Actively_Pressed == false) && (Next_Button_Set_Is_Valid == true) && (Both_Buttons_Were_Held == false))
+  if ((state == offload) && (Button_Gesture == gesture_hold_2))
     {
-      state_SetNext(stop_recording);
-      //Button1 = false; // If you only check if actively pressed, you can press both and then keep holding one to trigger antoher state. This forces unpressing a button before triggering another state.
-      //Button2 = false;
-      logentry++; Serial.print(logentry); Serial.println(" - State 'sleep_until_next_recording' -> 'stop_recording'.");
-      Next_Button_Set_Is_Valid = false;
+      Offload_Leave();
+      Button_Gesture = gesture_none;
       return;
     }
 
-  long heldtime_difference = Button1_HeldTime > Button2_HeldTime ? Button1_HeldTime - Button2_HeldTime : Button2_HeldTime - Button1_HeldTime; // basically absolute value of difference between held times.
-  if ((state == none) && (Button1_Is_Actively_Pressed == true) && (Button2_Is_Actively_Pressed == true) && (heldtime_difference <= BOTH_PRESSED_IF_WITHIN) && (Button1_HeldTime > BOTH_PRESSED_IF_WITHIN) && (Button2_HeldTime > BOTH_PRESSED_IF_WITHIN) && (Next_Button_Set_Is_Valid == true))
+  if ((state == none) && (Button_Gesture == gesture_hold_both))
     {
-      //Button1 = false; // If you only check if actively pressed, you can press both and then keep holding one to trigger antoher state. This forces unpressing a button before triggering another state.
-      //Button2 = false;
-      logentry++; Serial.print(logentry); Serial.println(" - Both buttons pressed.");
-      Next_Button_Set_Is_Valid = false;
+      TRACE_INFO(trace_Both_Buttons_Pressed);
+      Button_Gesture = gesture_none;
       state_SetNext(format_card);
-      //Both_Buttons_Were_Held = true;
       return;
     }
 
@@ -595,22 +989,40 @@ void events_Handler_HighPriority( void )
 }
 
 void events_Handler( void ){
+
+    if (powerfail_IsPending()) PowerFail_Shutdown(); // Doesn't return
   
     if (event_IsReady(&event_Test)){
+        #ifdef LIGHTS_ON_BUTTONS
         event_Start(&event_Test); // Start the event count over (So it can start to count down while the remaining code is executed)
+        #endif
         event_Test_function();
     }
 
-    if (event_IsReady(&event_ReadDataFromDevice)){
-        event_Start(&event_ReadDataFromDevice); // Start the event count over (So it can start to count down while the remaining code is executed)
+    if (event_PeriodicIsReady(&event_ReadDataFromDevice)){ // Stays planned, next deadline is one period after the last (no drift)
         ReadDataFromDevice();
     }
 
-    if (event_IsReady(&event_ButtonDebounce)){
-        event_Start(&event_ButtonDebounce);
+    Measurements_Collect();
+
+    if (event_IsReady(&event_CardRecover)){ // A write failed, the card gets another try
+        Card_Recover();
+    }
+
+    if (Card_Is_Ready && journal_Pending() && !journal_IsBusy()) Journal_ReplayOne(); // One per pass, the EEPROM mark takes ~3.4ms
+
+    #ifdef BURST_CAPTURE
+    if (burst_IsReady()) Burst_Write(); // Frozen until written, so it can wait its turn
+    #endif
+
+    if (event_IsReady(&event_ButtonDebounce)){ // Pins have been quiet for BUTTON_DEBOUNCE_INTERVAL, restarted by every pin change
         ButtonHandler();
     }
 
+    if (event_IsReady(&event_ButtonHold)){ // The newest press is old enough to be a hold
+        ButtonGestures();
+    }
+
     if (event_IsReady(&event_BlinkLEDs)){
         event_Start(&event_BlinkLEDs);
         BlinkLEDs();
@@ -705,11 +1117,12 @@ void GetSettingsFromEEPROM()
 
 
 // TIMER2 is set up as a 1ms timer
-ISR(TIMER2_COMPA_vect, ISR_NOBLOCK) {
+// Not ISR_NOBLOCK: the pin change ISR reads event_Clock, so it can't land in the middle of the increment
+ISR(TIMER2_COMPA_vect) {
+    sleep_Tick();
+    event_ClockTick();
     events_Tick();
     events_Handler_HighPriority();
-    if(Button1_Is_Actively_Pressed == true) { Button1_HeldTime++; Button1_HeldTime_Latest = Button1_HeldTime; }
-    if(Button2_Is_Actively_Pressed == true) { Button2_HeldTime++; Button2_HeldTime_Latest = Button2_HeldTime; }
 }
 
 
@@ -720,22 +1133,52 @@ ISR(WDT_vect) {
   //  LED_green(TURN_ON);
   //#endif
   //Serial.println("Watchdog Timer Triggered");
+  sleep_WatchdogInterrupt(); // Also wakes us from a tickless power down
 }
 
-// PCINT23_vect is an interrupt on PD7 (Button 1)
-//ISR(PCINT23_vect)
-// PCINT1_vect is an interrupt on PB1 (Button 1)
-ISR(PCINT1_vect)
+// ADC conversion done, the sampler accumulates it and moves to the next channel
+ISR(ADC_vect)
 {
-    Button1_Was_Pressed_With_Interrupt = true;
-    ButtonActivity = true;
+    if (ADC_SamplerInterrupt()) { // A result finished
+        #ifdef BURST_CAPTURE
+        Burst_Sample();
+        #endif
+    }
+}
+
+// EEPROM ready for the next journal byte
+ISR(EE_READY_vect)
+{
+    journal_Interrupt();
+}
+
+// Supply failing: stop acquiring, the main loop finishes the card write in flight and shuts down
+#ifdef POWERFAIL_INT0
+ISR(INT0_vect)
+#else
+ISR(ANALOG_COMP_vect)
+#endif
+{
+    powerfail_Interrupt(micros());
+    ADC_SamplerHalt(); // No waiting in here, PowerFail_Shutdown() lets the last conversion finish
+    event_PeriodicCancel(&event_ReadDataFromDevice);
+    sleep_WakeUp();
+}
+
+// PCINT0_vect covers PCINT0-7 (port B), so both buttons: PB0 (Button 2) and PB1 (Button 1)
+// RX pin changed while powered down: a host is talking. Once is enough, the main loop stays awake to listen.
+ISR(PCINT2_vect)
+{
+    PCMSK2 &= ~(1<<PCINT16); // Every edge of every byte would land here otherwise
+    Serial_Woke = true;
+    sleep_WakeUp();
 }
 
-// PCINT0_vect is an interrupt on PB0 (Button 2)
 ISR(PCINT0_vect)
 {
-    Button2_Was_Pressed_With_Interrupt = true;
-    ButtonActivity = true;
+    button_QueueEdge(PINB, event_Clock); // Timestamp now, debounce once the pins are quiet
+    event_Start(&event_ButtonDebounce);  // Every edge restarts the debounce wait
+    sleep_WakeUp();
 }
 
 
@@ -744,122 +1187,408 @@ void ReadDataFromDevice( void )
   // Read data from device
   // Write data to card
   // Be done with it all
-  //logentry++; Serial.print(logentry); Serial.println(" - Tick - One Second\n");
-  //logentry++; Serial.print(logentry); //Serial.println(" - Tick - One Second\n");
-  //Serial.print("\tButton 1 - ");
-  //Serial.print(Button1_Was_Pressed_With_Interrupt);
-  //Serial.print("\t\t\tButton 2 - ");
-  //Serial.println(Button2_Was_Pressed_With_Interrupt);
-  
+  Sample_Time = event_ReadDataFromDevice.last_deadline; // Timestamp with when it was due, not when we got to it
+  Reading_Pending = true;
+  if (!ADC_SamplerIsBusy()) { // Not already streaming (BURST_CAPTURE)
+    ADC_SamplerStart(ADC_Channels, sizeof(ADC_Channels), ADC_OVERSAMPLE_BITS, ADC_ONE_PASS); // Results come in from the ADC ISR
+  }
 }
 
 
+// Takes finished ADC results into the latest measurements
+void Measurements_Collect( void )
+{
+  struct an_adc_sample sample;
+  while (ADC_SamplerRead(&sample)) {
+    switch (sample.channel) {
+      case ADC_CHANNEL_BATTERY: Battery_Raw = sample.value; break;
+      case ADC_CHANNEL_SHUNT:   Shunt_Raw = sample.value; break;
+      default: break;
+    }
+    if (sample.channel == ADC_CHANNEL_SHUNT && Reading_Pending) { // Last in the pass, both are fresh
+      Reading_Pending = false;
+      Battery_Millivolts = measure_Convert(&Measure_Battery, Battery_Raw) - measure_Convert(&Measure_Shunt, Shunt_Raw);
+      Load_Milliamps = measure_Convert(&Measure_Load_Current, Shunt_Raw);
+      Load_Microwatts = measure_Power(Battery_Millivolts, Load_Milliamps);
+      accumulate_Add(&Acc_Battery_Millivolts, Battery_Millivolts, Sample_Time);
+      accumulate_Add(&Acc_Load_Milliamps, Load_Milliamps, Sample_Time);
+      accumulate_Add(&Acc_Load_Microwatts, Load_Microwatts, Sample_Time);
+      if (accumulate_WindowIsDone(&Acc_Load_Milliamps, Sample_Time)) Summary_Write();
+      Downsample_Write();
+    }
+  }
+}
 
-void ButtonHandler( void )
+
+// Closes the accumulator windows and appends their summaries to SUMMARY_FILE
+void Summary_Write( void )
 {
+  struct a_summary_record record;
+  accumulate_Summarize(&Acc_Battery_Millivolts, &record.millivolts, Sample_Time);
+  accumulate_Summarize(&Acc_Load_Milliamps, &record.milliamps, Sample_Time);
+  accumulate_Summarize(&Acc_Load_Microwatts, &record.microwatts, Sample_Time);
+  accumulate_NextWindow(&Acc_Battery_Millivolts, Sample_Time);
+  accumulate_NextWindow(&Acc_Load_Milliamps, Sample_Time);
+  accumulate_NextWindow(&Acc_Load_Microwatts, Sample_Time);
+  if (powerfail_IsPending() || !Card_Is_Ready) return; // Card is being shut down, or not mounted (not recording)
+
+  File summary = SD.open(SUMMARY_FILE, FILE_WRITE);
+  if (summary && (summary.write((const uint8_t *)&record, sizeof(record)) == sizeof(record)) && summary.sync()) {
+    Card_Recover_Wait = CARD_RECOVER_FIRST_MS;
+  } else {
+    Card_Is_Ready = false; // As Raw_Write(): raw appends may be minutes apart, this one brings the card back
+    TRACE_ERROR(trace_Summary_Write_Failed);
+    Card_Recover_Start();
+  }
+  if (summary) summary.close();
+}
 
-  Button1P = false;
-  Button2P = false;
 
-    if(PIN_READ(PIN_Button_1) == 1){
-      Button1P = true;
-    }
-    if(PIN_READ(PIN_Button_2) == 1){
-      Button2P = true;
+// Appends the latest reading to RAW_FILE, and any tier windows it finished to their own files
+void Downsample_Write( void )
+{
+  struct a_raw_record raw;
+  uint8_t tier;
+  File file;
+
+  // Windows that ended before this reading go out first, finest first so each one is merged up before the next is checked
+  while ((tier = downsample_Closing(Downsample_Tiers, DOWNSAMPLE_TIERS, Sample_Time)) != DOWNSAMPLE_NONE) {
+    if (powerfail_IsPending()) return; // Card is being shut down
+    if (Card_Is_Ready) { // Not mounted (not recording): merged up all the same, just not logged
+      file = SD.open(Downsample_Files[tier], FILE_WRITE);
+      if (file && (file.write((const uint8_t *)&Downsample_Tiers[tier].record, sizeof(struct a_downsample_record)) == sizeof(struct a_downsample_record))
+          && file.sync()) {
+        Card_Recover_Wait = CARD_RECOVER_FIRST_MS;
+      } else {
+        Card_Is_Ready = false; // Recovered as a raw append failure
+        TRACE_ERROR_VALUE(trace_Tier_Write_Failed, tier);
+        Card_Recover_Start();
+      }
+      if (file) file.close();
     }
+    downsample_Close(Downsample_Tiers, DOWNSAMPLE_TIERS, tier, Sample_Time); // Merged up even if the write failed, the coarser tiers stay whole
+  }
 
-  // Button 1
-  if(Button1P == true && Button1_Is_Actively_Pressed == false){
-    Button1_Debounce_Times++;
-    //StopDebouncing = false;
-    if(Button1_Debounce_Times >= BUTTON_DEBOUNCE_REPEAT_TIMES){
-      Button1 = true;
-      //Button1_Press_Has_Been_Used = false;
-      Button1_Is_Actively_Pressed = true;
-      Button1_Debounce_Times = 0;
-    }
+  raw.time = Sample_Time + Log_Time_Offset;
+  raw.values[0] = Battery_Millivolts;
+  raw.values[1] = Load_Milliamps;
+  raw.values[2] = Load_Microwatts;
+  downsample_Add(&Downsample_Tiers[0], raw.values); // The aggregates see every reading, logged or not
+
+  if (!Adaptive_Update(raw.values)) return;
+  Raw_Write(&raw);
+}
+
+
+// A write failed: trace what kind of failure (Sd2Card::errorClass()) and schedule the first try at bringing the card
+// back. The driver has already retried CRC failures, so whatever got this far needs the card re-initialized. The wait
+// keeps its backoff: a card that comes back only to fail again isn't hammered, the next good write resets it.
+void Card_Recover_Start( void )
+{
+  TRACE_ERROR_VALUE(trace_SD_Error_Class, SdVolume::sdCard()->errorClass());
+  event_Initialize(&event_CardRecover, Card_Recover_Wait);
+  event_Start(&event_CardRecover);
+}
+
+
+// One try at bringing the card back under the same mount (SD.recover()), at most ~2 x CARD_RECOVER_STEP_MS so readings
+// stay on time. RAW_FILE, the volume cache and the cluster bookkeeping carry on as they were, the journal then replays
+// what piled up meanwhile. Failed tries back off doubling up to CARD_RECOVER_MAX_MS, a card still initializing is
+// polled every CARD_RECOVER_FIRST_MS. A different card in the socket waits for the next recording start to mount it.
+void Card_Recover( void )
+{
+  if (powerfail_IsPending()) return; // Card is being shut down
+  switch (SD.recover(CARD_RECOVER_STEP_MS)) {
+    case SD_RECOVER_DONE:
+      Card_Is_Ready = true; // The journal replays from the event handler now
+      TRACE_INFO_VALUE(trace_SD_Recovered, SD.sckRate());
+      Green_LED_Flash();
+      return;
+    case SD_RECOVER_BUSY:
+      event_Initialize(&event_CardRecover, CARD_RECOVER_FIRST_MS);
+      break;
+    case SD_RECOVER_OTHER_CARD:
+      TRACE_ERROR(trace_SD_Other_Card);
+      Red_LED_Flash();
+      return;
+    default:
+      Card_Recover_Wait = (Card_Recover_Wait > CARD_RECOVER_MAX_MS / 2) ? CARD_RECOVER_MAX_MS : Card_Recover_Wait * 2;
+      TRACE_ERROR_VALUE(trace_SD_Recover_Failed, Card_Recover_Wait);
+      event_Initialize(&event_CardRecover, Card_Recover_Wait);
+      break;
   }
-  if(Button1P == false && Button1_Is_Actively_Pressed == true){
-    Button1_Debounce_Times++;
-    if(Button1_Debounce_Times >= BUTTON_DEBOUNCE_REPEAT_TIMES){
-      Button1_Is_Actively_Pressed = false;
-      Button1_Debounce_Times = 0;
-    }
-  }  
-  if(Button1P == true && Button1_Is_Actively_Pressed == true){
-    Button1_Debounce_Times = 0;
-    //Button1_HeldTime++;
-  }
-  if(Button1P == false && Button1_Is_Actively_Pressed == false){
-    Button1_Debounce_Times = 0;
-    if(Button1_HeldTime > 0){
-      logentry++; Serial.print(logentry); Serial.print(" - B1 millis = "); Serial.println(Button1_HeldTime);
-      Button1_HeldTime_Latest = Button1_HeldTime;
+  event_Start(&event_CardRecover);
+}
+
+
+// Appends a raw record to RAW_FILE. If the card can't take it (not mounted, write failed, power failing) or older
+// records are still in the journal (they go first, so RAW_FILE stays in order) it goes to the EEPROM journal instead,
+// during a recording session only.
+void Raw_Write( const struct a_raw_record *raw )
+{
+  uint32_t started, took;
+  bool ok;
+
+  if (Card_Is_Ready && !powerfail_IsPending() && !journal_Pending()) {
+    if (blocklog_IsFull(&Raw_Log, sizeof(*raw))) { // Not a card failure, and the journal couldn't replay it either
+      Raw_Dropped++;
+      return;
     }
-    Button1_HeldTime = 0;
-  } 
-
-  // Button 2
-  if(Button2P == true && Button2_Is_Actively_Pressed == false){
-    Button2_Debounce_Times++;
-    if(Button2_Debounce_Times >= BUTTON_DEBOUNCE_REPEAT_TIMES){
-      Button2 = true;     // Are these used? they have to be manually unused.
-      //Button2_Press_Has_Been_Used = false;
-      Button2_Is_Actively_Pressed = true;
-      Button2_Debounce_Times = 0;
+    started = micros();
+    ok = blocklog_Append(&Raw_Log, raw, sizeof(*raw));
+    took = micros() - started;
+    if (took > Raw_Write_Max_Us) Raw_Write_Max_Us = took;
+    if (took > RAW_WRITE_SLOW_US && Raw_Write_Slow < 0xFFFF) Raw_Write_Slow++;
+    if (ok) {
+      Raw_Last_Time = raw->time;
+      Card_Recover_Wait = CARD_RECOVER_FIRST_MS;
+      return;
     }
+    Card_Is_Ready = false; // Journal until the card is back
+    TRACE_ERROR(trace_Raw_Write_Failed);
+    Card_Recover_Start();
   }
-  if(Button2P == false && Button2_Is_Actively_Pressed == true){
-    Button2_Debounce_Times++;
-    if(Button2_Debounce_Times >= BUTTON_DEBOUNCE_REPEAT_TIMES){
-      Button2_Is_Actively_Pressed = false;
-      Button2_Debounce_Times = 0;
-    }
-  }  
-  if(Button2P == true && Button2_Is_Actively_Pressed == true){
-    Button2_Debounce_Times = 0;
-    //Button2_HeldTime++;
-  }
-  if(Button2P == false && Button2_Is_Actively_Pressed == false){
-    Button2_Debounce_Times = 0;
-    if(Button2_HeldTime > 0){
-      logentry++; Serial.print(logentry); Serial.print(" - B2 millis = "); Serial.println(Button2_HeldTime);
-      Button2_HeldTime_Latest = Button2_HeldTime;
+  if ((state != recording) && (state != sleep_until_next_recording)) return; // Not recording: nothing to keep, and no EEPROM wear for it
+  if (!journal_Append(Log_Time_Is_Set ? JOURNAL_TYPE_RAW : JOURNAL_TYPE_RAW_UNTIMED, raw)) TRACE_ERROR(trace_Journal_Full);
+}
+
+
+// Oldest journal record to its file on the card, then marked replayed (the mark is written in the background)
+void Journal_ReplayOne( void )
+{
+  struct a_journal_entry entry;
+  struct a_raw_record raw;
+  File file;
+  bool ok;
+
+  if (powerfail_IsPending() || !journal_Oldest(&entry)) return;
+  switch (entry.type) {
+    case JOURNAL_TYPE_RAW:
+    case JOURNAL_TYPE_RAW_UNTIMED:
+      memcpy(&raw, entry.payload, sizeof(raw));
+      if (entry.type == JOURNAL_TYPE_RAW_UNTIMED) raw.time += Log_Time_Offset; // Taken before the first mount, since the reset
+      if (raw.time <= Raw_Last_Time) raw.time = Raw_Last_Time + 1; // E.g. untimed from before an earlier reset: never back in time
+      if (blocklog_IsFull(&Raw_Log, sizeof(raw))) { // Lost either way, and retrying would hold the journal up for good
+        Raw_Dropped++;
+        journal_MarkReplayed();
+        return;
+      }
+      ok = blocklog_Append(&Raw_Log, &raw, sizeof(raw)) && SdVolume::sdCard()->writeCheck(); // Card status before the mark
+      if (ok) Raw_Last_Time = raw.time;
+      break;
+    case JOURNAL_TYPE_SHUTDOWN:
+      file = SD.open(SHUTDOWN_FILE, FILE_WRITE);
+      ok = file && (file.write(entry.payload, JOURNAL_PAYLOAD_SIZE) == JOURNAL_PAYLOAD_SIZE) && file.sync(); // close() would drop the status
+      if (file) file.close();
+      break;
+    default: journal_MarkReplayed(); return; // Not ours, skip it
+  }
+  if (!ok) {
+    Card_Is_Ready = false; // Stays in the journal, tried again once the card is back
+    TRACE_ERROR(trace_Journal_Replay_Failed);
+    Card_Recover_Start();
+    return;
+  }
+  Card_Recover_Wait = CARD_RECOVER_FIRST_MS;
+  journal_MarkReplayed();
+  if (!journal_Pending()) TRACE_INFO(trace_Journal_Replayed);
+}
+
+
+#ifdef BURST_CAPTURE
+// Pairs the sampler's results into burst samples, from ISR(ADC_vect)
+void Burst_Sample( void )
+{
+  static uint16_t values[BURST_CHANNELS]; // Battery, shunt (ADC_Channels order)
+  if (ADC_SamplerLatest.channel == ADC_CHANNEL_BATTERY) {
+    values[0] = ADC_SamplerLatest.value;
+    return;
+  }
+  values[1] = ADC_SamplerLatest.value;
+  burst_Sample(values, event_Clock); // Shunt comes last in the round, the pair is complete
+}
+
+
+// Appends a finished burst (header, then the samples oldest first) to BURST_FILE and rearms
+void Burst_Write( void )
+{
+  const struct a_burst_sample *samples;
+  uint8_t part, count;
+  bool ok;
+  File file;
+
+  if (powerfail_IsPending()) return; // Card is being shut down
+  file = SD.open(BURST_FILE, FILE_WRITE);
+
+  ok = file && (file.write((const uint8_t *)&burst_Header, sizeof(burst_Header)) == sizeof(burst_Header));
+  for (part = 0; ok && (count = burst_Part(part, &samples)); part++) {
+    ok = (file.write((const uint8_t *)samples, count * sizeof(struct a_burst_sample)) == count * sizeof(struct a_burst_sample));
+  }
+  if (file) file.close();
+  if (ok) {
+    TRACE_INFO_VALUE(trace_Burst_Written, burst_Header.reason);
+  } else {
+    TRACE_ERROR(trace_Burst_Write_Failed);
+  }
+  burst_Arm();
+}
+#endif
+
+
+// Supply is failing. The comparator ISR stopped acquisition, and getting here means the card write that was in flight
+// has finished (every file is closed after each record). Flush the volume cache, leave a marker with the times,
+// then wait for the brown-out. If the supply comes back instead it was a glitch, reset and carry on.
+void PowerFail_Shutdown( void )
+{
+  struct a_shutdown_record record;
+  uint32_t total;
+  uint8_t recovered = 0;
+  bool ok;
+  File file;
+
+  record.stopped_us = powerfail_Elapsed(micros());
+  record.tripped_at = event_Now() - record.stopped_us / 1000;
+  ADC_SamplerStop(); // Halted from the ISR, a conversion in progress (~104us) finishes here
+  SD.flush(); // Nothing normally (close() flushed it), unless a write failed part way
+  record.flushed_us = powerfail_Elapsed(micros());
+  record.budget_us = POWER_FAIL_BUDGET_US;
+  ok = false;
+  if (Card_Is_Ready) {
+    file = SD.open(SHUTDOWN_FILE, FILE_WRITE);
+    ok = file && (file.write((const uint8_t *)&record, sizeof(record)) == sizeof(record)) && file.sync(); // Card status too, close() would drop it
+    if (file) file.close();
+  }
+  if (!ok) { // No card: the marker waits in EEPROM
+    record.flushed_us = 0xFFFFFFFFUL; // Left erased: 13 bytes to write (~24ms) instead of 21
+    record.budget_us = 0xFFFFFFFFUL;
+    journal_Drop(); // A raw record still on its way in gives way, the next slot is already erased
+    while (!(ok = journal_Append(JOURNAL_TYPE_SHUTDOWN, &record)) && journal_IsBusy()); // Behind a replay mark at most (one byte)
+    if (!ok) TRACE_ERROR(trace_Journal_Full);
+    while (journal_IsBusy()); // Written from the EEPROM interrupt, everything else is stopped
+  }
+  total = powerfail_Elapsed(micros());
+
+  LED_RED_OFF;
+  LED_GREEN_OFF;
+  TRACE_INFO_VALUE(trace_Shutdown_Us, total); // Only seen on the bench (USB power), for sizing the supercap
+  if (total > POWER_FAIL_BUDGET_US) {
+    TRACE_ERROR_VALUE(trace_Shutdown_Over_Budget, total);
+  }
+  while ((state != offload) && trace_IsPending()) Trace_Drain(); // Offloading, the line carries frames: the trace stays queued
+  Serial.flush();
+
+  while (recovered < POWER_FAIL_RECOVERED_MS) {
+    recovered = powerfail_SupplyIsLow() ? 0 : recovered + 1;
+    watchdog_feed();
+    _delay_ms(1);
+  }
+  wdt_enable(WDTO_15MS); // Glitch: start over from reset, everything re-initialized
+  while (1);
+}
+
+
+// Whether a raw reading is worth logging: a value left its band, or the heartbeat is due.
+// Readings slow to READ_DATA_INTERVAL_QUIET after ADAPTIVE_QUIET_READINGS in band, back to READ_DATA_INTERVAL on the first change.
+bool Adaptive_Update( const int32_t *values )
+{
+#ifdef ADAPTIVE_SAMPLING
+  bool changed = false;
+  uint8_t i;
+  for (i = 0; i < DOWNSAMPLE_VALUES; i++) {
+    if (deadband_Check(&Deadbands[i], values[i], Sample_Time)) changed = true; // Check them all, each keeps its last sample for the slope
+  }
+
+  if (changed) {
+    Quiet_Readings = 0;
+    if (event_ReadDataFromDevice.period != READ_DATA_INTERVAL) {
+      event_PeriodicSetPeriod(&event_ReadDataFromDevice, READ_DATA_INTERVAL);
+      TRACE_DEBUG_VALUE(trace_Read_Interval, READ_DATA_INTERVAL);
     }
-    Button2_HeldTime = 0;
+  } else if (Quiet_Readings < ADAPTIVE_QUIET_READINGS && ++Quiet_Readings == ADAPTIVE_QUIET_READINGS) {
+    event_PeriodicSetPeriod(&event_ReadDataFromDevice, READ_DATA_INTERVAL_QUIET);
+    TRACE_DEBUG_VALUE(trace_Read_Interval, READ_DATA_INTERVAL_QUIET);
   }
 
-  Button1_Was_Pressed_With_Interrupt = false;
-  Button2_Was_Pressed_With_Interrupt = false;
+  if (!changed && (Sample_Time - Raw_Logged_At) < LOG_HEARTBEAT_MS) {
+    Raw_Skipped++;
+    return false;
+  }
+  for (i = 0; i < DOWNSAMPLE_VALUES; i++) deadband_Logged(&Deadbands[i], values[i]);
+  Raw_Logged_At = Sample_Time;
+#endif
+  return true;
+}
+
 
-//  if(Button1_Is_Actively_Pressed == true && Button2_Is_Actively_Pressed == true)
-//  {
-//    logentry++; Serial.print(logentry); Serial.println(" - 1 & 2 Debounced and Pressed...");
-//    return;
-//  } 
-//  if(Button1_Is_Actively_Pressed == true){
-//    logentry++; Serial.print(logentry); Serial.println(" - 1 Debounced and Pressed...");
-//  }
-//  if(Button2_Is_Actively_Pressed == true){
-//    logentry++; Serial.print(logentry); Serial.println(" - 2 Debounced and Pressed...");
-//  }
 
+// Pins have been quiet for BUTTON_DEBOUNCE_INTERVAL, take the queued edges as presses/releases
+void ButtonHandler( void )
+{
+  bool was_pressed_1 = Button_1.is_pressed;
+  bool was_pressed_2 = Button_2.is_pressed;
+
+  if (!button_ProcessEdges(Buttons, 2)) return; // Only bounces
+
+  if (was_pressed_1 && !Button_1.is_pressed) {
+    TRACE_DEBUG_VALUE(trace_Button_1_Held, Button_1.held_latest);
+  }
+  if (was_pressed_2 && !Button_2.is_pressed) {
+    TRACE_DEBUG_VALUE(trace_Button_2_Held, Button_2.held_latest);
+  }
+
+  if (Button_1.is_pressed || Button_2.is_pressed) {
+    event_Start(&event_ButtonHold); // Look again once the newest press could be a hold
+  } else {
+    event_Cancel(&event_ButtonHold);
+    Button_Gesture_Used = false; // Everything released, the next press can make a gesture
+    Button_Gesture = gesture_none; // Not used while held, don't act on it later
+  }
+  ButtonGestures();
 }
 
 
+// Press, hold and chord detection. Runs when the buttons change and when a press is old enough to be a hold.
+void ButtonGestures( void )
+{
+  uint32_t now = event_Now();
+  uint32_t held1 = button_HeldTime(&Button_1, now);
+  uint32_t held2 = button_HeldTime(&Button_2, now);
+
+  if (Button_Gesture_Used) return;
+
+  if (button_IsChord(&Button_1, &Button_2, BOTH_PRESSED_IF_WITHIN)) {
+    if ((held1 > BOTH_PRESSED_IF_WITHIN) && (held2 > BOTH_PRESSED_IF_WITHIN)) {
+      Button_Gesture = gesture_hold_both;
+      Button_Gesture_Used = true;
+    }
+    return;
+  }
+  if (Button_1.is_pressed && Button_2.is_pressed) {
+    Button_Gesture_Used = true; // Both down but too far apart to be a chord, ignore this press set
+    return;
+  }
+  if (held1 > BOTH_PRESSED_IF_WITHIN) {
+    Button_Gesture = gesture_hold_1;
+    Button_Gesture_Used = true;
+  }
+  if (held2 > BOTH_PRESSED_IF_WITHIN) {
+    Button_Gesture = gesture_hold_2;
+    Button_Gesture_Used = true;
+  }
+}
 
 
 void event_Test_function( void )
 {
   #ifdef LIGHTS_ON_BUTTONS
-  if(Button1_Is_Actively_Pressed == true)
+  if(Button_1.is_pressed == true)
   {
     LED_RED_ON; Red_Is_On = true;
   } else {
     if(Red_Is_On == true) { LED_RED_OFF; Red_Is_On = false; }
   }
 
-  if(Button2_Is_Actively_Pressed == true)
+  if(Button_2.is_pressed == true)
   {
     LED_GREEN_ON; Green_Is_On = true;
   } else {
@@ -918,7 +1647,7 @@ void Red_LED_Start_Blinking( void )
 
 void Green_LED_Start_Blinking( void )
 {
-  Red_LED_Blink_On = true;
+  Green_LED_Blink_On = true;
   event_StartNow(&event_BlinkLEDs);
 }
 
@@ -939,13 +1668,22 @@ void Green_LED_Stop_Blinking( void )
 
 void state_Sleep_until_next_recording( void )
 {
-  logentry++; Serial.print(logentry); Serial.println(" - In state_Sleep_until_next_recording(). ");
+  TRACE_INFO(trace_In_Sleep);
 }
 
 
 void state_Stop_recording( void )
 {
-  logentry++; Serial.print(logentry); Serial.println(" - In state_Stop_recording(). Resetting to state 'none'.");
+  TRACE_INFO(trace_In_Stop_Recording);
+  TRACE_INFO_VALUE(trace_Idle_Permille, sleep_IdlePermille());
+  TRACE_INFO_VALUE(trace_Missed_Readings, event_ReadDataFromDevice.missed);
+  TRACE_INFO_VALUE(trace_Charge_Total, Acc_Load_Milliamps.lifetime / 3600000L);       // mA*ms -> mAh
+  TRACE_INFO_VALUE(trace_Energy_Total, Acc_Load_Microwatts.lifetime / 3600000000LL);  // uW*ms -> mWh
+  TRACE_INFO_VALUE(trace_Raw_Skipped, Raw_Skipped);
+  TRACE_INFO_VALUE(trace_Raw_Write_Max_Us, Raw_Write_Max_Us);
+  TRACE_INFO_VALUE(trace_Raw_Write_Slow, Raw_Write_Slow);
+  if (Raw_Dropped) TRACE_ERROR_VALUE(trace_Raw_Dropped, Raw_Dropped);
+  if (Card_Is_Ready) blocklog_SetSize(&Raw_Log); // Last block's newest copy in its place and the size up to date, for an offload
   state_SetNext(none);
 }
 
@@ -992,13 +1730,232 @@ void ReadSDCardToConsole( void )
     myFile.close();
   } else {
     // if the file didn't open, print an error:
-    Serial.println("error opening test.txt");
+    TRACE_ERROR(trace_File_Open_Failed);
   }
 }
 
+// Erases and formats the whole card (lemtils/Format.h), then mounts it again with a new RAW_FILE.
+// Only from state none, and it blocks the loop while it runs: no readings are taken meanwhile.
 void state_Format_card( void )
 {
-  logentry++; Serial.print(logentry); Serial.println(" - In state_Format_card(). Resetting to state 'none'.");
+  Sd2Card *card = SD.sdCard(); // SD's own, no second one on the stack
+  struct a_format_layout layout;
+  uint8_t result;
+
+  TRACE_INFO(trace_In_Format_Card);
+  Card_Is_Ready = false;
+  event_Cancel(&event_CardRecover); // The old mount is going away
+  blocklog_Close(&Raw_Log); // Nothing left open to write into the new volume
+  SD.rootDirectory()->close();
+  LED_RED_ON; // Solid while it runs, the loop isn't there to blink it
+  if (!card->init(SD_SCK_RATE, SD_CHIP_SELECT_PIN)) {
+    result = FORMAT_ERROR_INIT;
+  } else {
+    result = format_Card(card, micros() ^ Log_Time_Offset, &layout);
+  }
+  LED_RED_OFF;
+  while (journal_IsBusy()); // EEPROM free
+  mountcache_Forget(sizeof(sd_mount_t)); // The card kept power, only this tells the next mount the volume changed
+  if (result == FORMAT_OK) {
+    TRACE_INFO_VALUE(trace_Format_Au_Blocks, layout.au);
+  } else {
+    TRACE_ERROR_VALUE(trace_Format_Failed, result);
+  }
+  InitializeSDCard();
+  state_SetNext(none);
+}
+
+
+// Offload mode: line to OFFLOAD_BAUD and the card mounted, then Offload_Poll() serves the host
+void state_Offload( void )
+{
+  Serial.flush();
+  Serial.begin(OFFLOAD_BAUD);
+  offload_Initialize(&Offload_Host);
+  Offload_Heard_At = event_Now();
+  Offload_Frames = 0;
+  InitializeSDCard();
+  Green_LED_Start_Blinking();
+}
+
+
+// Card operation timing (SD_LATENCY_STATS in Sd2Card.h): a DATA frame per kind (offset: SD_LATENCY_READ...,
+// payload: sd_latency_t), then END. Cleared after if asked, e.g. before a recording session to be measured.
+void Offload_Stats( bool clear )
+{
+#if SD_LATENCY_STATS
+  Sd2Card *card = SdVolume::sdCard();
+  uint8_t kind;
+
+  if (!card) {
+    Offload_Frame(OFFLOAD_ERROR, 0, 0, (const uint8_t *)"no card", 7);
+    return;
+  }
+  for (kind = 0; kind < SD_LATENCY_KINDS; kind++) {
+    Offload_Frame(OFFLOAD_DATA, kind, kind, (const uint8_t *)card->latency(kind), sizeof(sd_latency_t));
+  }
+  Offload_Frame(OFFLOAD_END, SD_LATENCY_KINDS, 0, 0, 0);
+  if (clear) card->latencyClear();
+#else
+  Offload_Frame(OFFLOAD_ERROR, 0, 0, (const uint8_t *)"SD_LATENCY_STATS is off", 23);
+#endif
+}
+
+
+// Back to SERIAL_BAUD and state none
+void Offload_Leave( void )
+{
+  Serial.flush();
+  Serial.begin(SERIAL_BAUD);
+  offload_Initialize(&Offload_Host);
+  Green_LED_Stop_Blinking();
   state_SetNext(none);
+  TRACE_INFO_VALUE(trace_Offload_Done, Offload_Frames);
+}
+
+
+// Host frames in. A HELLO (at SERIAL_BAUD) starts offload mode from state none, the rest only count in offload mode.
+void Offload_Poll( void )
+{
+  if (Serial_Woke) {
+    Serial_Woke = false;
+    Offload_Heard_At = event_Now();
+  }
+  while (Serial.available() > 0) {
+    Offload_Heard_At = event_Now();
+    if (offload_Receive(&Offload_Host, (uint8_t)Serial.read())) Offload_Handle(&Offload_Host.frame);
+  }
+  if ((state == offload) && ((event_Now() - Offload_Heard_At) >= OFFLOAD_IDLE_MS)) Offload_Leave(); // Host went away
+}
+
+
+void Offload_Handle( const struct an_offload_frame *frame )
+{
+  if (frame->type == OFFLOAD_HELLO) {
+    if ((state != none) && (state != offload)) return; // Not while recording
+    Offload_Frame(OFFLOAD_HELLO, 0, 0, (const uint8_t *)VERSION, sizeof(VERSION) - 1);
+    if (state == none) state_SetNext(offload); // Switches baud once the reply is out
+    return;
+  }
+  if (state != offload) return;
+  switch (frame->type) {
+    case OFFLOAD_LIST: Offload_List(); break;
+    case OFFLOAD_READ: Offload_Read((const char *)frame->payload, frame->offset); break;
+    case OFFLOAD_STATS: Offload_Stats(frame->offset == 1); break;
+    case OFFLOAD_RANGE:
+      if (frame->length == sizeof(uint32_t)) Offload_Range(frame->offset, frame->payload[0] | ((uint32_t)frame->payload[1] << 8) | ((uint32_t)frame->payload[2] << 16) | ((uint32_t)frame->payload[3] << 24));
+      break;
+    case OFFLOAD_QUIT:
+      Offload_Frame(OFFLOAD_QUIT, 0, 0, 0, 0);
+      Offload_Leave();
+      break;
+    default: break;
+  }
+}
+
+
+// One frame out: header, payload, CRC. Serial.write() waits for room in the TX buffer, the UDRE interrupt sends it.
+void Offload_Frame( uint8_t type, uint16_t sequence, uint32_t offset, const uint8_t *payload, uint16_t length )
+{
+  uint8_t header[OFFLOAD_HEADER_SIZE];
+  uint16_t crc = offload_Header(header, type, sequence, offset, length);
+  crc = offload_Crc(crc, payload, length);
+  Serial.write(header, OFFLOAD_HEADER_SIZE);
+  if (length) Serial.write(payload, length);
+  Serial.write((uint8_t)crc);
+  Serial.write((uint8_t)(crc >> 8));
+  Offload_Frames++;
+}
+
+
+// An ENTRY frame (name, size) per file in the root directory, then END
+void Offload_List( void )
+{
+  File root, entry;
+  uint16_t sequence = 0;
+
+  root = SD.open("/");
+  if (!root) {
+    Offload_Frame(OFFLOAD_ERROR, 0, 0, (const uint8_t *)"no card", 7);
+    return;
+  }
+  while ((entry = root.openNextFile())) {
+    if (!entry.isDirectory()) Offload_Frame(OFFLOAD_ENTRY, sequence++, entry.size(), (const uint8_t *)entry.name(), strlen(entry.name()));
+    entry.close();
+    watchdog_feed();
+  }
+  root.close();
+  Offload_Frame(OFFLOAD_END, sequence, 0, 0, 0);
+}
+
+
+// Streams name from offset to the end, a block per DATA frame straight out of the volume cache, then END.
+// Anything from the host stops it (a resume request, usually), so does the supply failing.
+void Offload_Read( const char *name, uint32_t offset )
+{
+  const uint8_t *data;
+  uint16_t sequence = 0;
+  int n = 1;
+  File file;
+
+  file = SD.open(name);
+  if (!file || !file.seek(offset)) {
+    Offload_Frame(OFFLOAD_ERROR, 0, offset, (const uint8_t *)name, strlen(name));
+    if (file) file.close();
+    return;
+  }
+  while (n > 0) {
+    if ((Serial.available() > 0) || powerfail_IsPending()) break; // Stopped part way, no END
+    if ((n = file.readInPlace(&data)) > 0) {
+      Offload_Frame(OFFLOAD_DATA, sequence++, offset, data, n);
+      offset += n;
+      watchdog_feed();
+    }
+  }
+  file.close();
+  if (n == 0) Offload_Frame(OFFLOAD_END, sequence, offset, 0, 0);
+  if (n < 0) Offload_Frame(OFFLOAD_ERROR, sequence, offset, (const uint8_t *)name, strlen(name));
+  Offload_Heard_At = event_Now(); // Streaming a big file can take longer than OFFLOAD_IDLE_MS
+}
+
+
+// The raw records with from <= time <= to: RAW_INDEX_FILE finds the first block (without it, from the start of
+// RAW_FILE), then DATA frames of up to OFFLOAD_RANGE_RECORDS whole records (offset: time of the first), then END
+// (offset: records sent). Stopped like Offload_Read(), the host resumes from the last time it got + 1.
+void Offload_Range( uint32_t from, uint32_t to )
+{
+  struct a_raw_record records[OFFLOAD_RANGE_RECORDS];
+  struct a_blocklog_reader reader;
+  uint32_t block = 0, sent = 0;
+  uint16_t sequence = 0;
+  uint8_t n = 0;
+  bool more = true;
+  File log, index;
+
+  index = SD.open(RAW_INDEX_FILE);
+  if (index) {
+    block = blocklog_FindBlock(index, from);
+    index.close();
+  }
+  log = SD.open(RAW_FILE);
+  if (!log || !blocklog_ReaderSeek(log, &reader, block)) {
+    Offload_Frame(OFFLOAD_ERROR, 0, from, (const uint8_t *)RAW_FILE, sizeof(RAW_FILE) - 1);
+    if (log) log.close();
+    return;
+  }
+  while (more) {
+    if ((Serial.available() > 0) || powerfail_IsPending()) break; // Stopped part way, no END
+    more = blocklog_ReaderNext(log, &reader, &records[n], sizeof(records[0])) && (records[n].time <= to);
+    if (more && (records[n].time >= from)) n++;
+    if (n && (!more || (n == OFFLOAD_RANGE_RECORDS))) {
+      Offload_Frame(OFFLOAD_DATA, sequence++, records[0].time, (const uint8_t *)records, n * sizeof(records[0]));
+      sent += n;
+      n = 0;
+      watchdog_feed();
+    }
+  }
+  log.close();
+  if (!more) Offload_Frame(OFFLOAD_END, sequence, sent, 0, 0);
+  Offload_Heard_At = event_Now();
 }
 
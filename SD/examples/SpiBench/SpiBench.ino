@@ -0,0 +1,205 @@
+/*
+  SPI block kernel benchmark
+
+ Times the 512 byte block transfers in utility/SdSpi.h against a byte at a
+ time loop and against the line rate, in CPU cycles from Timer1.  The card's
+ chip select is held high while timing, so a card is not needed and one
+ in the socket ignores the traffic.
+
+ For each SCK rate it prints cycles per byte and the share of the line rate
+ (16 cycles per byte at F_CPU/2), and for the timed kernels whether the SPI
+ saw a write collision.  A collision means SD_SPI_BYTE_CYCLES is too small
+ for this part.
+
+ Then, with a card in the socket, it checks what the receive kernels get:
+ block 0 is read through the driver (the timed kernel at F_CPU/2, the
+ polled one below) VERIFY_READS times at each rate, into a cleared buffer,
+ and every copy has to have the CRC16 of the first read at F_CPU/8.  With
+ USE_SD_CRC the driver also checks each copy against the card's own CRC.
+
+ The circuit:
+ * SD card attached to SPI bus as follows:
+ ** MOSI - pin 11
+ ** MISO - pin 12
+ ** CLK - pin 13
+ ** CS - pin 4
+
+ This example code is in the public domain.
+ */
+#include <SPI.h>
+#include <SD.h>
+#include <utility/SdSpi.h>
+#include <util/crc16.h>
+
+const int chipSelect = 4;
+const uint8_t VERIFY_READS = 16;
+
+uint8_t block[512];
+
+// the loop the block kernels replace, a byte at a time
+void byteSend(const uint8_t* src, uint16_t n) {
+  for (uint16_t i = 0; i < n; i++) {
+    SPDR = src[i];
+    while (!(SPSR & (1 << SPIF)))
+      ;
+  }
+}
+
+void byteRec(uint8_t* dst, uint16_t n) {
+  for (uint16_t i = 0; i < n; i++) {
+    SPDR = 0XFF;
+    while (!(SPSR & (1 << SPIF)))
+      ;
+    dst[i] = SPDR;
+  }
+}
+
+void setRate(uint8_t rate) {
+  // as Sd2Card::setSckRate()
+  if (rate & 1) {
+    SPSR &= ~(1 << SPI2X);
+  } else {
+    SPSR |= (1 << SPI2X);
+  }
+  SPCR &= ~((1 << SPR1) | (1 << SPR0));
+  SPCR |= (rate & 4 ? (1 << SPR1) : 0) | (rate & 2 ? (1 << SPR0) : 0);
+}
+
+void report(const char* name, uint8_t rate, uint16_t cycles, int8_t collision) {
+  uint16_t line = 512U * (16U << rate);
+  Serial.print(name);
+  Serial.print(cycles);
+  Serial.print(" cycles, ");
+  Serial.print(cycles / 512.0, 2);
+  Serial.print(" per byte, ");
+  Serial.print(100.0 * line / cycles, 1);
+  Serial.print("% of line rate");
+  if (collision > 0) Serial.print(", WRITE COLLISION");
+  Serial.println();
+}
+
+void bench(uint8_t rate) {
+  uint16_t t;
+  uint8_t c = 0;
+
+  setRate(rate);
+  Serial.print("SCK F_CPU/");
+  Serial.println(2 << rate);
+
+  cli();
+  TCNT1 = 0;
+  byteSend(block, 512);
+  t = TCNT1;
+  sei();
+  report("  send, byte loop:    ", rate, t, -1);
+
+  cli();
+  TCNT1 = 0;
+  spiSendBlockPolled(block, 512);
+  t = TCNT1;
+  sei();
+  report("  send, polled:       ", rate, t, -1);
+
+  if (spiFullSpeed()) {
+    cli();
+    TCNT1 = 0;
+    c = spiSendBlockTimed(block, 512);
+    t = TCNT1;
+    sei();
+    report("  send, timed:        ", rate, t, c);
+  }
+
+  cli();
+  TCNT1 = 0;
+  byteRec(block, 512);
+  t = TCNT1;
+  sei();
+  report("  receive, byte loop: ", rate, t, -1);
+
+  cli();
+  TCNT1 = 0;
+  spiRecBlockPolled(block, 512);
+  t = TCNT1;
+  sei();
+  report("  receive, polled:    ", rate, t, -1);
+
+  if (spiFullSpeed()) {
+    cli();
+    TCNT1 = 0;
+    c = spiRecBlockTimed(block, 512);
+    t = TCNT1;
+    sei();
+    report("  receive, timed:     ", rate, t, c);
+  }
+}
+
+// CRC16 of a block as the card sends it (CCITT, 0 start)
+uint16_t blockCrc(const uint8_t* src) {
+  uint16_t crc = 0;
+  for (uint16_t i = 0; i < 512; i++) crc = _crc_xmodem_update(crc, src[i]);
+  return crc;
+}
+
+void verify() {
+  Sd2Card card;
+  uint16_t reference;
+  uint8_t rate, i, bad;
+
+  Serial.println("Receive check, block 0 of the card:");
+  if (!card.init(SPI_QUARTER_SPEED, chipSelect)) {
+    Serial.println("  no card, skipped");
+    return;
+  }
+  if (card.crcMode(true)) Serial.println("  CMD59 on, the card's CRC is checked too");
+  if (!card.readBlock(0, block)) {
+    Serial.println("  read failed");
+    return;
+  }
+  reference = blockCrc(block);
+  for (rate = SPI_FULL_SPEED; rate <= SPI_QUARTER_SPEED; rate++) {
+    card.setSckRate(rate);
+    bad = 0;
+    for (i = 0; i < VERIFY_READS; i++) {
+      memset(block, 0, sizeof(block));  // a kernel that stores nothing can't pass on old data
+      if (!card.readBlock(0, block) || blockCrc(block) != reference) bad++;
+    }
+    Serial.print("  SCK F_CPU/");
+    Serial.print(2 << rate);
+    Serial.print(": ");
+    Serial.print(bad);
+    Serial.print(" of ");
+    Serial.print(VERIFY_READS);
+    Serial.println(bad ? " reads BAD" : " reads bad");
+  }
+}
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial) {
+    ; // wait for serial port to connect. Needed for native USB port only
+  }
+
+  // card deselected, SS an output so the SPI stays master
+  pinMode(chipSelect, OUTPUT);
+  digitalWrite(chipSelect, HIGH);
+  pinMode(SS, OUTPUT);
+  pinMode(MOSI, OUTPUT);
+  pinMode(SCK, OUTPUT);
+  SPCR = (1 << SPE) | (1 << MSTR);
+
+  // Timer1 counts CPU cycles
+  TCCR1A = 0;
+  TCCR1B = (1 << CS10);
+
+  for (uint16_t i = 0; i < 512; i++) block[i] = i;
+
+  Serial.print("SD_SPI_BYTE_CYCLES ");
+  Serial.println(SD_SPI_BYTE_CYCLES);
+  bench(SPI_FULL_SPEED);
+  bench(SPI_HALF_SPEED);
+  bench(SPI_QUARTER_SPEED);
+  verify();
+}
+
+void loop() {
+}
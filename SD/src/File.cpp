@@ -95,6 +95,13 @@ int File::read(void *buf, uint16_t nbyte) {
   return 0;
 }
 
+// zero copy read of up to a block, for streaming a file out
+int File::readInPlace(const uint8_t **data) {
+  if (_file) 
+    return _file->readInPlace(data);
+  return 0;
+}
+
 int File::available() {
   if (! _file) return 0;
 
@@ -108,6 +115,10 @@ void File::flush() {
     _file->sync();
 }
 
+boolean File::sync(void) {
+  return _file && _file->sync();
+}
+
 boolean File::seek(uint32_t pos) {
   if (! _file) return false;
 
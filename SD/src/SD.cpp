@@ -342,9 +342,157 @@ boolean SDClass::begin(uint8_t csPin) {
     Return true if initialization succeeds, false otherwise.
 
    */
-  return card.init(SPI_HALF_SPEED, csPin) &&
+  if (root.isOpen()) root.close();  // a remount
+  sckRate_ = SD_SCK_RATE;
+  return card.init(SD_SCK_RATE, csPin) &&
          volume.init(card) &&
-         root.openRoot(volume);
+         root.openRoot(volume) &&
+         remember(csPin);
+}
+
+boolean SDClass::beginAdaptive(uint8_t csPin,
+                               uint8_t (*firstRate)(const cid_t *cid),
+                               boolean keepCrc) {
+  /*
+
+    As begin(), but with the card's CRC checking on (CMD59) block zero is
+    read SD_SCK_CHECK_READS times at each rate from the first one down.
+    A failed read or a bad CRC steps down to the next slower rate, so
+    wiring that can't keep up at F_CPU/2 costs speed instead of data.
+
+    Return true if initialization succeeds, false otherwise.
+
+   */
+  cid_t cid;
+  uint8_t rate = SPI_FULL_SPEED;
+  uint8_t *buf;
+  uint8_t reads;
+
+  if (root.isOpen()) root.close();  // a remount
+  if (!card.init(SPI_QUARTER_SPEED, csPin) || !card.crcMode(true)) {
+    return false;
+  }
+  if (firstRate) {
+    if (!card.readCID(&cid)) return false;
+    rate = firstRate(&cid);
+  }
+  buf = SdVolume::cacheClear();
+  for (;; rate++) {
+    if (rate > 6) return false;  // F_CPU/128 is the slowest there is
+    reads = 0;
+    if (card.setSckRate(rate)) {
+      // readData(), readBlock() would retry: a rate that needs it isn't kept
+      while (reads < SD_SCK_CHECK_READS && card.readData(0, 0, 512, buf)) {
+        reads++;
+      }
+    }
+    if (reads == SD_SCK_CHECK_READS) break;
+  }
+  sckRate_ = rate;
+  if (!keepCrc && !card.crcMode(false)) return false;
+  return volume.init(card) &&
+         root.openRoot(volume) &&
+         remember(csPin);
+}
+
+boolean SDClass::beginWarm(uint8_t csPin, const sd_mount_t *mount) {
+  /*
+
+    Only a card that kept power is still in SPI mode and answers CMD13
+    without CMD0 and ACMD41, and the CID tells it's the same one. A card
+    that was taken out (and maybe written elsewhere) has lost power, so
+    the volume geometry from its last mount still holds. Formatting it
+    here does not lose power: forget the mount record then.
+
+    Return true if the remount succeeds, false otherwise.
+
+   */
+  cid_t cid;
+
+  if (root.isOpen()) root.close();
+  if (!card.initWarm(mount->sckRate, csPin, mount->cardType, mount->crc) ||
+      !card.readCID(&cid) ||
+      memcmp(&cid, &mount->cid, sizeof(cid)) != 0) {
+    return false;
+  }
+  sckRate_ = mount->sckRate;
+  return volume.initGeometry(&card, &mount->volume) &&
+         root.openRoot(volume) &&
+         remember(csPin);
+}
+
+boolean SDClass::mountRecord(sd_mount_t *mount) {
+  mount->cardType = card.type();
+  mount->sckRate = sckRate_;
+  mount->crc = card.crcMode();
+  volume.geometry(&mount->volume);
+  return card.readCID(&mount->cid);
+}
+
+uint8_t SDClass::recover(uint16_t budgetMillis) {
+  /*
+
+    Brings the card back after an error without touching the volume, its
+    cache or the open files, so writing carries on where it failed (the
+    failed operation has to be done again). One step per call:
+
+    - A warm takeover (CMD13, then the CID), for a card that kept power:
+      a glitch on the lines, a write that timed out. After a CRC class
+      error the SCK rate goes down a step first.
+    - Failing that, a cold init: CMD0 in this call, ACMD41 polled for
+      budgetMillis in each one after, then the CRC mode and the CID. A
+      card that was out of the socket may have been written elsewhere
+      meanwhile; only a different card is caught.
+
+    A step takes budgetMillis, plus up to budgetMillis more shared by the
+    waits of its commands on a card that holds MISO low or doesn't answer
+    (Sd2Card::busyBudget()).
+
+    Return SD_RECOVER_DONE, SD_RECOVER_BUSY, SD_RECOVER_FAILED or
+    SD_RECOVER_OTHER_CARD.
+
+   */
+  card.busyBudget(budgetMillis);
+  uint8_t result = recoverStep(budgetMillis);
+  card.busyBudget(0);
+  return result;
+}
+
+uint8_t SDClass::recoverStep(uint16_t budgetMillis) {
+  // recover() with the busy waits bounded
+  cid_t cid;
+
+  if (!recovering_) {
+    if (card.errorClass() == SD_ERROR_CLASS_CRC && sckRate_ < 6) sckRate_++;
+    if (card.initWarm(sckRate_, csPin_, cardType_, crc_) &&
+        card.readCID(&cid)) {
+      if (memcmp(&cid, &cid_, sizeof(cid)) != 0) return SD_RECOVER_OTHER_CARD;
+      return SD_RECOVER_DONE;
+    }
+    if (!card.initStart(csPin_, budgetMillis)) return SD_RECOVER_FAILED;
+    recovering_ = true;
+    return SD_RECOVER_BUSY;
+  }
+  if (!card.initPoll(sckRate_, budgetMillis)) {
+    if (!card.errorCode()) return SD_RECOVER_BUSY;
+    recovering_ = false;
+    return SD_RECOVER_FAILED;
+  }
+  recovering_ = false;
+  if ((crc_ && !card.crcMode(true)) || !card.readCID(&cid)) {
+    return SD_RECOVER_FAILED;
+  }
+  if (memcmp(&cid, &cid_, sizeof(cid)) != 0) return SD_RECOVER_OTHER_CARD;
+  return SD_RECOVER_DONE;
+}
+
+boolean SDClass::remember(uint8_t csPin) {
+  // what recover() needs, after a begin
+  csPin_ = csPin;
+  cardType_ = card.type();
+  crc_ = card.crcMode();
+  recovering_ = false;
+  return card.readCID(&cid_);
 }
 
 
@@ -560,6 +708,19 @@ boolean SDClass::rmdir(const char *filepath) {
   return walkPath(filepath, root, callback_rmdir);
 }
 
+boolean SDClass::flush(void) {
+  /*
+
+    Writes the volume's cached block to the card if it is dirty, e.g.
+    on power failure, and checks the card status for block writes not
+    yet checked (see SD_WRITE_STATUS_EVERY).
+
+    Return true if nothing was left to write, false on a write error.
+
+   */
+  return SdVolume::cacheSync();
+}
+
 boolean SDClass::remove(const char *filepath) {
   return walkPath(filepath, root, callback_remove);
 }
@@ -23,8 +23,24 @@
 #define FILE_READ O_READ
 #define FILE_WRITE (O_READ | O_WRITE | O_CREAT)
 
+// SDClass::recover() results
+#define SD_RECOVER_FAILED 0      // Not back, try again later
+#define SD_RECOVER_DONE 1        // Back, the mount carries on
+#define SD_RECOVER_BUSY 2        // Initializing, call again soon
+#define SD_RECOVER_OTHER_CARD 3  // A different card answered, begin() again
+
 namespace SDLib {
 
+// What SDClass::beginWarm() needs to remount a card, from the last begin
+struct sdMount {
+  cid_t cid;                 // Card identity
+  uint8_t cardType;          // Sd2Card::type()
+  uint8_t sckRate;           // SDClass::sckRate()
+  uint8_t crc;               // Sd2Card::crcMode()
+  volume_geometry_t volume;  // SdVolume::geometry()
+};
+typedef struct sdMount sd_mount_t;
+
 class File : public Stream {
  private:
   char _name[13]; // our name
@@ -39,7 +55,13 @@ public:
   virtual int peek();
   virtual int available();
   virtual void flush();
+  // As flush(), false if writing the data or directory entry failed or
+  // the card reported a write error (Sd2Card::writeCheck()).
+  boolean sync(void);
   int read(void *buf, uint16_t nbyte);
+  // The rest of the current block without copying it, left in the volume
+  // cache (valid until the next SD call). Returns the bytes, 0 at the end.
+  int readInPlace(const uint8_t **data);
   boolean seek(uint32_t pos);
   uint32_t position();
   uint32_t size();
@@ -68,6 +90,30 @@ public:
   // This needs to be called to set up the connection to the SD card
   // before other methods are used.
   boolean begin(uint8_t csPin = SD_CHIP_SELECT_PIN);
+
+  // As begin(), but runs the card at the fastest SCK rate its block reads
+  // pass CRC checks at, starting from the rate firstRate() returns for the
+  // card's CID (SPI_FULL_SPEED if it's NULL). CRC checking stays on if
+  // keepCrc.
+  boolean beginAdaptive(uint8_t csPin, uint8_t (*firstRate)(const cid_t *cid),
+                        boolean keepCrc);
+
+  // The SCK rate (SPI_FULL_SPEED...) the last begin() left the card at
+  uint8_t sckRate(void) { return sckRate_; }
+
+  // Remounts a card that stayed powered since the begin() that mount came
+  // from, without init()'s ACMD41 wait or reading the MBR and BPB. Fails if
+  // the card doesn't answer as ready or has another CID, then use begin().
+  boolean beginWarm(uint8_t csPin, const sd_mount_t *mount);
+
+  // Fills in what beginWarm() needs, after a begin()
+  boolean mountRecord(sd_mount_t *mount);
+
+  // After a card error: one step at bringing the card back under the same
+  // mount, so the volume and open files carry on. About twice budgetMillis
+  // at most: the polling, then the card's busy waits. Call again (from a
+  // timer, not a loop) until it's SD_RECOVER_DONE.
+  uint8_t recover(uint16_t budgetMillis);
   
   // Open the specified file/directory with the supplied mode (e.g. read or
   // write, etc). Returns a File object for interacting with the file.
@@ -91,6 +137,18 @@ public:
   boolean rmdir(const char *filepath);
   boolean rmdir(const String &filepath) { return rmdir(filepath.c_str()); }
 
+  // Write the volume's cached block (FAT or directory) to the card if it has
+  // changed. Open files still need flush() or close() for their own entry.
+  boolean flush(void);
+
+  // The root directory, for code that works on SdFile directly (e.g. a
+  // contiguous file written with raw block writes).
+  SdFile *rootDirectory(void) { return &root; }
+
+  // The card itself, for raw access outside the volume (e.g. formatting
+  // it). Operations on it count in its SD_LATENCY_STATS.
+  Sd2Card *sdCard(void) { return &card; }
+
 private:
 
   // This is used to determine the mode used to open a file
@@ -99,6 +157,17 @@ private:
   // it's probably not the best place for it.
   // It shouldn't be set directly--it is set via the parameters to `open`.
   int fileOpenMode;
+
+  uint8_t sckRate_;
+
+  // The mount recover() brings back, from the last begin
+  cid_t cid_;
+  uint8_t csPin_;
+  uint8_t cardType_;
+  uint8_t crc_;
+  boolean recovering_;  // cold init started, ACMD41 still polling
+  uint8_t recoverStep(uint16_t budgetMillis);
+  boolean remember(uint8_t csPin);
   
   friend class File;
   friend boolean callback_openPath(SdFile&, const char *, boolean, void *); 
@@ -288,6 +288,97 @@ uint32_t const FAT32MASK = 0X0FFFFFFF;
 /** Type name for fat32BootSector */
 typedef struct fat32BootSector fbs_t;
 //------------------------------------------------------------------------------
+/**
+ * \struct fat16BootSector
+ *
+ * \brief Boot sector for a FAT12 or FAT16 volume.
+ *
+ * The BIOS Parameter Block stops after totalSectors32, the FAT32 fields of
+ * bpb_t are not there, so the extended boot fields start at offset 36.
+ */
+struct fat16BootSector {
+           /** X86 jmp to boot program */
+  uint8_t  jmpToBootCode[3];
+           /** informational only - don't depend on it */
+  char     oemName[8];
+           /** Count of bytes per sector, 512 */
+  uint16_t bytesPerSector;
+           /** Number of sectors per allocation unit, a power of 2 */
+  uint8_t  sectorsPerCluster;
+           /** Number of sectors before the first FAT, usually 1 */
+  uint16_t reservedSectorCount;
+           /** The count of FAT data structures on the volume, always 2 */
+  uint8_t  fatCount;
+           /** Count of 32 byte entries in the root directory, usually 512 */
+  uint16_t rootDirEntryCount;
+           /** 16-bit total count of sectors, zero if totalSectors32 is used */
+  uint16_t totalSectors16;
+           /** 0XF8 for fixed media */
+  uint8_t  mediaType;
+           /** Count of sectors occupied by one FAT */
+  uint16_t sectorsPerFat16;
+           /** Sectors per track for interrupt 0x13. Not used otherwise. */
+  uint16_t sectorsPerTrack;
+           /** Number of heads for interrupt 0x13. Not used otherwise. */
+  uint16_t headCount;
+           /** Count of sectors preceding the partition */
+  uint32_t hidddenSectors;
+           /** 32-bit total count of sectors on the volume */
+  uint32_t totalSectors32;
+           /** for int0x13 use value 0X80 for hard drive */
+  uint8_t  driveNumber;
+           /** used by Windows NT - should be zero for FAT */
+  uint8_t  reserved1;
+           /** 0X29 if next three fields are valid */
+  uint8_t  bootSignature;
+           /** usually generated by combining date and time */
+  uint32_t volumeSerialNumber;
+           /** should match volume label in root dir */
+  char     volumeLabel[11];
+           /** informational only - don't depend on it */
+  char     fileSystemType[8];
+           /** X86 boot code */
+  uint8_t  bootCode[448];
+           /** must be 0X55 */
+  uint8_t  bootSectorSig0;
+           /** must be 0XAA */
+  uint8_t  bootSectorSig1;
+} __attribute__((packed));
+/** Type name for fat16BootSector */
+typedef struct fat16BootSector fbs16_t;
+//------------------------------------------------------------------------------
+/** Value of the bootSignature field for the extended boot fields */
+uint8_t const EXTENDED_BOOT_SIG = 0X29;
+/** Lead signature for a FAT32 FSINFO sector */
+uint32_t const FSINFO_LEAD_SIG = 0X41615252;
+/** Struct signature for a FAT32 FSINFO sector */
+uint32_t const FSINFO_STRUCT_SIG = 0X61417272;
+/** Trail signature for a FAT32 FSINFO sector, the usual 0X55 0XAA */
+uint32_t const FSINFO_TRAIL_SIG = 0XAA550000;
+/**
+ * \struct fat32FsInfo
+ *
+ * \brief FSINFO sector for a FAT32 volume, usually sector 1 of the volume.
+ */
+struct fat32FsInfo {
+           /** must be FSINFO_LEAD_SIG */
+  uint32_t leadSignature;
+           /** should be zero */
+  uint8_t  reserved1[480];
+           /** must be FSINFO_STRUCT_SIG */
+  uint32_t structSignature;
+           /** last known free cluster count, 0XFFFFFFFF if unknown */
+  uint32_t freeCount;
+           /** where to start looking for a free cluster, 0XFFFFFFFF if unknown */
+  uint32_t nextFree;
+           /** should be zero */
+  uint8_t  reserved2[12];
+           /** must be FSINFO_TRAIL_SIG */
+  uint32_t trailSignature;
+} __attribute__((packed));
+/** Type name for fat32FsInfo */
+typedef struct fat32FsInfo fsinfo_t;
+//------------------------------------------------------------------------------
 /**
  * \struct directoryEntry
  * \brief FAT short directory entry
@@ -17,7 +17,6 @@
  * along with the Arduino Sd2Card Library.  If not, see
  * <http://www.gnu.org/licenses/>.
  */
-#define USE_SPI_LIB
 #include <Arduino.h>
 #include "Sd2Card.h"
 //------------------------------------------------------------------------------
@@ -26,6 +25,7 @@
 #include <SPI.h>
 static SPISettings settings;
 #endif
+#include "SdSpi.h"
 // functions for hardware SPI
 /** Send a byte to the card */
 static void spiSend(uint8_t b) {
@@ -102,32 +102,162 @@ void spiSend(uint8_t data) {
 }
 #endif  // SOFTWARE_SPI
 //------------------------------------------------------------------------------
+#if USE_SD_CRC
+/** CRC7 of a command and its argument, shifted up with the end bit */
+static uint8_t crc7(uint8_t cmd, uint32_t arg) {
+  uint8_t crc = 0;
+  for (int8_t s = 32; s >= 0; s -= 8) {
+    uint8_t d = s == 32 ? cmd : arg >> s;
+    for (uint8_t i = 0; i < 8; i++) {
+      crc <<= 1;
+      if ((d ^ crc) & 0X80) crc ^= 0X09;
+      d <<= 1;
+    }
+  }
+  return (crc << 1) | 1;
+}
+#if USE_SD_CRC == 1
+/** CRC16 CCITT (0X1021, zero start) of a data block, by shifts */
+static uint16_t crc16(const uint8_t* data, uint16_t n) {
+  uint16_t crc = 0;
+  while (n--) {
+    crc = (uint8_t)(crc >> 8) | (crc << 8);
+    crc ^= *data++;
+    crc ^= (uint8_t)(crc & 0XFF) >> 4;
+    crc ^= crc << 12;
+    crc ^= (crc & 0XFF) << 5;
+  }
+  return crc;
+}
+#else  // USE_SD_CRC
+/** CRC16 CCITT of every byte value */
+static const uint16_t crc16Table[256] PROGMEM = {
+  0X0000, 0X1021, 0X2042, 0X3063, 0X4084, 0X50A5, 0X60C6, 0X70E7,
+  0X8108, 0X9129, 0XA14A, 0XB16B, 0XC18C, 0XD1AD, 0XE1CE, 0XF1EF,
+  0X1231, 0X0210, 0X3273, 0X2252, 0X52B5, 0X4294, 0X72F7, 0X62D6,
+  0X9339, 0X8318, 0XB37B, 0XA35A, 0XD3BD, 0XC39C, 0XF3FF, 0XE3DE,
+  0X2462, 0X3443, 0X0420, 0X1401, 0X64E6, 0X74C7, 0X44A4, 0X5485,
+  0XA56A, 0XB54B, 0X8528, 0X9509, 0XE5EE, 0XF5CF, 0XC5AC, 0XD58D,
+  0X3653, 0X2672, 0X1611, 0X0630, 0X76D7, 0X66F6, 0X5695, 0X46B4,
+  0XB75B, 0XA77A, 0X9719, 0X8738, 0XF7DF, 0XE7FE, 0XD79D, 0XC7BC,
+  0X48C4, 0X58E5, 0X6886, 0X78A7, 0X0840, 0X1861, 0X2802, 0X3823,
+  0XC9CC, 0XD9ED, 0XE98E, 0XF9AF, 0X8948, 0X9969, 0XA90A, 0XB92B,
+  0X5AF5, 0X4AD4, 0X7AB7, 0X6A96, 0X1A71, 0X0A50, 0X3A33, 0X2A12,
+  0XDBFD, 0XCBDC, 0XFBBF, 0XEB9E, 0X9B79, 0X8B58, 0XBB3B, 0XAB1A,
+  0X6CA6, 0X7C87, 0X4CE4, 0X5CC5, 0X2C22, 0X3C03, 0X0C60, 0X1C41,
+  0XEDAE, 0XFD8F, 0XCDEC, 0XDDCD, 0XAD2A, 0XBD0B, 0X8D68, 0X9D49,
+  0X7E97, 0X6EB6, 0X5ED5, 0X4EF4, 0X3E13, 0X2E32, 0X1E51, 0X0E70,
+  0XFF9F, 0XEFBE, 0XDFDD, 0XCFFC, 0XBF1B, 0XAF3A, 0X9F59, 0X8F78,
+  0X9188, 0X81A9, 0XB1CA, 0XA1EB, 0XD10C, 0XC12D, 0XF14E, 0XE16F,
+  0X1080, 0X00A1, 0X30C2, 0X20E3, 0X5004, 0X4025, 0X7046, 0X6067,
+  0X83B9, 0X9398, 0XA3FB, 0XB3DA, 0XC33D, 0XD31C, 0XE37F, 0XF35E,
+  0X02B1, 0X1290, 0X22F3, 0X32D2, 0X4235, 0X5214, 0X6277, 0X7256,
+  0XB5EA, 0XA5CB, 0X95A8, 0X8589, 0XF56E, 0XE54F, 0XD52C, 0XC50D,
+  0X34E2, 0X24C3, 0X14A0, 0X0481, 0X7466, 0X6447, 0X5424, 0X4405,
+  0XA7DB, 0XB7FA, 0X8799, 0X97B8, 0XE75F, 0XF77E, 0XC71D, 0XD73C,
+  0X26D3, 0X36F2, 0X0691, 0X16B0, 0X6657, 0X7676, 0X4615, 0X5634,
+  0XD94C, 0XC96D, 0XF90E, 0XE92F, 0X99C8, 0X89E9, 0XB98A, 0XA9AB,
+  0X5844, 0X4865, 0X7806, 0X6827, 0X18C0, 0X08E1, 0X3882, 0X28A3,
+  0XCB7D, 0XDB5C, 0XEB3F, 0XFB1E, 0X8BF9, 0X9BD8, 0XABBB, 0XBB9A,
+  0X4A75, 0X5A54, 0X6A37, 0X7A16, 0X0AF1, 0X1AD0, 0X2AB3, 0X3A92,
+  0XFD2E, 0XED0F, 0XDD6C, 0XCD4D, 0XBDAA, 0XAD8B, 0X9DE8, 0X8DC9,
+  0X7C26, 0X6C07, 0X5C64, 0X4C45, 0X3CA2, 0X2C83, 0X1CE0, 0X0CC1,
+  0XEF1F, 0XFF3E, 0XCF5D, 0XDF7C, 0XAF9B, 0XBFBA, 0X8FD9, 0X9FF8,
+  0X6E17, 0X7E36, 0X4E55, 0X5E74, 0X2E93, 0X3EB2, 0X0ED1, 0X1EF0
+};
+/** CRC16 CCITT (0X1021, zero start) of a data block, from the table */
+static uint16_t crc16(const uint8_t* data, uint16_t n) {
+  uint16_t crc = 0;
+  while (n--) {
+    crc = (crc << 8) ^ pgm_read_word(&crc16Table[(crc >> 8) ^ *data++]);
+  }
+  return crc;
+}
+#endif  // USE_SD_CRC
+#endif  // USE_SD_CRC
+//------------------------------------------------------------------------------
+/**
+ * Read the card's allocation unit (AU_SIZE in the SD Status), the erase
+ * block its flash management works in.  Writes that stay inside whole AUs
+ * don't make the card copy another file's data out of one first.
+ *
+ * \param[out] buf 64 bytes for the SD Status.
+ *
+ * \return The AU in 512 byte blocks, zero if the SD Status can't be read
+ * or doesn't give one.
+ */
+uint32_t Sd2Card::allocationUnit(uint8_t* buf) {
+  // AU_SIZE 0XA to 0XF, in MB
+  static const uint8_t largeMB[] = {8, 12, 16, 24, 32, 64};
+  if (!readSdStatus(buf)) return 0;
+  uint8_t code = buf[10] >> 4;
+  // 16KB up to 4MB
+  if (code >= 1 && code <= 9) return 32UL << (code - 1);
+  if (code >= 0XA) return (uint32_t)largeMB[code - 0XA] << 11;
+  return 0;
+}
+//------------------------------------------------------------------------------
+/**
+ * Share \a millis from now between the waits for a busy card before each
+ * command and for the start of read data, which otherwise take up to
+ * 300 ms each.  For a caller that has to stay on time while the card may
+ * not answer, e.g. SDClass::recover().  A wait that finds the budget used
+ * up still checks the card once.
+ *
+ * \param[in] millis Total for the waits, zero for the normal timeouts.
+ */
+void Sd2Card::busyBudget(uint16_t millis) {
+  busyStart_ = ::millis();
+  busyBudget_ = millis;
+}
+//------------------------------------------------------------------------------
+// timeoutMillis, or less if busyBudget() has less left
+uint16_t Sd2Card::busyLimit(uint16_t timeoutMillis) {
+  if (!busyBudget_) return timeoutMillis;
+  uint16_t used = (uint16_t)millis() - busyStart_;
+  if (used >= busyBudget_) return 0;
+  return busyBudget_ - used < timeoutMillis ? busyBudget_ - used : timeoutMillis;
+}
+//------------------------------------------------------------------------------
 // send command and return error code.  Return zero for OK
-uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
+uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg, uint8_t retries) {
   // end read if in partialBlockRead mode
   readEnd();
 
   // select card
   chipSelectLow();
 
-  // wait up to 300 ms if busy
-  waitNotBusy(300);
+  // wait up to 300 ms if busy, less with busyBudget()
+  waitNotBusy(busyLimit(300));
+#if SD_LATENCY_STATS
+  uint32_t t0 = micros();
+#endif
 
-  // send command
-  spiSend(cmd | 0x40);
+  for (uint8_t retry = 0;; retry++) {
+    // send command
+    spiSend(cmd | 0x40);
 
-  // send argument
-  for (int8_t s = 24; s >= 0; s -= 8) spiSend(arg >> s);
+    // send argument
+    for (int8_t s = 24; s >= 0; s -= 8) spiSend(arg >> s);
 
-  // send CRC
-  uint8_t crc = 0XFF;
-  if (cmd == CMD0) crc = 0X95;  // correct crc for CMD0 with arg 0
-  if (cmd == CMD8) crc = 0X87;  // correct crc for CMD8 with arg 0X1AA
-  spiSend(crc);
+    // send CRC
+    uint8_t crc = 0XFF;
+    if (cmd == CMD0) crc = 0X95;  // correct crc for CMD0 with arg 0
+    if (cmd == CMD8) crc = 0X87;  // correct crc for CMD8 with arg 0X1AA
+#if USE_SD_CRC
+    if (crc_) crc = crc7(cmd | 0x40, arg);
+#endif  // USE_SD_CRC
+    spiSend(crc);
 
-  // wait for response
-  for (uint8_t i = 0; ((status_ = spiRec()) & 0X80) && i != 0XFF; i++)
-    ;
+    // wait for response
+    for (uint8_t i = 0; ((status_ = spiRec()) & 0X80) && i != 0XFF; i++)
+      ;
+    // with crcMode() on, a command garbled on the way was not carried out
+    if (!crcRejected(status_) || retry >= retries) break;
+  }
+#if SD_LATENCY_STATS
+  if (cmd == CMD13) latencyRecord(SD_LATENCY_STATUS, t0);
+#endif
   return status_;
 }
 //------------------------------------------------------------------------------
@@ -157,10 +287,16 @@ uint32_t Sd2Card::cardSize(void) {
   }
 }
 //------------------------------------------------------------------------------
+#ifdef USE_SPI_LIB
 static uint8_t chip_select_asserted = 0;
+#endif  // USE_SPI_LIB
 
 void Sd2Card::chipSelectHigh(void) {
+#ifdef SD_FIXED_CHIP_SELECT_PIN
+  fastDigitalWrite(SD_FIXED_CHIP_SELECT_PIN, HIGH);
+#else  // SD_FIXED_CHIP_SELECT_PIN
   digitalWrite(chipSelectPin_, HIGH);
+#endif  // SD_FIXED_CHIP_SELECT_PIN
 #ifdef USE_SPI_LIB
   if (chip_select_asserted) {
     chip_select_asserted = 0;
@@ -176,7 +312,40 @@ void Sd2Card::chipSelectLow(void) {
     SPI.beginTransaction(settings);
   }
 #endif
+#ifdef SD_FIXED_CHIP_SELECT_PIN
+  fastDigitalWrite(SD_FIXED_CHIP_SELECT_PIN, LOW);
+#else  // SD_FIXED_CHIP_SELECT_PIN
   digitalWrite(chipSelectPin_, LOW);
+#endif  // SD_FIXED_CHIP_SELECT_PIN
+}
+//------------------------------------------------------------------------------
+/**
+ * Turn CRC checking on or off (CMD59).  With it on the card rejects a
+ * command or a written block with a bad CRC, and readData() checks the
+ * CRC16 of every whole block it reads (partial block reads go unchecked).
+ * init() turns it off.  Needs USE_SD_CRC.
+ *
+ * \param[in] enable true to turn CRC checking on.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::crcMode(uint8_t enable) {
+#if USE_SD_CRC
+  // CMD59 itself needs a good CRC if checking is already on
+  crc_ = 1;
+  if (cardCommand(CMD59, enable ? 1 : 0)) {
+    error(SD_CARD_ERROR_CMD59);
+    chipSelectHigh();
+    return false;
+  }
+  chipSelectHigh();
+  crc_ = enable ? 1 : 0;
+  return true;
+#else  // USE_SD_CRC
+  error(SD_CARD_ERROR_CMD59);
+  return false;
+#endif  // USE_SD_CRC
 }
 //------------------------------------------------------------------------------
 /** Erase a range of blocks.
@@ -229,6 +398,44 @@ uint8_t Sd2Card::eraseSingleBlockEnable(void) {
   return readCSD(&csd) ? csd.v1.erase_blk_en : 0;
 }
 //------------------------------------------------------------------------------
+/**
+ * What kind of failure the last error was, for deciding how to recover.
+ * Data errors that the retries in this class could not get past are
+ * SD_ERROR_CLASS_CRC; a card that answers only with ones (MISO high) is
+ * SD_ERROR_CLASS_GONE and needs init() again.
+ *
+ * \return One of the SD_ERROR_CLASS_ values in Sd2Card.h.
+ */
+uint8_t Sd2Card::errorClass(void) const {
+  switch (errorCode_) {
+    case 0:
+      return SD_ERROR_CLASS_NONE;
+    case SD_CARD_ERROR_READ_CRC:
+    case SD_CARD_ERROR_SPI_COLLISION:
+      return SD_ERROR_CLASS_CRC;
+    case SD_CARD_ERROR_ERASE_TIMEOUT:
+    case SD_CARD_ERROR_READ_TIMEOUT:
+    case SD_CARD_ERROR_WRITE_MULTIPLE:
+    case SD_CARD_ERROR_WRITE_TIMEOUT:
+      return SD_ERROR_CLASS_TIMEOUT;
+    case SD_CARD_ERROR_WRITE:
+      // status is the data response token
+      if ((status_ & DATA_RES_MASK) == DATA_RES_CRC_ERROR) {
+        return SD_ERROR_CLASS_CRC;
+      }
+      break;
+    case SD_CARD_ERROR_CHIP_SELECT:
+    case SD_CARD_ERROR_SCK_RATE:
+    case SD_CARD_ERROR_WRITE_BLOCK_ZERO:
+      return SD_ERROR_CLASS_CARD;
+    default:
+      break;
+  }
+  if (status_ == 0XFF) return SD_ERROR_CLASS_GONE;
+  if (crcRejected(status_)) return SD_ERROR_CLASS_CRC;
+  return SD_ERROR_CLASS_CARD;
+}
+//------------------------------------------------------------------------------
 /**
  * Initialize an SD flash memory card.
  *
@@ -240,35 +447,84 @@ uint8_t Sd2Card::eraseSingleBlockEnable(void) {
  * can be determined by calling errorCode() and errorData().
  */
 uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
-  errorCode_ = inBlock_ = partialBlockRead_ = type_ = 0;
-  chipSelectPin_ = chipSelectPin;
   // 16-bit init start time allows over a minute
   uint16_t t0 = (uint16_t)millis();
-  uint32_t arg;
+  uint16_t used;
 
-  // set pin modes
-  pinMode(chipSelectPin_, OUTPUT);
-  digitalWrite(chipSelectPin_, HIGH);
-#ifndef USE_SPI_LIB
-  pinMode(SPI_MISO_PIN, INPUT);
-  pinMode(SPI_MOSI_PIN, OUTPUT);
-  pinMode(SPI_SCK_PIN, OUTPUT);
-#endif
+  if (!initStart(chipSelectPin, SD_INIT_TIMEOUT)) return false;
+  used = (uint16_t)millis() - t0;
+  if (initPoll(sckRateID, used < SD_INIT_TIMEOUT ? SD_INIT_TIMEOUT - used : 0)) {
+    return true;
+  }
+  if (!errorCode_) error(SD_CARD_ERROR_ACMD41);
+  return false;
+}
+//------------------------------------------------------------------------------
+/**
+ * Finish an init() that initStart() began: send ACMD41 until the card is
+ * ready or \a timeoutMillis is up, then read its type and set the SCK rate.
+ * A card takes up to a second to get ready, so a caller that can't wait
+ * that long calls this again later with a short timeout.
+ *
+ * \param[in] sckRateID SPI clock rate selector. See setSckRate().
+ * \param[in] timeoutMillis Longest to poll, at least one ACMD41 is sent.
+ *
+ * \return The value one, true, is returned when the card is ready.  The
+ * value zero, false, is returned with errorCode() zero while the card is
+ * still initializing, and with an error code for failure.
+ */
+uint8_t Sd2Card::initPoll(uint8_t sckRateID, uint16_t timeoutMillis) {
+  uint16_t t0 = (uint16_t)millis();
+  // initialize card and send host supports SDHC if SD2
+  uint32_t arg = type() == SD_CARD_TYPE_SD2 ? 0X40000000 : 0;
+
+  while ((status_ = cardAcmd(ACMD41, arg)) != R1_READY_STATE) {
+    // check for timeout
+    if (((uint16_t)(millis() - t0)) >= timeoutMillis) {
+      if (status_ != R1_IDLE_STATE) error(SD_CARD_ERROR_ACMD41);
+      goto fail;
+    }
+  }
+  // if SD2 read OCR register to check for SDHC card
+  if (type() == SD_CARD_TYPE_SD2) {
+    if (cardCommand(CMD58, 0)) {
+      error(SD_CARD_ERROR_CMD58);
+      goto fail;
+    }
+    if ((spiRec() & 0XC0) == 0XC0) type(SD_CARD_TYPE_SDHC);
+    // discard rest of ocr - contains allowed voltage range
+    for (uint8_t i = 0; i < 3; i++) spiRec();
+  }
+  chipSelectHigh();
 
 #ifndef SOFTWARE_SPI
-#ifndef USE_SPI_LIB
-  // SS must be in output mode even it is not chip select
-  pinMode(SS_PIN, OUTPUT);
-  digitalWrite(SS_PIN, HIGH); // disable any SPI device using hardware SS pin
-  // Enable SPI, Master, clock rate f_osc/128
-  SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
-  // clear double speed
-  SPSR &= ~(1 << SPI2X);
-#else // USE_SPI_LIB
-  SPI.begin();
-  settings = SPISettings(250000, MSBFIRST, SPI_MODE0);
-#endif // USE_SPI_LIB
-#endif // SOFTWARE_SPI
+  return setSckRate(sckRateID);
+#else  // SOFTWARE_SPI
+  return true;
+#endif  // SOFTWARE_SPI
+
+ fail:
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
+/**
+ * Start an init(): power up clocks, CMD0 until the card goes idle in SPI
+ * mode or \a timeoutMillis is up, then CMD8 for its version.  Finish with
+ * initPoll().
+ *
+ * \param[in] chipSelectPin SD chip select pin number.
+ * \param[in] timeoutMillis Longest to keep sending CMD0.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::initStart(uint8_t chipSelectPin, uint16_t timeoutMillis) {
+  errorCode_ = inBlock_ = partialBlockRead_ = type_ = writesUnchecked_ = 0;
+  crc_ = 0;  // CMD0 turns it off in the card
+  uint16_t t0 = (uint16_t)millis();
+
+  if (!spiBegin(chipSelectPin)) return false;
 
   // must supply min of 74 clock cycles with CS high.
 #ifdef USE_SPI_LIB
@@ -283,7 +539,7 @@ uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
 
   // command to go idle in SPI mode
   while ((status_ = cardCommand(CMD0, 0)) != R1_IDLE_STATE) {
-    if (((uint16_t)(millis() - t0)) > SD_INIT_TIMEOUT) {
+    if (((uint16_t)(millis() - t0)) > timeoutMillis) {
       error(SD_CARD_ERROR_CMD0);
       goto fail;
     }
@@ -300,39 +556,73 @@ uint8_t Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
     }
     type(SD_CARD_TYPE_SD2);
   }
-  // initialize card and send host supports SDHC if SD2
-  arg = type() == SD_CARD_TYPE_SD2 ? 0X40000000 : 0;
-
-  while ((status_ = cardAcmd(ACMD41, arg)) != R1_READY_STATE) {
-    // check for timeout
-    if (((uint16_t)(millis() - t0)) > SD_INIT_TIMEOUT) {
-      error(SD_CARD_ERROR_ACMD41);
-      goto fail;
-    }
-  }
-  // if SD2 read OCR register to check for SDHC card
-  if (type() == SD_CARD_TYPE_SD2) {
-    if (cardCommand(CMD58, 0)) {
-      error(SD_CARD_ERROR_CMD58);
-      goto fail;
-    }
-    if ((spiRec() & 0XC0) == 0XC0) type(SD_CARD_TYPE_SDHC);
-    // discard rest of ocr - contains allowed voltage range
-    for (uint8_t i = 0; i < 3; i++) spiRec();
-  }
   chipSelectHigh();
-
-#ifndef SOFTWARE_SPI
-  return setSckRate(sckRateID);
-#else  // SOFTWARE_SPI
   return true;
-#endif  // SOFTWARE_SPI
 
  fail:
   chipSelectHigh();
   return false;
 }
 //------------------------------------------------------------------------------
+/**
+ * Take over a card that is still initialized, as after a sleep with the
+ * card powered: no CMD0 or ACMD41 wait, the card type and CRC mode are the
+ * ones an earlier init() and crcMode() left it in.  Only checks that the
+ * card answers CMD13 as ready; a card that lost power since is back in SD
+ * mode and doesn't.  Check it is the same card with readCID().
+ *
+ * \param[in] sckRateID SPI clock rate selector. See setSckRate().
+ * \param[in] chipSelectPin SD chip select pin number.
+ * \param[in] cardType type() after the earlier init().
+ * \param[in] crc crcMode() of the card.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::initWarm(uint8_t sckRateID, uint8_t chipSelectPin,
+                          uint8_t cardType, uint8_t crc) {
+  errorCode_ = inBlock_ = partialBlockRead_ = writesUnchecked_ = 0;
+  type_ = cardType;
+  crc_ = crc;
+  if (!spiBegin(chipSelectPin)) return false;
+#ifndef SOFTWARE_SPI
+  if (!setSckRate(sckRateID)) return false;
+#endif  // SOFTWARE_SPI
+  // R2 response, both bytes zero for a ready card with no errors
+  if (cardCommand(CMD13, 0) || spiRec()) {
+    error(SD_CARD_ERROR_CMD13);
+    chipSelectHigh();
+    return false;
+  }
+  chipSelectHigh();
+  return true;
+}
+#if SD_LATENCY_STATS
+//------------------------------------------------------------------------------
+/** Zero the latency histograms and worst cases. */
+void Sd2Card::latencyClear(void) {
+  memset(latency_, 0, sizeof(latency_));
+  latencyBlock_ = 0;
+}
+//------------------------------------------------------------------------------
+// bin the time since startMicros for one kind of operation
+void Sd2Card::latencyRecord(uint8_t kind, uint32_t startMicros) {
+  uint32_t t = micros() - startMicros;
+  sd_latency_t* p = &latency_[kind];
+  uint8_t bin = 0;
+  p->count++;
+  if (t > p->worstMicros) {
+    p->worstMicros = t;
+    p->worstBlock = latencyBlock_;
+  }
+  while (t > 1 && bin < (SD_LATENCY_BINS - 1)) {
+    t >>= 1;
+    bin++;
+  }
+  if (p->bins[bin] != 0XFFFF) p->bins[bin]++;
+}
+#endif  // SD_LATENCY_STATS
+//------------------------------------------------------------------------------
 /**
  * Enable or disable partial block reads.
  *
@@ -361,7 +651,13 @@ void Sd2Card::partialBlockRead(uint8_t value) {
  * the value zero, false, is returned for failure.
  */
 uint8_t Sd2Card::readBlock(uint32_t block, uint8_t* dst) {
-  return readData(block, 0, 512, dst);
+  // a block that failed its CRC or lost a byte is read again
+  for (uint8_t retry = 0;; retry++) {
+    if (readData(block, 0, 512, dst)) return true;
+    if (errorClass() != SD_ERROR_CLASS_CRC || retry == SD_CRC_RETRIES) {
+      return false;
+    }
+  }
 }
 //------------------------------------------------------------------------------
 /**
@@ -376,13 +672,21 @@ uint8_t Sd2Card::readBlock(uint32_t block, uint8_t* dst) {
  */
 uint8_t Sd2Card::readData(uint32_t block,
         uint16_t offset, uint16_t count, uint8_t* dst) {
-  uint16_t n;
+#if SD_LATENCY_STATS
+  uint32_t t0 = 0;
+  uint8_t timed = 0;
+#endif
   if (count == 0) return true;
   if ((count + offset) > 512) {
     goto fail;
   }
   if (!inBlock_ || block != block_ || offset < offset_) {
     block_ = block;
+#if SD_LATENCY_STATS
+    latencyBlock_ = block;
+    t0 = micros();
+    timed = 1;
+#endif
     // use address if not SDHC card
     if (type()!= SD_CARD_TYPE_SDHC) block <<= 9;
     if (cardCommand(CMD17, block)) {
@@ -392,32 +696,26 @@ uint8_t Sd2Card::readData(uint32_t block,
     if (!waitStartBlock()) {
       goto fail;
     }
+#if SD_LATENCY_STATS
+    latencyRecord(SD_LATENCY_READ, t0);
+    timed = 0;
+#endif
     offset_ = 0;
     inBlock_ = 1;
   }
 
 #ifdef OPTIMIZE_HARDWARE_SPI
-  // start first spi transfer
-  SPDR = 0XFF;
 
   // skip data before offset
   for (;offset_ < offset; offset_++) {
-    while (!(SPSR & (1 << SPIF)))
-      ;
-    SPDR = 0XFF;
+    spiRec();
   }
-  // transfer data
-  n = count - 1;
-  for (uint16_t i = 0; i < n; i++) {
-    while (!(SPSR & (1 << SPIF)))
-      ;
-    dst[i] = SPDR;
-    SPDR = 0XFF;
+  // transfer data - block kernel
+  if (spiRecBlock(dst, count)) {
+    error(SD_CARD_ERROR_SPI_COLLISION);
+    inBlock_ = 0;
+    goto fail;
   }
-  // wait for last byte
-  while (!(SPSR & (1 << SPIF)))
-    ;
-  dst[n] = SPDR;
 
 #else  // OPTIMIZE_HARDWARE_SPI
 
@@ -432,6 +730,20 @@ uint8_t Sd2Card::readData(uint32_t block,
 #endif  // OPTIMIZE_HARDWARE_SPI
 
   offset_ += count;
+#if USE_SD_CRC
+  if (crc_ && offset == 0 && count == 512) {
+    // whole block, check its CRC instead of skipping it
+    uint16_t crc = (uint16_t)spiRec() << 8;
+    crc |= spiRec();
+    chipSelectHigh();
+    inBlock_ = 0;
+    if (crc != crc16(dst, 512)) {
+      error(SD_CARD_ERROR_READ_CRC);
+      goto fail;
+    }
+    return true;
+  }
+#endif  // USE_SD_CRC
   if (!partialBlockRead_ || offset_ >= 512) {
     // read rest of data, checksum and set chip select high
     readEnd();
@@ -440,6 +752,9 @@ uint8_t Sd2Card::readData(uint32_t block,
 
  fail:
   chipSelectHigh();
+#if SD_LATENCY_STATS
+  if (timed) latencyRecord(SD_LATENCY_READ, t0);  // timeouts count too
+#endif
   return false;
 }
 //------------------------------------------------------------------------------
@@ -486,6 +801,35 @@ uint8_t Sd2Card::readRegister(uint8_t cmd, void* buf) {
   return false;
 }
 //------------------------------------------------------------------------------
+/**
+ * Read the card's 64 byte SD Status register (ACMD13).  It holds the
+ * allocation unit (AU) size, the speed class and the erase timing.
+ *
+ * \param[out] buf Buffer for the 64 bytes, most significant byte first.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::readSdStatus(void* buf) {
+  uint8_t* dst = reinterpret_cast<uint8_t*>(buf);
+  if (cardAcmd(ACMD13, 0)) {
+    error(SD_CARD_ERROR_ACMD13);
+    goto fail;
+  }
+  spiRec();  // second byte of the R2 response
+  if (!waitStartBlock()) goto fail;
+  // transfer data
+  for (uint8_t i = 0; i < 64; i++) dst[i] = spiRec();
+  spiRec();  // get first crc byte
+  spiRec();  // get second crc byte
+  chipSelectHigh();
+  return true;
+
+ fail:
+  chipSelectHigh();
+  return false;
+}
+//------------------------------------------------------------------------------
 /**
  * Set the SPI clock rate.
  *
@@ -527,21 +871,64 @@ uint8_t Sd2Card::setSckRate(uint8_t sckRateID) {
   return true;
 }
 //------------------------------------------------------------------------------
+// chip select and SPI pins, SPI enabled at the init rate of F_CPU/128
+uint8_t Sd2Card::spiBegin(uint8_t chipSelectPin) {
+  chipSelectPin_ = chipSelectPin;
+#ifdef SD_FIXED_CHIP_SELECT_PIN
+  if (chipSelectPin != SD_FIXED_CHIP_SELECT_PIN) {
+    error(SD_CARD_ERROR_CHIP_SELECT);
+    return false;
+  }
+#endif  // SD_FIXED_CHIP_SELECT_PIN
+  // set pin modes
+  pinMode(chipSelectPin_, OUTPUT);
+  digitalWrite(chipSelectPin_, HIGH);
+#ifndef USE_SPI_LIB
+  pinMode(SPI_MISO_PIN, INPUT);
+  pinMode(SPI_MOSI_PIN, OUTPUT);
+  pinMode(SPI_SCK_PIN, OUTPUT);
+#endif
+
+#ifndef SOFTWARE_SPI
+#ifndef USE_SPI_LIB
+  // SS must be in output mode even it is not chip select
+  pinMode(SS_PIN, OUTPUT);
+  digitalWrite(SS_PIN, HIGH); // disable any SPI device using hardware SS pin
+  // Enable SPI, Master, clock rate f_osc/128
+  SPCR = (1 << SPE) | (1 << MSTR) | (1 << SPR1) | (1 << SPR0);
+  // clear double speed
+  SPSR &= ~(1 << SPI2X);
+#else // USE_SPI_LIB
+  SPI.begin();
+  settings = SPISettings(250000, MSBFIRST, SPI_MODE0);
+#endif // USE_SPI_LIB
+#endif // SOFTWARE_SPI
+  return true;
+}
+//------------------------------------------------------------------------------
 // wait for card to go not busy
 uint8_t Sd2Card::waitNotBusy(uint16_t timeoutMillis) {
   uint16_t t0 = millis();
+#if SD_LATENCY_STATS
+  uint32_t start = micros();
+#endif
+  uint8_t ready;
   do {
-    if (spiRec() == 0XFF) return true;
+    if ((ready = (spiRec() == 0XFF))) break;
   }
   while (((uint16_t)millis() - t0) < timeoutMillis);
-  return false;
+#if SD_LATENCY_STATS
+  latencyRecord(SD_LATENCY_BUSY, start);
+#endif
+  return ready;
 }
 //------------------------------------------------------------------------------
 /** Wait for start block token */
 uint8_t Sd2Card::waitStartBlock(void) {
   uint16_t t0 = millis();
+  uint16_t timeout = busyLimit(SD_READ_TIMEOUT);
   while ((status_ = spiRec()) == 0XFF) {
-    if (((uint16_t)millis() - t0) > SD_READ_TIMEOUT) {
+    if (((uint16_t)millis() - t0) > timeout) {
       error(SD_CARD_ERROR_READ_TIMEOUT);
       goto fail;
     }
@@ -570,78 +957,137 @@ uint8_t Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
   // don't allow write to first block
   if (blockNumber == 0) {
     error(SD_CARD_ERROR_WRITE_BLOCK_ZERO);
-    goto fail;
+    chipSelectHigh();
+    return false;
   }
 #endif  // SD_PROTECT_BLOCK_ZERO
-
+  return writeSingle(blockNumber, src);
+}
+//------------------------------------------------------------------------------
+/**
+ * Check the card status (CMD13) if there were single block writes since
+ * the last check, see SD_WRITE_STATUS_EVERY.  The status bits are cleared
+ * by reading them, so this covers all of those writes.
+ *
+ * \return The value one, true, is returned if there were none or the card
+ * reports no error, the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::writeCheck(void) {
+  if (!writesUnchecked_) return true;
+  writesUnchecked_ = 0;
+  // response is r2 so get and check two bytes for nonzero
+  if (cardCommand(CMD13, 0) || spiRec()) {
+    error(SD_CARD_ERROR_WRITE_PROGRAMMING);
+    chipSelectHigh();
+    return false;
+  }
+  chipSelectHigh();
+  return true;
+}
+//------------------------------------------------------------------------------
+/**
+ * Writes block zero, the Master Boot Record, which writeBlock() refuses
+ * when SD_PROTECT_BLOCK_ZERO is set.  Only for formatting the card.
+ *
+ * \param[in] src Pointer to the location of the data to be written.
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+uint8_t Sd2Card::writeMbr(const uint8_t* src) {
+  return writeSingle(0, src);
+}
+//------------------------------------------------------------------------------
+// single block write, CMD24 through programming, CMD13 when it is due
+uint8_t Sd2Card::writeSingle(uint32_t blockNumber, const uint8_t* src) {
+#if SD_LATENCY_STATS
+  uint32_t t0 = micros();
+  latencyBlock_ = blockNumber;
+#endif
   // use address if not SDHC card
   if (type() != SD_CARD_TYPE_SDHC) blockNumber <<= 9;
-  if (cardCommand(CMD24, blockNumber)) {
-    error(SD_CARD_ERROR_CMD24);
-    goto fail;
+  for (uint8_t retry = 0;; retry++) {
+    if (cardCommand(CMD24, blockNumber)) {
+      error(SD_CARD_ERROR_CMD24);
+      goto fail;
+    }
+    if (writeData(DATA_START_BLOCK, src)) break;
+    // rejected for its CRC, or sent with a byte missing: send it again
+    if (errorClass() != SD_ERROR_CLASS_CRC || retry == SD_CRC_RETRIES) {
+      goto fail;
+    }
   }
-  if (!writeData(DATA_START_BLOCK, src)) goto fail;
 
   // wait for flash programming to complete
   if (!waitNotBusy(SD_WRITE_TIMEOUT)) {
     error(SD_CARD_ERROR_WRITE_TIMEOUT);
     goto fail;
   }
-  // response is r2 so get and check two bytes for nonzero
-  if (cardCommand(CMD13, 0) || spiRec()) {
-    error(SD_CARD_ERROR_WRITE_PROGRAMMING);
-    goto fail;
+  // the data response token said accepted, CMD13 only every so often
+  if (writesUnchecked_ < 0XFF) writesUnchecked_++;
+  if (SD_WRITE_STATUS_EVERY && writesUnchecked_ >= SD_WRITE_STATUS_EVERY) {
+    if (!writeCheck()) goto fail;
   }
   chipSelectHigh();
+#if SD_LATENCY_STATS
+  latencyRecord(SD_LATENCY_WRITE, t0);
+#endif
   return true;
 
  fail:
   chipSelectHigh();
+#if SD_LATENCY_STATS
+  latencyRecord(SD_LATENCY_WRITE, t0);
+#endif
   return false;
 }
 //------------------------------------------------------------------------------
 /** Write one data block in a multiple block write sequence */
 uint8_t Sd2Card::writeData(const uint8_t* src) {
+#if SD_LATENCY_STATS
+  uint32_t t0 = micros();
+#endif
+  uint8_t ok;
   // wait for previous write to finish
   if (!waitNotBusy(SD_WRITE_TIMEOUT)) {
     error(SD_CARD_ERROR_WRITE_MULTIPLE);
     chipSelectHigh();
-    return false;
+    ok = false;
+  } else {
+    ok = writeData(WRITE_MULTIPLE_TOKEN, src);
   }
-  return writeData(WRITE_MULTIPLE_TOKEN, src);
+#if SD_LATENCY_STATS
+  latencyRecord(SD_LATENCY_WRITE_MULTIPLE, t0);
+  latencyBlock_++;
+#endif
+  return ok;
 }
 //------------------------------------------------------------------------------
 // send one block of data for write block or write multiple blocks
 uint8_t Sd2Card::writeData(uint8_t token, const uint8_t* src) {
+  uint8_t collision = 0;
+  uint16_t crc = 0XFFFF;  // dummy crc
+#if USE_SD_CRC
+  if (crc_) crc = crc16(src, 512);
+#endif  // USE_SD_CRC
+  spiSend(token);
 #ifdef OPTIMIZE_HARDWARE_SPI
-
-  // send data - optimized loop
-  SPDR = token;
-
-  // send two byte per iteration
-  for (uint16_t i = 0; i < 512; i += 2) {
-    while (!(SPSR & (1 << SPIF)))
-      ;
-    SPDR = src[i];
-    while (!(SPSR & (1 << SPIF)))
-      ;
-    SPDR = src[i+1];
-  }
-
-  // wait for last data byte
-  while (!(SPSR & (1 << SPIF)))
-    ;
-
+  // send data - block kernel
+  collision = spiSendBlock(src, 512);
 #else  // OPTIMIZE_HARDWARE_SPI
-  spiSend(token);
   for (uint16_t i = 0; i < 512; i++) {
     spiSend(src[i]);
   }
 #endif  // OPTIMIZE_HARDWARE_SPI
-  spiSend(0xff);  // dummy crc
-  spiSend(0xff);  // dummy crc
+  spiSend(crc >> 8);
+  spiSend(crc);
 
   status_ = spiRec();
+  if (collision) {
+    // the card took a block with a byte missing
+    error(SD_CARD_ERROR_SPI_COLLISION);
+    chipSelectHigh();
+    return false;
+  }
   if ((status_ & DATA_RES_MASK) != DATA_RES_ACCEPTED) {
     error(SD_CARD_ERROR_WRITE);
     chipSelectHigh();
@@ -653,7 +1099,10 @@ uint8_t Sd2Card::writeData(uint8_t token, const uint8_t* src) {
 /** Start a write multiple blocks sequence.
  *
  * \param[in] blockNumber Address of first block in sequence.
- * \param[in] eraseCount The number of blocks to be pre-erased.
+ * \param[in] eraseCount The number of blocks to be pre-erased.  Pass the
+ * number that will actually be written, or zero if it isn't known (ACMD23
+ * isn't sent then).  A count that is too big makes the card erase blocks
+ * past the end of the write.
  *
  * \note This function is used with writeData() and writeStop()
  * for optimized multiple block writes.
@@ -670,10 +1119,13 @@ uint8_t Sd2Card::writeStart(uint32_t blockNumber, uint32_t eraseCount) {
   }
 #endif  // SD_PROTECT_BLOCK_ZERO
   // send pre-erase count
-  if (cardAcmd(ACMD23, eraseCount)) {
+  if (eraseCount && cardAcmd(ACMD23, eraseCount)) {
     error(SD_CARD_ERROR_ACMD23);
     goto fail;
   }
+#if SD_LATENCY_STATS
+  latencyBlock_ = blockNumber;
+#endif
   // use address if not SDHC card
   if (type() != SD_CARD_TYPE_SDHC) blockNumber <<= 9;
   if (cardCommand(CMD25, blockNumber)) {
@@ -34,8 +34,23 @@ uint8_t const SPI_QUARTER_SPEED = 2;
 /**
  * USE_SPI_LIB: if set, use the SPI library bundled with Arduino IDE, otherwise
  * run with a standalone driver for AVR.
+ *
+ * The standalone driver sets the SPI registers once, in init() and
+ * setSckRate(), and keeps the bus: no transaction setup per card operation.
+ * Set USE_SPI_LIB if anything else shares the bus (nothing does on the
+ * S4-Logger).  Data blocks go through the SdSpi.h kernels either way.
+ */
+//#define USE_SPI_LIB
+/**
+ * Define SD_FIXED_CHIP_SELECT_PIN as the card's chip select, an Arduino pin
+ * number (see Sd2PinMap.h), to fix it at compile time.  chipSelectHigh() and
+ * chipSelectLow() then compile to a single sbi/cbi instead of a digitalWrite()
+ * table lookup, and it becomes SD_CHIP_SELECT_PIN, the default for init() and
+ * SD.begin().  init() refuses any other pin with SD_CARD_ERROR_CHIP_SELECT.
+ *
+ * S4-Logger: PIN_SPI_SS_SDCARD is D,4, Arduino pin 4.
  */
-#define USE_SPI_LIB
+#define SD_FIXED_CHIP_SELECT_PIN 4
 /**
  * Define MEGA_SOFT_SPI non-zero to use software SPI on Mega Arduinos.
  * Pins used are SS 10, MOSI 11, MISO 12, and SCK 13.
@@ -61,8 +76,13 @@ uint8_t const SPI_QUARTER_SPEED = 2;
  * as an output by init().  An avr processor will not function as an SPI
  * master unless SS is set to output mode.
  */
+#ifdef SD_FIXED_CHIP_SELECT_PIN
+/** The chip select pin for the SD card, fixed at compile time. */
+uint8_t const  SD_CHIP_SELECT_PIN = SD_FIXED_CHIP_SELECT_PIN;
+#else  // SD_FIXED_CHIP_SELECT_PIN
 /** The default chip select pin for the SD card is SS. */
 uint8_t const  SD_CHIP_SELECT_PIN = SS_PIN;
+#endif  // SD_FIXED_CHIP_SELECT_PIN
 // The following three pins must not be redefined for hardware SPI.
 /** SPI Master Out Slave In pin */
 uint8_t const  SPI_MOSI_PIN = MOSI_PIN;
@@ -70,10 +90,8 @@ uint8_t const  SPI_MOSI_PIN = MOSI_PIN;
 uint8_t const  SPI_MISO_PIN = MISO_PIN;
 /** SPI Clock pin */
 uint8_t const  SPI_SCK_PIN = SCK_PIN;
-/** optimize loops for hardware SPI */
-#ifndef USE_SPI_LIB
+/** optimize loops for hardware SPI, with or without USE_SPI_LIB */
 #define OPTIMIZE_HARDWARE_SPI
-#endif
 
 #else  // SOFTWARE_SPI
 // define software SPI pins so Mega can use unmodified GPS Shield
@@ -85,7 +103,13 @@ uint8_t const SPI_MOSI_PIN = 11;
 uint8_t const SPI_MISO_PIN = 12;
 /** SPI Clock pin */
 uint8_t const SPI_SCK_PIN = 13;
+#undef SD_FIXED_CHIP_SELECT_PIN  // fastDigitalWrite() would need the soft SPI pin
 #endif  // SOFTWARE_SPI
+/** SCK rate SD.begin() runs the card at once it is initialized. */
+uint8_t const SD_SCK_RATE = SPI_HALF_SPEED;
+/** Block zero reads that must pass their CRC for SD.beginAdaptive() to
+ *  settle on a rate. */
+uint8_t const SD_SCK_CHECK_READS = 8;
 //------------------------------------------------------------------------------
 /** Protect block zero from write if nonzero */
 #define SD_PROTECT_BLOCK_ZERO 1
@@ -97,6 +121,77 @@ uint16_t const SD_ERASE_TIMEOUT = 10000;
 uint16_t const SD_READ_TIMEOUT = 300;
 /** write time out ms */
 uint16_t const SD_WRITE_TIMEOUT = 600;
+/** times a command, block read or single block write that failed on a
+ *  CRC or a lost byte is tried again right away */
+uint8_t const SD_CRC_RETRIES = 2;
+/**
+ * Single block writes between CMD13 status checks.  1 checks after every
+ * writeBlock(), as the library always did.  The data response token has
+ * already said the card took the block, and the error bits CMD13 returns
+ * stay set until read, so a larger value saves a command per write and
+ * the next check still fails, it just can't say which block.  0 leaves it
+ * to writeCheck(), which SdFile::sync() and SdVolume::cacheSync() call, so
+ * an error is always reported before they say the data is on the card.
+ */
+#ifndef SD_WRITE_STATUS_EVERY
+#define SD_WRITE_STATUS_EVERY 8
+#endif  // SD_WRITE_STATUS_EVERY
+//------------------------------------------------------------------------------
+/**
+ * USE_SD_CRC: CRC support for Sd2Card::crcMode() (CMD59), which makes the
+ * card check a CRC7 on every command and a CRC16 on every data block, and
+ * Sd2Card check the CRC16 of every whole block it reads.
+ *
+ * 0 - no CRC support, crcMode() fails.
+ * 1 - CRC16 a byte at a time by shifts, small and slow.
+ * 2 - CRC16 from a 512 byte table in flash, about 0.3 ms per block.
+ */
+#ifndef USE_SD_CRC
+#define USE_SD_CRC 2
+#endif  // USE_SD_CRC
+//------------------------------------------------------------------------------
+/**
+ * Set SD_LATENCY_STATS nonzero (here or with -D) to time card operations
+ * into log2 histograms, see Sd2Card::latency().  Zero compiles all of it
+ * out.  Costs 240 bytes of RAM and a micros() call per timed operation.
+ */
+#ifndef SD_LATENCY_STATS
+#define SD_LATENCY_STATS 0
+#endif  // SD_LATENCY_STATS
+#if SD_LATENCY_STATS
+/** CMD17 single block read, command to data token (includes the busy wait) */
+uint8_t const SD_LATENCY_READ = 0;
+/** CMD24 single block write, command through programming (and CMD13 when
+ *  it is due, see SD_WRITE_STATUS_EVERY) */
+uint8_t const SD_LATENCY_WRITE = 1;
+/** one block of a CMD25 multiple block write, with the wait for the last */
+uint8_t const SD_LATENCY_WRITE_MULTIPLE = 2;
+/** CMD13 send status, command to response */
+uint8_t const SD_LATENCY_STATUS = 3;
+/** every wait for the card to stop signalling busy */
+uint8_t const SD_LATENCY_BUSY = 4;
+/** number of operation kinds timed */
+uint8_t const SD_LATENCY_KINDS = 5;
+/** histogram bins, bin n counts times from 2^n to 2^(n+1) microseconds */
+uint8_t const SD_LATENCY_BINS = 16;
+/**
+ * \struct sdLatency
+ * \brief Timing of one kind of card operation.
+ */
+struct sdLatency {
+           /** operations timed */
+  uint32_t count;
+           /** longest time in microseconds */
+  uint32_t worstMicros;
+           /** block the longest one was for */
+  uint32_t worstBlock;
+           /** log2 histogram, bin 0 also holds under 1 us, the last bin
+            *  everything from 2^15 us up.  Counts stop at 0XFFFF. */
+  uint16_t bins[SD_LATENCY_BINS];
+};
+/** Type name for sdLatency */
+typedef struct sdLatency sd_latency_t;
+#endif  // SD_LATENCY_STATS
 //------------------------------------------------------------------------------
 // SD card errors
 /** timeout error for command CMD0 */
@@ -143,6 +238,30 @@ uint8_t const SD_CARD_ERROR_WRITE_PROGRAMMING = 0X14;
 uint8_t const SD_CARD_ERROR_WRITE_TIMEOUT = 0X15;
 /** incorrect rate selected */
 uint8_t const SD_CARD_ERROR_SCK_RATE = 0X16;
+/** card did not accept ACMD13, the SD Status read */
+uint8_t const SD_CARD_ERROR_ACMD13 = 0X17;
+/** init() was given a pin other than SD_FIXED_CHIP_SELECT_PIN */
+uint8_t const SD_CARD_ERROR_CHIP_SELECT = 0X18;
+/** SPI write collision in a timed block transfer, see SdSpi.h */
+uint8_t const SD_CARD_ERROR_SPI_COLLISION = 0X19;
+/** card did not accept CMD59, or USE_SD_CRC is zero */
+uint8_t const SD_CARD_ERROR_CMD59 = 0X1A;
+/** CRC16 of a block read did not match the card's */
+uint8_t const SD_CARD_ERROR_READ_CRC = 0X1B;
+/** card did not answer CMD13 as ready in initWarm() */
+uint8_t const SD_CARD_ERROR_CMD13 = 0X1C;
+//------------------------------------------------------------------------------
+// error classes, see Sd2Card::errorClass()
+/** no error */
+uint8_t const SD_ERROR_CLASS_NONE = 0;
+/** a command or block was corrupted on the way, worth trying again now */
+uint8_t const SD_ERROR_CLASS_CRC = 1;
+/** the card stayed busy, or sent no data, for too long */
+uint8_t const SD_ERROR_CLASS_TIMEOUT = 2;
+/** no answer at all: no card, or one that lost power */
+uint8_t const SD_ERROR_CLASS_GONE = 3;
+/** the card answered and refused */
+uint8_t const SD_ERROR_CLASS_CARD = 4;
 //------------------------------------------------------------------------------
 // card types
 /** Standard capacity V1 SD card */
@@ -159,10 +278,21 @@ uint8_t const SD_CARD_TYPE_SDHC = 3;
 class Sd2Card {
  public:
   /** Construct an instance of Sd2Card. */
-  Sd2Card(void) : errorCode_(0), inBlock_(0), partialBlockRead_(0), type_(0) {}
+  Sd2Card(void) : busyBudget_(0), crc_(0), errorCode_(0), inBlock_(0),
+    partialBlockRead_(0), type_(0), writesUnchecked_(0) {
+#if SD_LATENCY_STATS
+    latencyClear();
+#endif  // SD_LATENCY_STATS
+  }
+  uint32_t allocationUnit(uint8_t* buf);
+  void busyBudget(uint16_t millis);
   uint32_t cardSize(void);
+  uint8_t crcMode(uint8_t enable);
+  /** \return true if CRC checking is on, see crcMode(). */
+  uint8_t crcMode(void) const {return crc_;}
   uint8_t erase(uint32_t firstBlock, uint32_t lastBlock);
   uint8_t eraseSingleBlockEnable(void);
+  uint8_t errorClass(void) const;
   /**
    * \return error code for last error. See Sd2Card.h for a list of error codes.
    */
@@ -185,6 +315,18 @@ class Sd2Card {
     return init(sckRateID, SD_CHIP_SELECT_PIN);
   }
   uint8_t init(uint8_t sckRateID, uint8_t chipSelectPin);
+  uint8_t initPoll(uint8_t sckRateID, uint16_t timeoutMillis);
+  uint8_t initStart(uint8_t chipSelectPin, uint16_t timeoutMillis);
+  uint8_t initWarm(uint8_t sckRateID, uint8_t chipSelectPin,
+                   uint8_t cardType, uint8_t crc);
+#if SD_LATENCY_STATS
+  /**
+   * \return Timing of one kind of operation, SD_LATENCY_READ through
+   * SD_LATENCY_BUSY.  Kept across init() so it covers remounts.
+   */
+  const sd_latency_t* latency(uint8_t kind) const {return &latency_[kind];}
+  void latencyClear(void);
+#endif  // SD_LATENCY_STATS
   void partialBlockRead(uint8_t value);
   /** Returns the current value, true or false, for partial block read. */
   uint8_t partialBlockRead(void) const {return partialBlockRead_;}
@@ -205,36 +347,60 @@ class Sd2Card {
     return readRegister(CMD9, csd);
   }
   void readEnd(void);
+  uint8_t readSdStatus(void* buf);
   uint8_t setSckRate(uint8_t sckRateID);
   /** Return the card type: SD V1, SD V2 or SDHC */
   uint8_t type(void) const {return type_;}
   uint8_t writeBlock(uint32_t blockNumber, const uint8_t* src);
+  uint8_t writeCheck(void);
   uint8_t writeData(const uint8_t* src);
+  uint8_t writeMbr(const uint8_t* src);
   uint8_t writeStart(uint32_t blockNumber, uint32_t eraseCount);
   uint8_t writeStop(void);
  private:
   uint32_t block_;
+  uint16_t busyBudget_;  // busyBudget(), 0 for none
+  uint16_t busyStart_;   // millis() when it was given
   uint8_t chipSelectPin_;
+  uint8_t crc_;
   uint8_t errorCode_;
   uint8_t inBlock_;
   uint16_t offset_;
   uint8_t partialBlockRead_;
   uint8_t status_;
   uint8_t type_;
+  uint8_t writesUnchecked_;  // writeBlock()s since the last CMD13, saturates
+#if SD_LATENCY_STATS
+  sd_latency_t latency_[SD_LATENCY_KINDS];
+  uint32_t latencyBlock_;  // block of the operation in progress
+  void latencyRecord(uint8_t kind, uint32_t startMicros);
+#endif  // SD_LATENCY_STATS
   // private functions
   uint8_t cardAcmd(uint8_t cmd, uint32_t arg) {
-    cardCommand(CMD55, 0);
-    return cardCommand(cmd, arg);
+    // a retry has to send CMD55 again, so it's done here
+    for (uint8_t retry = 0;; retry++) {
+      cardCommand(CMD55, 0);
+      if (!crcRejected(cardCommand(cmd, arg, 0)) || retry == SD_CRC_RETRIES) {
+        return status_;
+      }
+    }
+  }
+  uint16_t busyLimit(uint16_t timeoutMillis);
+  uint8_t cardCommand(uint8_t cmd, uint32_t arg,
+                      uint8_t retries = SD_CRC_RETRIES);
+  static uint8_t crcRejected(uint8_t r1) {
+    return (r1 & (0X80 | R1_COM_CRC_ERROR)) == R1_COM_CRC_ERROR;
   }
-  uint8_t cardCommand(uint8_t cmd, uint32_t arg);
   void error(uint8_t code) {errorCode_ = code;}
   uint8_t readRegister(uint8_t cmd, void* buf);
   uint8_t sendWriteCommand(uint32_t blockNumber, uint32_t eraseCount);
+  uint8_t spiBegin(uint8_t chipSelectPin);
   void chipSelectHigh(void);
   void chipSelectLow(void);
   void type(uint8_t value) {type_ = value;}
   uint8_t waitNotBusy(uint16_t timeoutMillis);
   uint8_t writeData(uint8_t token, const uint8_t* src);
+  uint8_t writeSingle(uint32_t blockNumber, const uint8_t* src);
   uint8_t waitStartBlock(void);
 };
 #endif  // Sd2Card_h
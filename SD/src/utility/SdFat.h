@@ -71,6 +71,11 @@ uint8_t const O_CREAT = 0X10;
 uint8_t const O_EXCL = 0X20;
 /** truncate the file to zero length */
 uint8_t const O_TRUNC = 0X40;
+/**
+ * Allocate in whole allocation units of the card, each new extent starting
+ * on one.  See SdVolume::allocUnit().
+ */
+uint8_t const O_ALLOC_AU = 0X80;
 
 // flags for timestamp
 /** set the file's last access date */
@@ -154,7 +159,7 @@ class SdFile : public Print {
   uint8_t close(void);
   uint8_t contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock);
   uint8_t createContiguous(SdFile* dirFile,
-          const char* fileName, uint32_t size);
+          const char* fileName, uint32_t size, uint8_t oflag = 0);
   /** \return The current cluster number for a file or directory. */
   uint32_t curCluster(void) const {return curCluster_;}
   /** \return The current position for a file or directory. */
@@ -241,6 +246,7 @@ class SdFile : public Print {
     return read(&b, 1) == 1 ? b : -1;
   }
   int16_t read(void* buf, uint16_t nbyte);
+  int16_t readInPlace(const uint8_t** data);
   int8_t readDir(dir_t* dir);
   static uint8_t remove(SdFile* dirFile, const char* fileName);
   uint8_t remove(void);
@@ -260,6 +266,7 @@ class SdFile : public Print {
    */
   uint8_t seekEnd(void) {return seekSet(fileSize_);}
   uint8_t seekSet(uint32_t pos);
+  uint8_t setContiguousSize(uint32_t size);
   /**
    * Use unbuffered reads to access this file.  Used with Wave
    * Shield ISR.  Used with Sd2Card::partialBlockRead() in WaveRP.
@@ -372,15 +379,18 @@ class SdFile : public Print {
   // bits defined in flags_
   // should be 0XF
   static uint8_t const F_OFLAG = (O_ACCMODE | O_APPEND | O_SYNC);
+  // allocate in whole allocation units, O_ALLOC_AU
+  static uint8_t const F_FILE_ALLOC_AU = 0X10;
   // available bits
-  static uint8_t const F_UNUSED = 0X30;
+  static uint8_t const F_UNUSED = 0X20;
   // use unbuffered SD read
   static uint8_t const F_FILE_UNBUFFERED_READ = 0X40;
   // sync of directory entry required
   static uint8_t const F_FILE_DIR_DIRTY = 0X80;
 
 // make sure F_OFLAG is ok
-#if ((F_UNUSED | F_FILE_UNBUFFERED_READ | F_FILE_DIR_DIRTY) & F_OFLAG)
+#if ((F_UNUSED | F_FILE_ALLOC_AU | F_FILE_UNBUFFERED_READ | F_FILE_DIR_DIRTY)\
+  & F_OFLAG)
 #error flags_ bits conflict
 #endif  // flags_ bits
 
@@ -422,7 +432,41 @@ union cache_t {
   mbr_t    mbr;
            /** Used to access to a cached FAT boot sector. */
   fbs_t    fbs;
+           /** Used to access to a cached FAT16 boot sector. */
+  fbs16_t  fbs16;
+           /** Used to access to a cached FAT32 FSINFO sector. */
+  fsinfo_t fsinfo;
+};
+//------------------------------------------------------------------------------
+/**
+ * \struct volumeGeometry
+ * \brief What SdVolume::init() works out from the MBR and BPB, kept so a
+ * remount of the same card can skip reading them.
+ */
+struct volumeGeometry {
+           /** first data block number */
+  uint32_t dataStartBlock;
+           /** FAT size in blocks */
+  uint32_t blocksPerFat;
+           /** clusters in one FAT */
+  uint32_t clusterCount;
+           /** start block for first FAT */
+  uint32_t fatStartBlock;
+           /** root start block for FAT16, cluster for FAT32 */
+  uint32_t rootDirStart;
+           /** number of entries in FAT16 root dir */
+  uint16_t rootDirEntryCount;
+           /** cluster size in blocks */
+  uint8_t  blocksPerCluster;
+           /** shift to convert cluster count to block count */
+  uint8_t  clusterSizeShift;
+           /** number of FATs on volume */
+  uint8_t  fatCount;
+           /** volume type, 16 or 32 */
+  uint8_t  fatType;
 };
+/** Type name for volumeGeometry */
+typedef struct volumeGeometry volume_geometry_t;
 //------------------------------------------------------------------------------
 /**
  * \class SdVolume
@@ -431,7 +475,7 @@ union cache_t {
 class SdVolume {
  public:
   /** Create an instance of SdVolume */
-  SdVolume(void) :allocSearchStart_(2), fatType_(0) {}
+  SdVolume(void) :allocSearchStart_(2), auShift_(AU_UNKNOWN), fatType_(0) {}
   /** Clear the cache and returns a pointer to the cache.  Used by the WaveRP
    *  recorder to do raw write to the SD card.  Not for normal apps.
    */
@@ -453,6 +497,9 @@ class SdVolume {
    */
   uint8_t init(Sd2Card* dev) { return init(dev, 1) ? true : init(dev, 0);}
   uint8_t init(Sd2Card* dev, uint8_t part);
+  uint8_t initGeometry(Sd2Card* dev, const volume_geometry_t* geometry);
+  void geometry(volume_geometry_t* geometry) const;
+  uint32_t allocUnit(void);
 
   // inline functions that return volume info
   /** \return The volume's cluster size in blocks. */
@@ -478,6 +525,20 @@ class SdVolume {
   uint32_t rootDirStart(void) const {return rootDirStart_;}
   /** return a pointer to the Sd2Card object for this volume */
   static Sd2Card* sdCard(void) {return sdCard_;}
+  /** \return true if the cache holds a block not yet written to the card */
+  static uint8_t cacheIsDirty(void) {return cacheDirty_ != 0;}
+  /**
+   * Write the cache block (and its FAT mirror) to the card if it is dirty.
+   * Used to save state quickly on power failure.  Directory entries of
+   * open files are only updated by SdFile::sync().  Also checks the status
+   * of block writes, see Sd2Card::writeCheck().
+   *
+   * \return The value one, true, is returned for success and
+   * the value zero, false, is returned for failure.
+   */
+  static uint8_t cacheSync(void) {
+    return cacheFlush() && (!sdCard_ || sdCard_->writeCheck());
+  }
 //------------------------------------------------------------------------------
 #if ALLOW_DEPRECATED_FUNCTIONS
   // Deprecated functions  - suppress cpplint warnings with NOLINT comment
@@ -498,6 +559,8 @@ class SdVolume {
   static uint8_t const CACHE_FOR_READ = 0;
   // value for action argument in cacheRawBlock to indicate cache dirty
   static uint8_t const CACHE_FOR_WRITE = 1;
+  // value of auShift_ before the card's allocation unit has been read
+  static uint8_t const AU_UNKNOWN = 0XFF;
 
   static cache_t cacheBuffer_;        // 512 byte cache for device blocks
   static uint32_t cacheBlockNumber_;  // Logical number of block in the cache
@@ -506,6 +569,8 @@ class SdVolume {
   static uint32_t cacheMirrorBlock_;  // block number for mirror FAT
 //
   uint32_t allocSearchStart_;   // start cluster for alloc search
+  uint32_t auFirst_;            // first cluster on an allocation unit boundary
+  uint8_t auShift_;             // log2 of clusters per allocation unit
   uint8_t blocksPerCluster_;    // cluster size in blocks
   uint32_t blocksPerFat_;       // FAT size in blocks
   uint32_t clusterCount_;       // clusters in one FAT
@@ -517,7 +582,11 @@ class SdVolume {
   uint16_t rootDirEntryCount_;  // number of entries in FAT16 root dir
   uint32_t rootDirStart_;       // root start block for FAT16, cluster for FAT32
   //----------------------------------------------------------------------------
-  uint8_t allocContiguous(uint32_t count, uint32_t* curCluster);
+  uint8_t allocAligned(uint32_t count, uint32_t* curCluster);
+  uint8_t allocContiguous(uint32_t count, uint32_t* curCluster,
+                          uint8_t alignAu = false);
+  uint8_t allocLink(uint32_t bgnCluster, uint32_t endCluster,
+                    uint32_t* curCluster);
   uint8_t blockOfCluster(uint32_t position) const {
           return (position >> 9) & (blocksPerCluster_ - 1);}
   uint32_t clusterStartBlock(uint32_t cluster) const {
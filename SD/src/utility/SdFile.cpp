@@ -33,7 +33,9 @@ void (*SdFile::oldDateTime_)(uint16_t& date, uint16_t& time) = NULL;  // NOLINT
 //------------------------------------------------------------------------------
 // add a cluster to a file
 uint8_t SdFile::addCluster() {
-  if (!vol_->allocContiguous(1, &curCluster_)) return false;
+  if (!vol_->allocContiguous(1, &curCluster_, flags_ & F_FILE_ALLOC_AU)) {
+    return false;
+  }
 
   // if first cluster of file link to directory entry
   if (firstCluster_ == 0) {
@@ -119,6 +121,8 @@ uint8_t SdFile::contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock) {
  * \param[in] dirFile The directory where the file will be created.
  * \param[in] fileName A valid DOS 8.3 file name.
  * \param[in] size The desired file size.
+ * \param[in] oflag O_ALLOC_AU to start the file on an allocation unit
+ * boundary and round its clusters up to whole AUs, see open().
  *
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
@@ -129,16 +133,20 @@ uint8_t SdFile::contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock) {
  *
  */
 uint8_t SdFile::createContiguous(SdFile* dirFile,
-        const char* fileName, uint32_t size) {
+        const char* fileName, uint32_t size, uint8_t oflag) {
   // don't allow zero length file
   if (size == 0) return false;
-  if (!open(dirFile, fileName, O_CREAT | O_EXCL | O_RDWR)) return false;
+  if (!open(dirFile, fileName,
+    O_CREAT | O_EXCL | O_RDWR | (oflag & O_ALLOC_AU))) {
+    return false;
+  }
 
   // calculate number of clusters needed
   uint32_t count = ((size - 1) >> (vol_->clusterSizeShift_ + 9)) + 1;
 
   // allocate clusters
-  if (!vol_->allocContiguous(count, &firstCluster_)) {
+  if (!vol_->allocContiguous(count, &firstCluster_,
+                             flags_ & F_FILE_ALLOC_AU)) {
     remove();
     return false;
   }
@@ -380,6 +388,13 @@ uint8_t SdFile::makeDir(SdFile* dir, const char* dirName) {
  * O_TRUNC - If the file exists and is a regular file, and the file is
  * successfully opened and is not read only, its length shall be truncated to 0.
  *
+ * O_ALLOC_AU - Clusters added while writing come a whole allocation unit of
+ * the card at a time, starting on an AU boundary, so the file shares no AU
+ * with other files.  The clusters past the end of the file stay in its
+ * chain and are written next time it is appended to.  A volume without a
+ * usable AU, see SdVolume::allocUnit(), or without a free one allocates as
+ * usual.
+ *
  * \note Directory files must be opened read only.  Write and truncation is
  * not allowed for directory files.
  *
@@ -535,6 +550,7 @@ uint8_t SdFile::openCachedEntry(uint8_t dirIndex, uint8_t oflag) {
   }
   // save open flags for read/write
   flags_ = oflag & (O_ACCMODE | O_SYNC | O_APPEND);
+  if (oflag & O_ALLOC_AU) flags_ |= F_FILE_ALLOC_AU;
 
   // set to start of file
   curCluster_ = 0;
@@ -718,6 +734,52 @@ int16_t SdFile::read(void* buf, uint16_t nbyte) {
   return nbyte;
 }
 //------------------------------------------------------------------------------
+/**
+ * Read from the current position to the end of its block without copying.
+ * The block is read into the volume cache and \a data is pointed at the
+ * bytes there.  They are only valid until the next call that uses the
+ * cache (any read, write, open or sync on the volume).
+ *
+ * \param[out] data Set to the first byte read, in the cache.
+ *
+ * \return The number of bytes read, at most 512 and less at the start of a
+ * file position that isn't block aligned or at end of file.  Zero at end
+ * of file, -1 for an error (see read()).
+ */
+int16_t SdFile::readInPlace(const uint8_t** data) {
+  // error if not open or write only
+  if (!isOpen() || !(flags_ & O_READ)) return -1;
+
+  // nothing left in file
+  if (curPosition_ >= fileSize_) return 0;
+
+  uint32_t block;  // raw device block number
+  uint16_t offset = curPosition_ & 0X1FF;  // offset in block
+  if (type_ == FAT_FILE_TYPE_ROOT16) {
+    block = vol_->rootDirStart() + (curPosition_ >> 9);
+  } else {
+    uint8_t blockOfCluster = vol_->blockOfCluster(curPosition_);
+    if (offset == 0 && blockOfCluster == 0) {
+      // start of new cluster
+      if (curPosition_ == 0) {
+        // use first cluster in file
+        curCluster_ = firstCluster_;
+      } else {
+        // get next cluster from FAT
+        if (!vol_->fatGet(curCluster_, &curCluster_)) return -1;
+      }
+    }
+    block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
+  }
+  uint16_t n = 512 - offset;
+  if (n > (fileSize_ - curPosition_)) n = fileSize_ - curPosition_;
+
+  if (!SdVolume::cacheRawBlock(block, SdVolume::CACHE_FOR_READ)) return -1;
+  *data = SdVolume::cacheBuffer_.data + offset;
+  curPosition_ += n;
+  return n;
+}
+//------------------------------------------------------------------------------
 /**
  * Read the next directory entry from a directory file.
  *
@@ -953,6 +1015,37 @@ uint8_t SdFile::seekSet(uint32_t pos) {
   return true;
 }
 //------------------------------------------------------------------------------
+/**
+ * Set the size recorded in a contiguous file's directory entry without
+ * changing its clusters.  For logs written with raw block writes to a
+ * file made by createContiguous(), so readers only see the part written.
+ * The current position is moved back to the new end if it was past it.
+ *
+ * \param[in] size The new file size, at most the blocks allocated.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ * Reasons for failure include file is read only, the file is not
+ * contiguous, \a size is greater than the space allocated or an I/O error.
+ */
+uint8_t SdFile::setContiguousSize(uint32_t size) {
+  uint32_t bgnBlock, endBlock;
+
+  // error if not a normal file or read-only
+  if (!isFile() || !(flags_ & O_WRITE)) return false;
+
+  // error if not contiguous or size is past the last allocated block
+  if (!contiguousRange(&bgnBlock, &endBlock)) return false;
+  if (size > ((endBlock - bgnBlock + 1) << 9)) return false;
+
+  if (curPosition_ > size && !seekSet(size)) return false;
+  fileSize_ = size;
+
+  // need to update directory entry
+  flags_ |= F_FILE_DIR_DIRTY;
+  return sync();
+}
+//------------------------------------------------------------------------------
 /**
  * The sync() call causes all modified data and directory fields
  * to be written to the storage device.
@@ -985,7 +1078,8 @@ uint8_t SdFile::sync(void) {
     // clear directory dirty
     flags_ &= ~F_FILE_DIR_DIRTY;
   }
-  return SdVolume::cacheFlush();
+  // and the status of block writes not yet checked
+  return SdVolume::cacheFlush() && SdVolume::sdCard()->writeCheck();
 }
 //------------------------------------------------------------------------------
 /**
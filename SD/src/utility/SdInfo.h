@@ -59,6 +59,10 @@ uint8_t const CMD38 = 0X26;
 uint8_t const CMD55 = 0X37;
 /** READ_OCR - read the OCR register of a card */
 uint8_t const CMD58 = 0X3A;
+/** CRC_ON_OFF - turn CRC checking of commands and data on (arg 1) or off */
+uint8_t const CMD59 = 0X3B;
+/** SD_STATUS - read the 64 byte SD Status register */
+uint8_t const ACMD13 = 0X0D;
 /** SET_WR_BLK_ERASE_COUNT - Set the number of write blocks to be
      pre-erased before writing */
 uint8_t const ACMD23 = 0X17;
@@ -72,6 +76,8 @@ uint8_t const R1_READY_STATE = 0X00;
 uint8_t const R1_IDLE_STATE = 0X01;
 /** status bit for illegal command */
 uint8_t const R1_ILLEGAL_COMMAND = 0X04;
+/** status bit for a command with a bad CRC, it was not carried out */
+uint8_t const R1_COM_CRC_ERROR = 0X08;
 /** start data token for read or write single block*/
 uint8_t const DATA_START_BLOCK = 0XFE;
 /** stop token for write multiple blocks*/
@@ -82,6 +88,8 @@ uint8_t const WRITE_MULTIPLE_TOKEN = 0XFC;
 uint8_t const DATA_RES_MASK = 0X1F;
 /** write data accepted token */
 uint8_t const DATA_RES_ACCEPTED = 0X05;
+/** write data rejected for its CRC token */
+uint8_t const DATA_RES_CRC_ERROR = 0X0B;
 //------------------------------------------------------------------------------
 typedef struct CID {
   // byte 0
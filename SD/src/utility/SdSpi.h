@@ -0,0 +1,157 @@
+#ifndef SdSpi_h
+#define SdSpi_h
+/**
+ * \file
+ * Block transfer kernels for AVR hardware SPI
+ *
+ * Sd2Card moves every 512 byte data block through these, with or without
+ * USE_SPI_LIB (inside a transaction the registers are the card's).  Two
+ * kinds:
+ *
+ * Polled, for any SCK rate: the next byte is fetched (send) or the last one
+ * stored (receive) while the current one shifts, so only the SPIF poll and
+ * one SPDR access sit between bytes.
+ *
+ * Timed, used when SCK is F_CPU/2: no polling at all.  SPDR is written
+ * every SD_SPI_BYTE_CYCLES cycles by a counted loop, the load or store and
+ * the loop overhead hidden in the 16 cycles the byte takes to shift.
+ * Unrolling buys nothing here, the nops pad out whatever the loop doesn't
+ * use.  An interrupt only stretches the gap between two bytes, and a
+ * received byte is read before the next write, so interrupts stay on.
+ *
+ * SPIF is left the way the single byte spiSend()/spiRec() expect.  The
+ * timed kernels return non-zero if the SPI saw a write collision (WCOL), a
+ * byte was lost, which only a too small SD_SPI_BYTE_CYCLES can cause.
+ * examples/SpiBench measures all of them against the line rate.
+ */
+#include <avr/io.h>
+#include <stdint.h>
+//------------------------------------------------------------------------------
+/**
+ * CPU cycles per byte in the timed kernels.  A byte shifts in 16 at
+ * F_CPU/2 and the SPI takes about one more before SPDR can be written
+ * again; receive reads SPDR a cycle before that write.  18 is 89% of the
+ * line rate with a cycle of margin.
+ */
+#ifndef SD_SPI_BYTE_CYCLES
+#define SD_SPI_BYTE_CYCLES 18
+#endif  // SD_SPI_BYTE_CYCLES
+#if SD_SPI_BYTE_CYCLES < 18 || SD_SPI_BYTE_CYCLES > 40
+#error SD_SPI_BYTE_CYCLES must be 18 to 40
+#endif  // SD_SPI_BYTE_CYCLES
+//------------------------------------------------------------------------------
+/** True if the SPI runs at F_CPU/2, the rate the timed kernels are for. */
+static inline uint8_t spiFullSpeed(void) {
+  return (SPSR & (1 << SPI2X)) && !(SPCR & ((1 << SPR1) | (1 << SPR0)));
+}
+//------------------------------------------------------------------------------
+/** Receive n > 0 bytes, polling SPIF. */
+static inline void spiRecBlockPolled(uint8_t* dst, uint16_t n) {
+  SPDR = 0XFF;
+  while (--n) {
+    while (!(SPSR & (1 << SPIF)))
+      ;
+    uint8_t b = SPDR;
+    SPDR = 0XFF;
+    // stored while the next byte shifts
+    *dst++ = b;
+  }
+  while (!(SPSR & (1 << SPIF)))
+    ;
+  *dst = SPDR;
+}
+//------------------------------------------------------------------------------
+/** Send n > 0 bytes, polling SPIF. */
+static inline void spiSendBlockPolled(const uint8_t* src, uint16_t n) {
+  SPDR = *src++;
+  while (--n) {
+    // fetched while the last byte shifts
+    uint8_t b = *src++;
+    while (!(SPSR & (1 << SPIF)))
+      ;
+    SPDR = b;
+  }
+  while (!(SPSR & (1 << SPIF)))
+    ;
+}
+//------------------------------------------------------------------------------
+/**
+ * Receive n > 1 bytes at F_CPU/2, one every SD_SPI_BYTE_CYCLES.
+ * \return non-zero on a write collision.
+ */
+static inline uint8_t spiRecBlockTimed(uint8_t* dst, uint16_t n) {
+  uint8_t ff = 0XFF;
+  uint8_t tmp;
+  uint16_t count = n - 1;
+  asm volatile(
+    // first byte, padded so it gets the same gap as the loop
+    "out %[spdr], %[ff]\n\t"
+    ".rept 6\n\t" "nop\n\t" ".endr\n\t"
+    // loop: nops + 8 cycles, read the last byte then start the next
+    "1:\n\t"
+    ".rept %[pad]\n\t" "nop\n\t" ".endr\n\t"
+    "in %[tmp], %[spdr]\n\t"
+    "out %[spdr], %[ff]\n\t"
+    "st %a[dst]+, %[tmp]\n\t"
+    "sbiw %[count], 1\n\t"
+    "brne 1b\n\t"
+    // last byte, a few cycles late so SPIF is surely set and gets cleared
+    ".rept %[tail]\n\t" "nop\n\t" ".endr\n\t"
+    "in %[ff], %[spsr]\n\t"
+    "in %[tmp], %[spdr]\n\t"
+    "st %a[dst], %[tmp]\n\t"
+    : [dst] "+e" (dst), [count] "+w" (count), [tmp] "=&r" (tmp),
+      [ff] "+r" (ff)
+    : [spdr] "I" (_SFR_IO_ADDR(SPDR)), [spsr] "I" (_SFR_IO_ADDR(SPSR)),
+      [pad] "I" (SD_SPI_BYTE_CYCLES - 8), [tail] "I" (SD_SPI_BYTE_CYCLES - 4)
+    : "memory");
+  return ff & (1 << WCOL);
+}
+//------------------------------------------------------------------------------
+/**
+ * Send n > 0 bytes at F_CPU/2, one every SD_SPI_BYTE_CYCLES.
+ * \return non-zero on a write collision.
+ */
+static inline uint8_t spiSendBlockTimed(const uint8_t* src, uint16_t n) {
+  uint8_t tmp;
+  uint8_t status;
+  asm volatile(
+    // loop: 7 cycles + nops, fetch and start a byte
+    "1:\n\t"
+    "ld %[tmp], %a[src]+\n\t"
+    "out %[spdr], %[tmp]\n\t"
+    ".rept %[pad]\n\t" "nop\n\t" ".endr\n\t"
+    "sbiw %[n], 1\n\t"
+    "brne 1b\n\t"
+    // wait out the last byte, then clear SPIF
+    ".rept 5\n\t" "nop\n\t" ".endr\n\t"
+    "in %[status], %[spsr]\n\t"
+    "in %[tmp], %[spdr]\n\t"
+    : [src] "+e" (src), [n] "+w" (n), [tmp] "=&r" (tmp),
+      [status] "=&r" (status)
+    : [spdr] "I" (_SFR_IO_ADDR(SPDR)), [spsr] "I" (_SFR_IO_ADDR(SPSR)),
+      [pad] "I" (SD_SPI_BYTE_CYCLES - 7)
+    : "memory");
+  return status & (1 << WCOL);
+}
+//------------------------------------------------------------------------------
+/**
+ * Receive n bytes, timed at F_CPU/2, polled otherwise.
+ * \return non-zero on a write collision.
+ */
+static inline uint8_t spiRecBlock(uint8_t* dst, uint16_t n) {
+  if (n > 1 && spiFullSpeed()) return spiRecBlockTimed(dst, n);
+  if (n) spiRecBlockPolled(dst, n);
+  return 0;
+}
+//------------------------------------------------------------------------------
+/**
+ * Send n bytes, timed at F_CPU/2, polled otherwise.
+ * \return non-zero on a write collision.
+ */
+static inline uint8_t spiSendBlock(const uint8_t* src, uint16_t n) {
+  if (n && spiFullSpeed()) return spiSendBlockTimed(src, n);
+  if (n) spiSendBlockPolled(src, n);
+  return 0;
+}
+#endif  // SdSpi_h
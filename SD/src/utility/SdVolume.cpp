@@ -27,8 +27,54 @@ Sd2Card* SdVolume::sdCard_;          // pointer to SD card object
 uint8_t  SdVolume::cacheDirty_ = 0;  // cacheFlush() will write block if true
 uint32_t SdVolume::cacheMirrorBlock_ = 0;  // mirror  block for second FAT
 //------------------------------------------------------------------------------
-// find a contiguous group of clusters
-uint8_t SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
+// find free whole allocation units for count clusters, rounded up to whole
+// AUs, starting on an AU boundary
+uint8_t SdVolume::allocAligned(uint32_t count, uint32_t* curCluster) {
+  uint32_t auMask = (1UL << auShift_) - 1;
+  count = ((count - 1) | auMask) + 1;
+
+  // last cluster of FAT
+  uint32_t fatEnd = clusterCount_ + 1;
+
+  // start at the first boundary after the likely place for free clusters
+  uint32_t start = auFirst_;
+  if (allocSearchStart_ > auFirst_) {
+    start += ((allocSearchStart_ - auFirst_ - 1) | auMask) + 1;
+  }
+  uint32_t bgnCluster = start;
+  for (uint32_t endCluster = bgnCluster;; endCluster++) {
+    if (bgnCluster + count - 1 > fatEnd) {
+      // past end - start from the first boundary, once
+      if (start == auFirst_) return false;
+      bgnCluster = endCluster = start = auFirst_;
+    }
+    uint32_t f;
+    if (!fatGet(endCluster, &f)) return false;
+
+    if (f != 0) {
+      // cluster in use try the next boundary as bgnCluster
+      bgnCluster = auFirst_ + ((endCluster - auFirst_) | auMask) + 1;
+      endCluster = bgnCluster - 1;
+    } else if ((endCluster - bgnCluster + 1) == count) {
+      // done - found space
+      return allocLink(bgnCluster, endCluster, curCluster);
+    }
+  }
+}
+//------------------------------------------------------------------------------
+// find a contiguous group of clusters, in whole allocation units if alignAu
+// and allocUnit() gives one
+uint8_t SdVolume::allocContiguous(uint32_t count,
+                                  uint32_t* curCluster, uint8_t alignAu) {
+  // new extent on a boundary, unless the file ends inside an AU
+  if (alignAu && allocUnit()) {
+    uint32_t next = *curCluster + 1;
+    if (*curCluster == 0 || (next >= auFirst_ &&
+      ((next - auFirst_) & ((1UL << auShift_) - 1)) == 0)) {
+      if (allocAligned(count, curCluster)) return true;
+    }
+    // no free AU left - fall back to any free clusters
+  }
   // start of group
   uint32_t bgnCluster;
 
@@ -75,6 +121,18 @@ uint8_t SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
       break;
     }
   }
+  if (!allocLink(bgnCluster, endCluster, curCluster)) return false;
+
+  // remember possible next free cluster
+  if (setStart) allocSearchStart_ = bgnCluster + 1;
+
+  return true;
+}
+//------------------------------------------------------------------------------
+// chain the free clusters bgnCluster to endCluster and link them after
+// *curCluster if it isn't zero.  Returns the first in *curCluster
+uint8_t SdVolume::allocLink(uint32_t bgnCluster, uint32_t endCluster,
+                            uint32_t* curCluster) {
   // mark end of chain
   if (!fatPutEOC(endCluster)) return false;
 
@@ -89,13 +147,38 @@ uint8_t SdVolume::allocContiguous(uint32_t count, uint32_t* curCluster) {
   }
   // return first cluster number to caller
   *curCluster = bgnCluster;
-
-  // remember possible next free cluster
-  if (setStart) allocSearchStart_ = bgnCluster + 1;
-
   return true;
 }
 //------------------------------------------------------------------------------
+/**
+ * The allocation unit files opened with O_ALLOC_AU are allocated in.  The
+ * card's AU, Sd2Card::allocationUnit(), is read the first time it is needed
+ * after init().  Only its largest power of two factor is used, a 12MB or
+ * 24MB AU is treated as 4MB or 8MB.
+ *
+ * \return Clusters per allocation unit, or zero if the policy is off for
+ * this volume: the card doesn't give its AU, the AU isn't larger than a
+ * cluster or the clusters don't line up with AU boundaries.
+ */
+uint32_t SdVolume::allocUnit(void) {
+  if (auShift_ == AU_UNKNOWN) {
+    uint32_t au = sdCard_->allocationUnit(cacheClear());
+    au &= ~(au - 1);
+    auShift_ = 0;
+    if (au > blocksPerCluster_) {
+      // blocks from the start of the data region to the next AU boundary
+      uint32_t offset = (au - (dataStartBlock_ & (au - 1))) & (au - 1);
+      if ((offset & (blocksPerCluster_ - 1)) == 0) {
+        auFirst_ = 2 + (offset >> clusterSizeShift_);
+        uint8_t shift = 1;
+        while (((uint32_t)blocksPerCluster_ << shift) < au) shift++;
+        auShift_ = shift;
+      }
+    }
+  }
+  return auShift_ ? 1UL << auShift_ : 0;
+}
+//------------------------------------------------------------------------------
 uint8_t SdVolume::cacheFlush(void) {
   if (cacheDirty_) {
     if (!sdCard_->writeBlock(cacheBlockNumber_, cacheBuffer_.data)) {
@@ -209,6 +292,20 @@ uint8_t SdVolume::freeChain(uint32_t cluster) {
   return true;
 }
 //------------------------------------------------------------------------------
+/** Copy out the geometry init() found, for initGeometry() on a remount. */
+void SdVolume::geometry(volume_geometry_t* geometry) const {
+  geometry->blocksPerCluster = blocksPerCluster_;
+  geometry->blocksPerFat = blocksPerFat_;
+  geometry->clusterCount = clusterCount_;
+  geometry->clusterSizeShift = clusterSizeShift_;
+  geometry->dataStartBlock = dataStartBlock_;
+  geometry->fatCount = fatCount_;
+  geometry->fatStartBlock = fatStartBlock_;
+  geometry->fatType = fatType_;
+  geometry->rootDirEntryCount = rootDirEntryCount_;
+  geometry->rootDirStart = rootDirStart_;
+}
+//------------------------------------------------------------------------------
 /**
  * Initialize a FAT volume.
  *
@@ -227,6 +324,7 @@ uint8_t SdVolume::freeChain(uint32_t cluster) {
 uint8_t SdVolume::init(Sd2Card* dev, uint8_t part) {
   uint32_t volumeStartBlock = 0;
   sdCard_ = dev;
+  auShift_ = AU_UNKNOWN;
   // if part == 0 assume super floppy with FAT boot sector in block zero
   // if part > 0 assume mbr volume with partition table
   if (part) {
@@ -293,3 +391,38 @@ uint8_t SdVolume::init(Sd2Card* dev, uint8_t part) {
   }
   return true;
 }
+//------------------------------------------------------------------------------
+/**
+ * Initialize a FAT volume from the geometry an earlier init() found on the
+ * same card, see geometry().  Nothing is read from the card, so it is up to
+ * the caller to know the card and its volume haven't changed since.
+ *
+ * \param[in] dev The Sd2Card where the volume is located.
+ * \param[in] geometry What geometry() returned after the earlier init().
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.  Failure means the
+ * geometry isn't one init() could have found.
+ */
+uint8_t SdVolume::initGeometry(Sd2Card* dev,
+                               const volume_geometry_t* geometry) {
+  if ((geometry->fatType != 16 && geometry->fatType != 32) ||
+    geometry->clusterSizeShift > 7 ||
+    geometry->blocksPerCluster != (1 << geometry->clusterSizeShift) ||
+    geometry->fatCount == 0) {
+    return false;
+  }
+  sdCard_ = dev;
+  auShift_ = AU_UNKNOWN;
+  blocksPerCluster_ = geometry->blocksPerCluster;
+  blocksPerFat_ = geometry->blocksPerFat;
+  clusterCount_ = geometry->clusterCount;
+  clusterSizeShift_ = geometry->clusterSizeShift;
+  dataStartBlock_ = geometry->dataStartBlock;
+  fatCount_ = geometry->fatCount;
+  fatStartBlock_ = geometry->fatStartBlock;
+  fatType_ = geometry->fatType;
+  rootDirEntryCount_ = geometry->rootDirEntryCount;
+  rootDirStart_ = geometry->rootDirStart;
+  return true;
+}
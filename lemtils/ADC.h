@@ -2,6 +2,7 @@
 #define ADC_H
 
 #include <avr/io.h>
+#include <stdbool.h>
 
 #ifndef VREF
 #  error "Define VREF before including lemtils/ADC.h"
@@ -23,35 +24,106 @@
  *  - Can use something like "#define PHOTOCELL 0" and then ADC_Value(PHOTOCELL) to get value from PC0.
  *  - First use ADC_SetAsInput(PHOTOCELL) though to set that pin PCx as an input.
  *  - Can get values from pins PC0 through PC5, pass 0-5 to ADC_Value(pin).
+ *  - Sampler (no busy waiting): call ADC_SamplerInterrupt(); from your ISR(ADC_vect), then
+ *      ADC_SamplerStart(channels, count, 2, ADC_ONE_PASS); // One 12-bit result per channel, then stops
+ *      while (ADC_SamplerRead(&sample)) { sample.channel, sample.value }
+ *    Oversampling takes 4^bits conversions per result and decimates by 2^bits, so 10+bits bits of result.
  *
  * Pins Used:
  *  DDRC - Whichever pin is called to be checked on DDRC
  *
  * Definitions:
  *  VREF 5 // <- 5V operating voltage (will need to change this if using 3.3V)
+ *  ADC_MAX_CHANNELS 6 // Channels in the sampler's round robin
+ *  ADC_SAMPLE_BUFFER_SIZE 8 // Finished results waiting for ADC_SamplerRead(), power of 2
  *  
  * Functions:
  *  ADC_Initialize(); // Initializes the ADC (ADLAR, Voltage reference is AVcc, Prescaler 128, enables ADC)
  *  uint8_t ADC_Value(uint8_t pin); // Returns the ADC measured value at PCx (x = PIN) as an 8-bit value [0-255]
  *  ADC_SetAsInput(uint8_t pin); // Sets the pin (PCx) as an input for use with the ADC
  *  int ADC_Millivolts(uint8_t pin); // Returns the ADC measured value in millivolts at PCx (x = PIN) as an int (with respect to VREF)
- *  double ADC_Volts(uint8_t pin); // Returns the ADC measured value in Volts at PCx (x = PIN) as an int (with respect to VREF)
+ *  uint16_t ADC_Volts(uint8_t pin); // Returns the ADC measured value in Volts at PCx (x = PIN) as Q8.8 fixed point (/256 for Volts) (with respect to VREF)
+ *  void ADC_SamplerStart(const uint8_t *channels, uint8_t count, uint8_t oversample_bits, uint8_t trigger); // Round robins channels from the ADC ISR
+ *  void ADC_SamplerStop(); // Stops the sampler, ADC_Value() can be used again
+ *  void ADC_SamplerHalt(); // From an ISR: no more conversions or interrupts, without waiting. ADC_SamplerStop() later.
+ *  bool ADC_SamplerRead(struct an_adc_sample *sample); // Takes the oldest finished result, false if there are none
+ *  bool ADC_SamplerIsBusy(); // Converting (the ADC and its interrupt need the CPU out of power down)
+ *  bool ADC_SamplerInterrupt(); // Call from ISR(ADC_vect). True when it finished a result, which is also in ADC_SamplerLatest.
  *  + more...
+ *
+ * Triggers:
+ *  ADC_FREE_RUNNING         // Back to back conversions, ~9.6k/s at prescaler 128
+ *  ADC_ONE_PASS             // Free running until every channel has one result, then stops
+ *  ADC_TRIGGER_TIMER0_COMPA // One conversion per Timer0 compare match (~1k/s with the Arduino core's Timer0)
+ *  ADC_TRIGGER_TIMER1_COMPB // One conversion per Timer1 compare match B (set Timer1 up yourself)
+ *
+ * Notes:
+ *  - Oversampling only adds resolution if there's at least ~1 LSB of noise on the input.
+ *  - The first result after switching channels is thrown away (the conversion already running used the old channel).
+ *  - Results are right adjusted 10+bits values, full scale = VREF.
  */ 
 
 
+#ifndef ADC_MAX_CHANNELS
+#define ADC_MAX_CHANNELS 6
+#endif
+#ifndef ADC_SAMPLE_BUFFER_SIZE
+#define ADC_SAMPLE_BUFFER_SIZE 8
+#endif
+
+#if (ADC_SAMPLE_BUFFER_SIZE & (ADC_SAMPLE_BUFFER_SIZE - 1))
+#  error "ADC_SAMPLE_BUFFER_SIZE must be a power of 2"
+#endif
+
+// VREF scaled at compile time, so nothing here needs float math at run time
+#define _ADC_VREF_MV ((uint32_t)((VREF) * 1000.0 + 0.5)) // [mV]
+#define _ADC_VREF_Q8 ((uint32_t)((VREF) * 256.0 + 0.5))  // [V, Q8.8]
+
+// Sampler triggers, low 3 bits are ADTS2:0
+#define ADC_FREE_RUNNING         0x00
+#define ADC_TRIGGER_TIMER0_COMPA 0x03
+#define ADC_TRIGGER_TIMER1_COMPB 0x05
+#define ADC_ONE_PASS             0x80
+
+struct an_adc_sample {
+	uint8_t channel;
+	uint16_t value; // 10 + oversample_bits bits
+};
+
+volatile struct an_adc_sample _adc_buffer[ADC_SAMPLE_BUFFER_SIZE];
+volatile uint8_t _adc_head = 0; // Written by the ISR
+volatile uint8_t _adc_tail = 0; // Written by ADC_SamplerRead()
+volatile uint8_t ADC_SamplerOverflows = 0; // Results dropped because the buffer was full
+struct an_adc_sample ADC_SamplerLatest; // Last result finished, for ISR-side use straight after ADC_SamplerInterrupt() returns true
+uint8_t _adc_channels[ADC_MAX_CHANNELS];
+uint8_t _adc_channel_count = 0;
+volatile uint8_t _adc_index = 0;
+uint8_t _adc_bits = 0;
+uint8_t _adc_trigger = ADC_FREE_RUNNING;
+volatile uint16_t _adc_sum = 0;        // 64 * 1023 fits, so up to 3 oversample bits
+volatile uint8_t _adc_taken = 0;
+volatile uint8_t _adc_discard = 0;
+volatile bool _adc_busy = false;
+uint8_t _adc_saved_admux = 0;
+
 int ADC_Millivolts(uint8_t pin);
-double ADC_Volts(uint8_t pin);
+uint16_t ADC_Volts(uint8_t pin);
 void ADC_Initialize();
 uint8_t ADC_Value(uint8_t pin);
 void ADC_SetAsInput(uint8_t pin);
+void ADC_SamplerStart(const uint8_t *channels, uint8_t count, uint8_t oversample_bits, uint8_t trigger);
+void ADC_SamplerStop(void);
+void ADC_SamplerHalt(void);
+bool ADC_SamplerRead(struct an_adc_sample *sample);
+bool ADC_SamplerIsBusy(void);
+bool ADC_SamplerInterrupt(void);
 
 // Initializes the ADC (ADLAR, Voltage reference is AVcc, Prescaler 128, enables ADC)
 void ADC_Initialize()
 {
 	ADMUX |= _BV(ADLAR); // ADCH register now contains the 8 MSB
 	ADMUX |= _BV(REFS0); // Voltage Reference Selection is internal AVcc (VREF)
-	ADCSRA |= (_BV(ADPS1) | _BV(ADPS1) | _BV(ADPS0)); // Set ADC clock with prescale 128
+	ADCSRA |= (_BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0)); // Set ADC clock with prescale 128 (125kHz at 16MHz)
 	ADCSRA |= _BV(ADEN); // Enables the ADC
 }
 
@@ -88,16 +160,126 @@ uint8_t ADC_Value(uint8_t pin)
 
 int ADC_Millivolts(uint8_t pin) // Returns the ADC measured value in millivolts at PCx (x = PIN) as an int (with respect to VREF)
 {
-  // Vin = (Reading * VREF * 3.90625) because Vin is now in millivolts (3.9 mV per bit? 1/256 (for V) * 1000 (mV / V) = 3.9)
-  // (double)((1/256)*1000) yields 3.90625 mV, as in mV per division, where ADC_Value yields 256 divisions
-  // Below is basically   x/256  *  VREF, where x is  between 0 and 255
-  return (int)( ADC_Value(pin) * VREF * (double)(1000/256) );
+  // Vin = Reading/256 * VREF. VREF in mV is the Q8 gain (mV per 1/256th), so: (Reading * VREF_mV + 128) >> 8, rounded
+  return (int)( ((uint32_t)ADC_Value(pin) * _ADC_VREF_MV + 128) >> 8 );
+}
+
+
+uint16_t ADC_Volts(uint8_t pin) // Returns the ADC measured value in Volts at PCx (x = PIN) as Q8.8 fixed point (/256 for Volts) (with respect to VREF)
+{
+	// Volts * 256 = Reading/256 * VREF * 256 = Reading * VREF
+	return (uint16_t)( ((uint32_t)ADC_Value(pin) * _ADC_VREF_Q8 + 128) >> 8 );
+}
+
+
+// Round robins channels (0-7, PCx) from the ADC ISR, oversample_bits 0-3 extra bits per result
+void ADC_SamplerStart(const uint8_t *channels, uint8_t count, uint8_t oversample_bits, uint8_t trigger)
+{
+	uint8_t i;
+
+	ADCSRA &= ~(_BV(ADATE) | _BV(ADIE)); // Stop whatever was running
+	if (count > ADC_MAX_CHANNELS) {count = ADC_MAX_CHANNELS;}
+	if (count == 0) {return;}
+	if (oversample_bits > 3) {oversample_bits = 3;}
+
+	if (!_adc_busy) {_adc_saved_admux = ADMUX;}
+	for (i = 0; i < count; i++) {
+		_adc_channels[i] = channels[i] & 0x07;
+		if (_adc_channels[i] < 6) {DIDR0 |= _BV(_adc_channels[i]);} // Digital input buffer off, saves power and noise
+	}
+	_adc_channel_count = count;
+	_adc_bits = oversample_bits;
+	_adc_trigger = trigger;
+	_adc_index = 0;
+	_adc_sum = 0;
+	_adc_taken = 0;
+	_adc_discard = 1; // First conversion after setting up the mux settles
+	_adc_busy = true;
+
+	ADMUX = _BV(REFS0) | _adc_channels[0]; // AVcc reference, right adjusted
+	ADCSRB = (ADCSRB & ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0))) | (trigger & 0x07);
+	ADCSRA = _BV(ADEN) | _BV(ADATE) | _BV(ADIE) | _BV(ADIF) | _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0); // Writing ADIF clears it
+	if ((trigger & 0x07) == ADC_FREE_RUNNING) {ADCSRA |= _BV(ADSC);} // Free running needs the first one started
+}
+
+
+// Stops the sampler, ADC_Value() can be used again
+void ADC_SamplerStop(void)
+{
+	ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+	while (ADCSRA & _BV(ADSC)); // Let a conversion in progress finish (at most 13 ADC clocks, ~104us)
+	if (_adc_busy) {ADMUX = _adc_saved_admux;}
+	_adc_busy = false;
+}
+
+
+// From an ISR: no more conversions or interrupts, without waiting. One in progress finishes on its own, ADC_SamplerStop() later.
+void ADC_SamplerHalt(void)
+{
+	ADCSRA &= ~(_BV(ADATE) | _BV(ADIE));
+}
+
+
+// Takes the oldest finished result, false if there are none
+bool ADC_SamplerRead(struct an_adc_sample *sample)
+{
+	if (_adc_tail == _adc_head) {return false;}
+	sample->channel = _adc_buffer[_adc_tail].channel;
+	sample->value = _adc_buffer[_adc_tail].value;
+	_adc_tail = (_adc_tail + 1) & (ADC_SAMPLE_BUFFER_SIZE - 1);
+	return true;
 }
 
 
-double ADC_Volts(uint8_t pin) // Returns the ADC measured value in Volts at PCx (x = PIN) as an int (with respect to VREF)
+// Converting (the ADC and its interrupt need the CPU out of power down)
+bool ADC_SamplerIsBusy(void)
 {
-	return (double)( ADC_Value(pin) * VREF * (1/256) );
+	return _adc_busy;
 }
 
-#endif
\ No newline at end of file
+
+// Call from ISR(ADC_vect). True when it finished a result (also in ADC_SamplerLatest, even if the buffer was full).
+bool ADC_SamplerInterrupt(void)
+{
+	uint16_t value = ADC; // ADCL then ADCH
+	uint8_t next;
+
+	// Timer compare flags only trigger the ADC on their rising edge, and nothing else clears them
+	if (_adc_trigger == ADC_TRIGGER_TIMER0_COMPA) {TIFR0 = _BV(OCF0A);}
+	else if (_adc_trigger == ADC_TRIGGER_TIMER1_COMPB) {TIFR1 = _BV(OCF1B);}
+
+	if (_adc_discard) {_adc_discard--; return false;}
+
+	_adc_sum += value;
+	if (++_adc_taken < (uint8_t)(1 << (2 * _adc_bits))) {return false;}
+
+	ADC_SamplerLatest.channel = _adc_channels[_adc_index];
+	ADC_SamplerLatest.value = _adc_sum >> _adc_bits; // Decimate: 4^n samples summed, keep 10+n bits
+	next = (_adc_head + 1) & (ADC_SAMPLE_BUFFER_SIZE - 1);
+	if (next == _adc_tail) {
+		if (ADC_SamplerOverflows < 0xFF) {ADC_SamplerOverflows++;}
+	} else {
+		_adc_buffer[_adc_head].channel = ADC_SamplerLatest.channel;
+		_adc_buffer[_adc_head].value = ADC_SamplerLatest.value;
+		_adc_head = next;
+	}
+	_adc_sum = 0;
+	_adc_taken = 0;
+
+	if (++_adc_index >= _adc_channel_count) {
+		_adc_index = 0;
+		if (_adc_trigger == ADC_ONE_PASS) {
+			ADCSRA &= ~(_BV(ADATE) | _BV(ADIE)); // The conversion already started finishes on its own, unread
+			ADMUX = _adc_saved_admux;
+			_adc_busy = false;
+			return true;
+		}
+	}
+	if (_adc_channel_count > 1) {
+		ADMUX = (ADMUX & 0xF0) | _adc_channels[_adc_index];
+		_adc_discard = 1; // Already running on the old channel
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef _LEM_ACCUMULATE_H
+#define _LEM_ACCUMULATE_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Accumulate.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Running statistics of a sampled value, updated in O(1) per sample: min, max, mean, time-weighted average
+ *  and the time integral (mA -> charge, uW -> energy) over a window, plus a lifetime integral that never resets.
+ *  Summaries can then be logged at a low rate without losing anything the full rate saw.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/Accumulate.h" // Running stats and integrals. REQUIRES: accumulate_Initialize(); per value
+ *  - struct an_accumulator current; accumulate_Initialize(&current, 60000, now); // 1 minute windows
+ *  - Every sample: accumulate_Add(&current, milliamps, sample_time);
+ *  - if (accumulate_WindowIsDone(&current, now)) { accumulate_Summarize(&current, &summary, now); accumulate_NextWindow(&current, now); }
+ *  - Charge: integral [mA*ms] / 3600000 = mAh. Energy: integral [uW*ms] / 3600000 = uWh.
+ *
+ * Functions:
+ *  void accumulate_Initialize(struct an_accumulator *acc, uint32_t window_ms, uint32_t now); // Empty, window starts now
+ *  void accumulate_Add(struct an_accumulator *acc, int32_t value, uint32_t time); // One sample at time [ms]
+ *  bool accumulate_WindowIsDone(struct an_accumulator *acc, uint32_t now); // The window has run its length
+ *  void accumulate_Summarize(struct an_accumulator *acc, struct an_accumulator_summary *summary, uint32_t now); // Window so far, as a record
+ *  void accumulate_NextWindow(struct an_accumulator *acc, uint32_t now); // Starts a new window, lifetime integral carries on
+ *
+ * Notes:
+ *  - Time weighting holds each sample until the next one (zero order hold), so irregular sample times are fine.
+ *  - The integrals are 64-bit: at 2^31 units per sample (e.g. 2 kW in uW) they last ~50 days, at realistic values centuries.
+ *  - Only accumulate_Summarize() divides (64-bit), so do that at the window rate, not per sample.
+ *  - Gaps longer than ACCUMULATE_MAX_HOLD_MS (powered off, stopped) hold the last value for at most that long.
+ */
+
+#ifndef ACCUMULATE_MAX_HOLD_MS
+#define ACCUMULATE_MAX_HOLD_MS 60000UL
+#endif
+
+struct an_accumulator {
+	int64_t integral;        // Window: sum of value * ms
+	int64_t lifetime;        // Never reset: sum of value * ms
+	int64_t sum;             // Window: sum of values, for the plain mean
+	int32_t min, max, last;
+	uint32_t count;          // Window: samples
+	uint32_t window_ms;
+	uint32_t window_start;   // [ms]
+	uint32_t last_time;      // [ms] of the last sample
+	bool has_last;           // A sample has been seen (something to hold)
+};
+
+// Compact record of one window (28 bytes)
+struct an_accumulator_summary {
+	uint32_t end_time;       // [ms]
+	uint32_t duration_ms;
+	int32_t min, max;
+	int32_t mean;            // Of the samples
+	int32_t average;         // Time weighted
+	int32_t integral_s;      // Window integral in units * s (mA -> mAs, uW -> uJ)
+};
+
+void accumulate_Initialize(struct an_accumulator *acc, uint32_t window_ms, uint32_t now);
+void accumulate_Add(struct an_accumulator *acc, int32_t value, uint32_t time);
+bool accumulate_WindowIsDone(struct an_accumulator *acc, uint32_t now);
+void accumulate_Summarize(struct an_accumulator *acc, struct an_accumulator_summary *summary, uint32_t now);
+void accumulate_NextWindow(struct an_accumulator *acc, uint32_t now);
+
+
+// Empty, window starts now
+void accumulate_Initialize(struct an_accumulator *acc, uint32_t window_ms, uint32_t now)
+{
+	acc->lifetime = 0;
+	acc->window_ms = window_ms;
+	acc->has_last = false;
+	acc->last = 0;
+	acc->last_time = now;
+	accumulate_NextWindow(acc, now);
+}
+
+
+// Held value times the ms since the last sample (capped), added to both integrals
+void _accumulate_Hold(struct an_accumulator *acc, uint32_t time)
+{
+	uint32_t held;
+	int64_t area;
+	if (!acc->has_last) {return;}
+	held = time - acc->last_time;
+	if ((int32_t)held <= 0) {return;}
+	if (held > ACCUMULATE_MAX_HOLD_MS) {held = ACCUMULATE_MAX_HOLD_MS;}
+	area = (int64_t)acc->last * held;
+	acc->integral += area;
+	acc->lifetime += area;
+	acc->last_time = time;
+}
+
+
+// One sample at time [ms]
+void accumulate_Add(struct an_accumulator *acc, int32_t value, uint32_t time)
+{
+	_accumulate_Hold(acc, time);
+	if (acc->count == 0) {
+		acc->min = acc->max = value;
+	} else {
+		if (value < acc->min) {acc->min = value;}
+		if (value > acc->max) {acc->max = value;}
+	}
+	acc->sum += value;
+	acc->count++;
+	acc->last = value;
+	acc->last_time = time;
+	acc->has_last = true;
+}
+
+
+// The window has run its length
+bool accumulate_WindowIsDone(struct an_accumulator *acc, uint32_t now)
+{
+	return (now - acc->window_start) >= acc->window_ms;
+}
+
+
+// Window so far, as a record. Holds the last value up to now first.
+void accumulate_Summarize(struct an_accumulator *acc, struct an_accumulator_summary *summary, uint32_t now)
+{
+	_accumulate_Hold(acc, now);
+	summary->end_time = now;
+	summary->duration_ms = now - acc->window_start;
+	summary->min = acc->count ? acc->min : 0;
+	summary->max = acc->count ? acc->max : 0;
+	summary->mean = acc->count ? (int32_t)(acc->sum / (int32_t)acc->count) : 0;
+	summary->average = summary->duration_ms ? (int32_t)(acc->integral / (int64_t)summary->duration_ms) : 0;
+	summary->integral_s = (int32_t)(acc->integral / 1000);
+}
+
+
+// Starts a new window, the lifetime integral carries on (and the last value keeps being held)
+void accumulate_NextWindow(struct an_accumulator *acc, uint32_t now)
+{
+	_accumulate_Hold(acc, now);
+	acc->integral = 0;
+	acc->sum = 0;
+	acc->count = 0;
+	acc->min = acc->max = 0;
+	acc->window_start = now;
+}
+
+#endif
@@ -0,0 +1,502 @@
+#ifndef _LEM_BLOCKLOG_H
+#define _LEM_BLOCKLOG_H 1
+
+#include <avr/wdt.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <util/crc16.h>
+#include <SD.h>
+
+/*
+ * BlockLog.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Append-only record log in a preallocated contiguous file, written a whole 512 byte block at a time straight to the
+ *  card. Every block starts with a header (log id, sequence number, bytes used, CRC) and holds only whole records,
+ *  so a reader can pick up at any block and a torn block is simply skipped. The block being filled is rewritten with
+ *  each record, alternately in its place and in a scratch block at the end of the file, so the newest copy of it is
+ *  never the one written over.
+ *  Blocks are written in order and never skipped, so the good ones are a run from the start of the file. At mount
+ *  the end of that run is found by binary search (~log2(blocks) block reads, 16 for 32MB), the directory size is set
+ *  to match, and appending carries on from there. No scan of the whole file, no FAT or directory writes per record.
+ *  Optionally a sidecar index keeps the time of the first record in each block, so a time range can be found by binary
+ *  search of the index (through File::seek()) and read straight from its first block.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/BlockLog.h" // Framed block log with recovery. REQUIRES: blocklog_Open(); after SD.begin()
+ *  - struct a_blocklog log;
+ *  - After every SD.begin(): if (!blocklog_Open(&log, SD.rootDirectory(), "RAW.LOG", "RAW.IDX", 65536UL)) { no log }
+ *  - blocklog_Append(&log, &record, sizeof(record)); // Indexed records start with their uint32_t time
+ *  - Reading a time range back (log and index opened with SD.open()):
+ *      blocklog_ReaderSeek(log, &reader, blocklog_FindBlock(index, from));
+ *      while (blocklog_ReaderNext(log, &reader, &record, sizeof(record)) && record.time <= to) { if (record.time >= from) use it; }
+ *
+ * Definitions:
+ *  BLOCKLOG_SIZE_EVERY 16 // Blocks started between directory size updates (the size lags by up to this, blocklog_Open() fixes it)
+ *  BLOCKLOG_ERASE_CHUNK 8192 // Blocks per erase command in blocklog_Erase() (4MB), the watchdog is fed between them
+ *  BLOCKLOG_CREATE_FLAGS O_ALLOC_AU // createContiguous() flags for a new log (0: first free run of clusters)
+ *  BLOCKLOG_DATA_SIZE     // Record bytes per block (496)
+ *  BLOCKLOG_INDEX_ENTRY   // Index bytes per block (4: the uint32_t time its first record starts with)
+ *
+ * Functions:
+ *  bool blocklog_Open(struct a_blocklog *log, SdFile *dir, const char *name, const char *index_name, uint32_t blocks); // Opens and recovers the end, or creates it (blocks * 512 bytes, contiguous). index_name 0 for no index.
+ *  bool blocklog_Append(struct a_blocklog *log, const void *record, uint16_t size); // Into the last block, or a new one if it won't fit. Written to the card before returning.
+ *  bool blocklog_IsFull(const struct a_blocklog *log, uint16_t size); // No room left for a record of that size, appends fail without touching the card
+ *  bool blocklog_SetSize(struct a_blocklog *log); // Newest copy of the last block in its place, directory size to the blocks written so far
+ *  bool blocklog_Close(struct a_blocklog *log); // Size set and both files closed, e.g. before the card is formatted
+ *  uint32_t blocklog_Erase(struct a_blocklog *log); // Erases the rest of the file ahead of the appends, returns the blocks erased ahead (0 if the card won't)
+ *  uint32_t blocklog_Blocks(struct a_blocklog *log); // Blocks written so far, including the one being filled
+ *  bool blocklog_Last(struct a_blocklog *log, void *record, uint16_t size); // Copy of the newest record, false if the log is empty
+ *  uint32_t blocklog_FindBlock(File &index, uint32_t time); // Last block whose first record is at or before time (0 if none)
+ *  bool blocklog_ReaderSeek(File &log, struct a_blocklog_reader *reader, uint32_t block); // Start reading records at block
+ *  bool blocklog_ReaderNext(File &log, struct a_blocklog_reader *reader, void *record, uint16_t size); // Next record, false at the end of the log
+ *
+ * Notes:
+ *  - Block layout: struct a_blocklog_header (16 bytes, little endian), then header.used bytes of records, then zeros.
+ *    The CRC is CRC-16 CCITT (0xFFFF start) over the header up to crc, then the used bytes.
+ *  - A block is good if its magic, log id and sequence (= its block number in the file) match and the CRC checks.
+ *    The log id is picked when the file is made, different from whatever was in block 0 before, so blocks left on
+ *    the card by an older log in the same clusters never look like ours.
+ *  - Each append reads the newest copy of the last block into the volume cache, adds the record and writes it where
+ *    the other copy is: the block's place in the file or the scratch block (the file's last, not counted in its log
+ *    blocks). A write lost part way only tears the older copy. blocklog_Open() takes the scratch block if it holds a
+ *    newer copy (more records) of the last good block or of the one after it (torn). A block that's full, or
+ *    blocklog_SetSize(), copies the scratch block back to the block's place first if it's the newer one.
+ *  - So each log block is written about half as many times as it gets records (~16 for 16 byte records), the scratch
+ *    block the other half. The first record of a block goes straight to its place (nothing to keep).
+ *  - A last block whose newest copy reads back bad goes back to the other copy (one record fewer), or if that's no good
+ *    either starts over empty in its place: appends carry on instead of failing on it for good. A failed read fails
+ *    the append (card fault).
+ *  - Readers (File) only see the block's place, so they can be one copy behind until blocklog_SetSize().
+ *  - The directory size only counts the blocks written, the rest of the allocation stays in the cluster chain.
+ *    A desktop disk check may report that as a size mismatch: read the file with a tool that follows the headers.
+ *  - The file must be contiguous, one made by anything else (or fragmented) is refused.
+ *  - A new log starts on an allocation unit boundary of the card and is rounded up to whole AUs (all of them used as
+ *    log blocks), so no other file shares its AUs and the card never has to copy their data out to reuse one. Only
+ *    if the volume has no usable AU (SdVolume::allocUnit()) or no run of free ones is it placed anywhere that fits.
+ *  - The volume cache is borrowed for each block, SdFile users don't lose anything (it is flushed first) but have to
+ *    read their block back in.
+ *  - Index: entry n (4 bytes, little endian) is the time of the first record in block n, so it's also the file offset
+ *    (n * 512). It's written (and synced) when a record starts a new block. Times have to go up through the log for the
+ *    binary search to work. blocklog_Open() trims entries past the recovered end and fills in missing ones from the
+ *    blocks (one block read each, the whole log if the index was deleted). A failed index write stops indexing until
+ *    the next blocklog_Open(), the log itself carries on.
+ *  - blocklog_Erase() at the start of a session: an append into an erased block is just a program, one into a block
+ *    holding old data can make the card erase first (the write stalls, for hundreds of ms on some cards). Blocks past
+ *    the end read as all 0 or all 0xFF after it, which recovery already treats as unwritten. It's remembered until the
+ *    next blocklog_Open(), so a second call only erases what the first couldn't. Cards without single block erase
+ *    (some under 2GB, see Sd2Card::eraseSingleBlockEnable()) refuse it and are written as before.
+ *  - A time range costs ~log2(blocks) index reads, one seek along the log's cluster chain, then the blocks holding it.
+ *    The reader checks each header (magic, log id, sequence) but not the CRC, that needs the whole block in RAM.
+ *  - Block writes check the card status every SD_WRITE_STATUS_EVERY writes (Sd2Card.h), so a programming error can
+ *    fail a later append than the one it hit. The index sync and blocklog_Close() check whatever is left.
+ */
+
+#ifndef BLOCKLOG_SIZE_EVERY
+#define BLOCKLOG_SIZE_EVERY 16
+#endif
+#ifndef BLOCKLOG_ERASE_CHUNK
+#define BLOCKLOG_ERASE_CHUNK 8192UL
+#endif
+#ifndef BLOCKLOG_CREATE_FLAGS
+#define BLOCKLOG_CREATE_FLAGS O_ALLOC_AU
+#endif
+
+#define BLOCKLOG_BLOCK_SIZE 512
+#define BLOCKLOG_MAGIC 0x474C3453UL // "S4LG" on the card
+#define BLOCKLOG_DATA_SIZE (BLOCKLOG_BLOCK_SIZE - sizeof(struct a_blocklog_header))
+#define BLOCKLOG_INDEX_ENTRY 4
+
+// Start of every block (16 bytes)
+struct a_blocklog_header {
+	uint32_t magic;          // BLOCKLOG_MAGIC
+	uint32_t log_id;         // Same in every block of one log
+	uint32_t sequence;       // Block number in the file, 0 first
+	uint16_t used;           // Record bytes after the header
+	uint16_t crc;            // CRC-16 CCITT of the fields above and the used bytes
+};
+
+struct a_blocklog {
+	SdFile file;
+	SdFile index;            // Sidecar, first record time per block
+	uint32_t first_block;    // On the card
+	uint32_t blocks;         // Log blocks in the file, the scratch block is the one after them
+	uint32_t log_id;
+	uint32_t current;        // Block being filled
+	uint32_t erased_end;     // Blocks after current up to this are erased (0 until blocklog_Erase())
+	uint16_t used;           // Record bytes in it
+	uint8_t unsized;         // Blocks started since the directory size was set
+	bool is_open, is_indexed;
+	bool in_scratch;         // The newest copy of the block being filled is in the scratch block
+};
+
+// Position in a log being read back through File
+struct a_blocklog_reader {
+	uint32_t block;          // Next block
+	uint32_t log_id;         // From block 0
+	uint16_t left;           // Record bytes not read yet in the current block
+};
+
+bool blocklog_Open(struct a_blocklog *log, SdFile *dir, const char *name, const char *index_name, uint32_t blocks);
+bool blocklog_Append(struct a_blocklog *log, const void *record, uint16_t size);
+bool blocklog_SetSize(struct a_blocklog *log);
+bool blocklog_Close(struct a_blocklog *log);
+uint32_t blocklog_Erase(struct a_blocklog *log);
+uint32_t blocklog_Blocks(struct a_blocklog *log);
+bool blocklog_Last(struct a_blocklog *log, void *record, uint16_t size);
+uint32_t blocklog_FindBlock(File &index, uint32_t time);
+bool blocklog_ReaderSeek(File &log, struct a_blocklog_reader *reader, uint32_t block);
+bool blocklog_ReaderNext(File &log, struct a_blocklog_reader *reader, void *record, uint16_t size);
+
+
+// CRC-16 CCITT of the header up to crc and the used bytes
+uint16_t _blocklog_Crc(const uint8_t *block)
+{
+	const struct a_blocklog_header *header = (const struct a_blocklog_header *)block;
+	uint16_t i, crc = 0xFFFF;
+	for (i = 0; i < offsetof(struct a_blocklog_header, crc); i++) {
+		crc = _crc_ccitt_update(crc, block[i]);
+	}
+	for (i = 0; i < header->used; i++) {
+		crc = _crc_ccitt_update(crc, block[sizeof(struct a_blocklog_header) + i]);
+	}
+	return crc;
+}
+
+
+// Block index of the log into the volume cache, 0 on a read error
+uint8_t *_blocklog_Read(struct a_blocklog *log, uint32_t index)
+{
+	uint8_t *block;
+	if (!SdVolume::cacheSync()) {return 0;}
+	block = SdVolume::cacheClear();
+	if (!SdVolume::sdCard()->readBlock(log->first_block + index, block)) {return 0;}
+	return block;
+}
+
+
+// A good copy of block index of this log (in its place, or the scratch block)
+bool _blocklog_IsGood(struct a_blocklog *log, const uint8_t *block, uint32_t index)
+{
+	const struct a_blocklog_header *header = (const struct a_blocklog_header *)block;
+	return (header->magic == BLOCKLOG_MAGIC) && (header->log_id == log->log_id) && (header->sequence == index)
+		&& (header->used <= BLOCKLOG_DATA_SIZE) && (header->crc == _blocklog_Crc(block));
+}
+
+
+// Header for the block being filled, then the whole block to the card: in its place, or the scratch block
+bool _blocklog_Write(struct a_blocklog *log, uint8_t *block, bool to_scratch)
+{
+	struct a_blocklog_header *header = (struct a_blocklog_header *)block;
+	header->magic = BLOCKLOG_MAGIC;
+	header->log_id = log->log_id;
+	header->sequence = log->current;
+	header->used = log->used;
+	header->crc = _blocklog_Crc(block);
+	return SdVolume::sdCard()->writeBlock(log->first_block + (to_scratch ? log->blocks : log->current), block);
+}
+
+
+// Newest copy of the block being filled into the volume cache. A copy that doesn't check out falls back to the other
+// one (fewer records), or if neither does to an empty block. 0 on a read error.
+uint8_t *_blocklog_ReadLast(struct a_blocklog *log)
+{
+	uint8_t *block;
+	uint16_t used;
+	uint8_t tries;
+
+	for (tries = 0; tries < 2; tries++) {
+		if (!(block = _blocklog_Read(log, log->in_scratch ? log->blocks : log->current))) {return 0;}
+		used = ((struct a_blocklog_header *)block)->used;
+		if (_blocklog_IsGood(log, block, log->current) && (used == log->used || (tries && used && used < log->used))) {
+			log->used = used;
+			return block;
+		}
+		log->in_scratch = !log->in_scratch;
+	}
+	log->used = 0; // Nothing good of it is left: it starts over in its place
+	log->in_scratch = false;
+	memset(block, 0, BLOCKLOG_BLOCK_SIZE);
+	return block;
+}
+
+
+// Newest copy of the block being filled back in its place, before the log moves on from it or a reader looks
+bool _blocklog_Settle(struct a_blocklog *log)
+{
+	uint8_t *block;
+
+	if (!log->in_scratch) {return true;}
+	if (!(block = _blocklog_ReadLast(log))) {return false;}
+	if (!log->in_scratch) {return true;} // Fell back to the copy in its place
+	if (!_blocklog_Write(log, block, false)) {return false;}
+	log->in_scratch = false;
+	return true;
+}
+
+
+// Index entry for a block, positioned so a lost write can't shift the ones after it. Off on failure.
+bool _blocklog_Index(struct a_blocklog *log, uint32_t block, uint32_t time)
+{
+	if (!log->is_indexed) {return false;}
+	if (!log->index.seekSet(block * BLOCKLOG_INDEX_ENTRY) || (log->index.write(&time, BLOCKLOG_INDEX_ENTRY) != BLOCKLOG_INDEX_ENTRY)
+		|| !log->index.sync()) {
+		log->is_indexed = false; // Until the next blocklog_Open() fills it in
+		return false;
+	}
+	return true;
+}
+
+
+// Opens (or makes) the index and brings it in line with the recovered log
+void _blocklog_OpenIndex(struct a_blocklog *log, SdFile *dir, const char *index_name)
+{
+	uint32_t entries, block, time;
+	uint32_t holding = log->used ? log->current + 1 : log->current; // Blocks with records in them
+	uint8_t *data;
+
+	log->is_indexed = false;
+	if (log->index.isOpen()) {log->index.close();}
+	if (!index_name || !log->index.open(dir, index_name, O_RDWR | O_CREAT)) {return;}
+	entries = log->index.fileSize() / BLOCKLOG_INDEX_ENTRY;
+	if (entries > holding) {
+		if (!log->index.truncate(holding * BLOCKLOG_INDEX_ENTRY)) {return;} // From a longer log, or one made again
+		entries = holding;
+	}
+	log->is_indexed = true;
+	for (block = entries; block < holding && log->is_indexed; block++) {
+		if (!(data = _blocklog_Read(log, (block == log->current && log->in_scratch) ? log->blocks : block))) {
+			log->is_indexed = false;
+			return;
+		}
+		memcpy(&time, data + sizeof(struct a_blocklog_header), sizeof(time));
+		_blocklog_Index(log, block, time);
+	}
+}
+
+
+// Opens the log and finds where it ends, or creates it (blocks * 512 bytes, contiguous) if it isn't there
+bool blocklog_Open(struct a_blocklog *log, SdFile *dir, const char *name, const char *index_name, uint32_t blocks)
+{
+	uint32_t last_block, low, high, middle;
+	uint8_t *block;
+	struct a_blocklog_header *header;
+	uint16_t used;
+	bool created = false;
+
+	log->is_open = log->is_indexed = false;
+	log->in_scratch = false;
+	log->erased_end = 0;
+	if (log->file.isOpen()) {log->file.close();} // From before a remount
+	if (!log->file.open(dir, name, O_RDWR)) {
+		if (!log->file.createContiguous(dir, name, blocks * BLOCKLOG_BLOCK_SIZE, BLOCKLOG_CREATE_FLAGS)) {return false;}
+		created = true;
+	}
+	if (!log->file.contiguousRange(&log->first_block, &last_block)) {
+		log->file.close(); // Fragmented, not one of ours
+		return false;
+	}
+	if (last_block == log->first_block) {
+		log->file.close(); // No room for a log block and the scratch block
+		return false;
+	}
+	log->blocks = last_block - log->first_block; // The last one is the scratch block
+
+	if (!(block = _blocklog_Read(log, 0))) {return false;}
+	header = (struct a_blocklog_header *)block;
+	log->log_id = header->log_id;
+	if (!created && _blocklog_IsGood(log, block, 0)) {
+		// Block low is good, block high is past the end (or not written yet)
+		low = 0;
+		high = log->blocks;
+		while (high - low > 1) {
+			middle = low + (high - low) / 2;
+			if (!(block = _blocklog_Read(log, middle))) {return false;}
+			if (_blocklog_IsGood(log, block, middle)) {low = middle;} else {high = middle;}
+		}
+		if (!(block = _blocklog_Read(log, low))) {return false;}
+		log->current = low;
+		log->used = ((struct a_blocklog_header *)block)->used;
+		// The scratch block may hold a newer copy of that block, or one of the next block if its place was torn
+		if (!(block = _blocklog_Read(log, log->blocks))) {return false;}
+		used = ((struct a_blocklog_header *)block)->used;
+		if (_blocklog_IsGood(log, block, low) && (used > log->used)) {
+			log->used = used;
+			log->in_scratch = true;
+		} else if ((low + 1 < log->blocks) && _blocklog_IsGood(log, block, low + 1)) {
+			log->current = low + 1;
+			log->used = used;
+			log->in_scratch = true;
+		}
+	} else {
+		// New (or nothing good in it): an id no block left in these clusters has, and an empty block 0
+		log->log_id = (header->magic == BLOCKLOG_MAGIC) ? header->log_id + 1 : log->first_block;
+		log->current = 0;
+		log->used = 0;
+		memset(block, 0, BLOCKLOG_BLOCK_SIZE);
+		if (!_blocklog_Write(log, block, false)) {return false;}
+	}
+	log->is_open = true;
+	_blocklog_OpenIndex(log, dir, index_name);
+	return blocklog_SetSize(log);
+}
+
+
+// Into the last block, or a new one if it won't fit. On the card before this returns.
+bool blocklog_Append(struct a_blocklog *log, const void *record, uint16_t size)
+{
+	uint8_t *block;
+	uint32_t time;
+	bool starts, to_scratch;
+
+	if (!log->is_open || size > BLOCKLOG_DATA_SIZE) {return false;}
+	if (log->used + size > BLOCKLOG_DATA_SIZE) {
+		if (log->current + 1 >= log->blocks) {return false;} // Full
+		if (!_blocklog_Settle(log)) {return false;} // Its newest copy has to be in its place before moving on
+		log->current++;
+		log->used = 0;
+		log->unsized++;
+	}
+	if (log->used) {
+		// Read back what's in it. A bad copy would be rewritten with a good CRC, so it has to check out (or is left behind).
+		if (!(block = _blocklog_ReadLast(log))) {return false;}
+	} else {
+		if (!SdVolume::cacheSync()) {return false;}
+		block = SdVolume::cacheClear();
+		memset(block, 0, BLOCKLOG_BLOCK_SIZE);
+	}
+	starts = (log->used == 0);
+	to_scratch = !starts && !log->in_scratch; // Never over the newest copy, the first record goes straight to its place
+	memcpy(block + sizeof(struct a_blocklog_header) + log->used, record, size);
+	log->used += size;
+	if (!_blocklog_Write(log, block, to_scratch)) {
+		log->used -= size;
+		return false;
+	}
+	log->in_scratch = to_scratch;
+	if (starts && size >= sizeof(time)) {
+		memcpy(&time, record, sizeof(time));
+		_blocklog_Index(log, log->current, time); // The record is safe either way
+	}
+	if (log->unsized >= BLOCKLOG_SIZE_EVERY) {blocklog_SetSize(log);}
+	return true;
+}
+
+
+// No room left for a record of that size, appends fail without touching the card
+bool blocklog_IsFull(const struct a_blocklog *log, uint16_t size)
+{
+	return (log->used + size > BLOCKLOG_DATA_SIZE) && (log->current + 1 >= log->blocks);
+}
+
+
+// Newest copy of the last block in its place, directory size to the blocks written so far
+bool blocklog_SetSize(struct a_blocklog *log)
+{
+	if (!log->is_open || !_blocklog_Settle(log)) {return false;}
+	log->unsized = 0;
+	return log->file.setContiguousSize(blocklog_Blocks(log) * BLOCKLOG_BLOCK_SIZE);
+}
+
+
+// Size set and both files closed. Nothing of the log is left open to write a stale directory entry later.
+bool blocklog_Close(struct a_blocklog *log)
+{
+	bool ok = !log->is_open || blocklog_SetSize(log);
+	log->is_open = log->is_indexed = false;
+	if (log->index.isOpen() && !log->index.close()) {ok = false;}
+	if (log->file.isOpen() && !log->file.close()) {ok = false;}
+	return ok;
+}
+
+
+// Erases the blocks after the one being filled up to the end of the file, so appends into them don't wait on the card
+// erasing. Returns the blocks erased ahead of the current one, 0 if the card won't erase.
+uint32_t blocklog_Erase(struct a_blocklog *log)
+{
+	uint32_t first, last;
+
+	if (!log->is_open) {return 0;}
+	first = log->current + 1;
+	if (log->erased_end > first) {first = log->erased_end;} // Done already since the open
+	if (first < log->blocks && !SdVolume::cacheSync()) {return 0;}
+	SdVolume::cacheClear(); // Nothing of the old contents left in the cache either
+	while (first < log->blocks) {
+		last = first + BLOCKLOG_ERASE_CHUNK - 1;
+		if (last >= log->blocks) {last = log->blocks - 1;}
+		if (!SdVolume::sdCard()->erase(log->first_block + first, log->first_block + last)) {break;}
+		log->erased_end = last + 1;
+		first = last + 1;
+		wdt_reset();
+	}
+	return log->erased_end > log->current + 1 ? log->erased_end - log->current - 1 : 0;
+}
+
+
+// Blocks written so far, including the one being filled
+uint32_t blocklog_Blocks(struct a_blocklog *log)
+{
+	return log->current + 1;
+}
+
+
+// Copy of the newest record (records all size bytes), false if the log is empty
+bool blocklog_Last(struct a_blocklog *log, void *record, uint16_t size)
+{
+	uint8_t *block;
+	if (!log->is_open || log->used < size) {return false;}
+	if (!(block = _blocklog_ReadLast(log)) || log->used < size) {return false;}
+	memcpy(record, block + sizeof(struct a_blocklog_header) + log->used - size, size);
+	return true;
+}
+
+
+// Binary search of the index: the last block whose first record is at or before time (0 if none are)
+uint32_t blocklog_FindBlock(File &index, uint32_t time)
+{
+	uint32_t low = 0, high = index.size() / BLOCKLOG_INDEX_ENTRY, middle, first;
+	while (high - low > 1) {
+		middle = low + (high - low) / 2;
+		if (!index.seek(middle * BLOCKLOG_INDEX_ENTRY) || (index.read(&first, sizeof(first)) != sizeof(first))) {break;} // Read from low, still before time
+		if (first <= time) {low = middle;} else {high = middle;}
+	}
+	return low;
+}
+
+
+// Start reading records at block. Block 0 gives the log id every block read has to have.
+bool blocklog_ReaderSeek(File &log, struct a_blocklog_reader *reader, uint32_t block)
+{
+	struct a_blocklog_header header;
+	reader->block = block;
+	reader->left = 0;
+	if (!log.seek(0) || (log.read(&header, sizeof(header)) != sizeof(header)) || (header.magic != BLOCKLOG_MAGIC)) {return false;}
+	reader->log_id = header.log_id;
+	return true;
+}
+
+
+// Next record (all size bytes) in order, false at the end of the log: past the size, a header that doesn't follow on, or a read error
+bool blocklog_ReaderNext(File &log, struct a_blocklog_reader *reader, void *record, uint16_t size)
+{
+	struct a_blocklog_header header;
+	while (reader->left < size) {
+		if (!log.seek(reader->block * BLOCKLOG_BLOCK_SIZE)) {return false;} // Skips the zeros at the end of the last one
+		if (log.read(&header, sizeof(header)) != sizeof(header)) {return false;}
+		if ((header.magic != BLOCKLOG_MAGIC) || (header.log_id != reader->log_id) || (header.sequence != reader->block)
+			|| (header.used > BLOCKLOG_DATA_SIZE)) {return false;}
+		reader->left = header.used;
+		reader->block++;
+	}
+	if (log.read(record, size) != size) {return false;}
+	reader->left -= size;
+	return true;
+}
+
+#endif
@@ -0,0 +1,238 @@
+#ifndef _LEM_BURST_H
+#define _LEM_BURST_H 1
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Burst.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Pre-trigger capture of fast transients. Samples (a few raw readings each) go continuously into a RAM ring.
+ *  When a trigger fires (a level crossed, a step between two samples, or burst_Trigger() by hand) the ring keeps
+ *  the BURST_PRE_SAMPLES before it, fills the BURST_POST_SAMPLES from it on, and then freezes so the main loop
+ *  can write the whole burst out as one record. The trigger check is a few compares, cheap enough for an ISR.
+ *
+ * To Use:
+ *  - Define BURST_CHANNELS (values per sample) before including if it isn't 1
+ *  - Paste: #include "lemtils/Burst.h" // Pre-trigger burst capture. REQUIRES: burst_Initialize(); burst_Sample(); from the sampling ISR
+ *  - burst_SetTrigger(0, below, above, step); // Per channel, in raw counts, 0 turns a check off
+ *  - burst_Initialize(); // Armed
+ *  - In the ISR, per sample: burst_Sample(values, event_Clock);
+ *  - In the main loop: if (burst_IsReady()) { write burst_Header and burst_Part(0/1), then burst_Arm(); }
+ *
+ * Definitions:
+ *  BURST_CHANNELS 1       // Raw values per sample
+ *  BURST_BUFFER_SIZE 64   // Samples in the ring (2 bytes per channel each), power of 2
+ *  BURST_PRE_SAMPLES 16   // Kept from before the trigger
+ *  BURST_POST_SAMPLES 48  // From the trigger sample on. PRE + POST <= BUFFER_SIZE.
+ *
+ * Functions:
+ *  void burst_Initialize(); // Empty ring, armed
+ *  void burst_SetTrigger(uint8_t channel, uint16_t below, uint16_t above, uint16_t step); // Fires on value < below, value > above, or |change| > step
+ *  void burst_Sample(const uint16_t *values, uint32_t time); // One sample, from the sampling ISR
+ *  void burst_Trigger(uint8_t reason); // Fires by hand (e.g. a button), reason >= BURST_REASON_MANUAL
+ *  bool burst_IsReady(); // A burst is complete and frozen, waiting to be written
+ *  uint8_t burst_Part(uint8_t part, const struct a_burst_sample **samples); // Oldest first, in up to 2 contiguous parts (the ring wraps)
+ *  void burst_Arm(); // Done writing, start looking for the next trigger
+ *
+ * Notes:
+ *  - burst_Header.reason: channel * 4 + BURST_REASON_BELOW/ABOVE/STEP, or the value passed to burst_Trigger().
+ *  - Times are on the ms clock. Sample spacing is (last_time - trigger_time) / (post - 1), the pre-trigger samples
+ *    come at the same spacing before trigger_time (no per sample times, they'd take more RAM than the samples).
+ *  - A trigger with fewer than BURST_PRE_SAMPLES in the ring (just armed) keeps what there is, burst_Header.pre says how many.
+ *  - Samples that arrive while a burst waits to be written are counted in burst_Header.dropped, not stored.
+ */
+
+#ifndef BURST_CHANNELS
+#define BURST_CHANNELS 1
+#endif
+#ifndef BURST_BUFFER_SIZE
+#define BURST_BUFFER_SIZE 64
+#endif
+#ifndef BURST_PRE_SAMPLES
+#define BURST_PRE_SAMPLES 16
+#endif
+#ifndef BURST_POST_SAMPLES
+#define BURST_POST_SAMPLES 48
+#endif
+
+#if (BURST_BUFFER_SIZE & (BURST_BUFFER_SIZE - 1))
+#  error "BURST_BUFFER_SIZE must be a power of 2"
+#endif
+#if (BURST_PRE_SAMPLES + BURST_POST_SAMPLES > BURST_BUFFER_SIZE) || (BURST_POST_SAMPLES < 1)
+#  error "Need 1 <= BURST_POST_SAMPLES and BURST_PRE_SAMPLES + BURST_POST_SAMPLES <= BURST_BUFFER_SIZE"
+#endif
+
+#define BURST_REASON_BELOW  0
+#define BURST_REASON_ABOVE  1
+#define BURST_REASON_STEP   2
+#define BURST_REASON_MANUAL 0x80
+
+#define _BURST_ARMED     0
+#define _BURST_TRIGGERED 1
+#define _BURST_READY     2
+
+struct a_burst_sample {
+	uint16_t value[BURST_CHANNELS];
+};
+
+struct a_burst_trigger {
+	uint16_t below, above, step; // 0 = off
+};
+
+// Start of a burst record, the samples follow it (oldest first)
+struct a_burst_header {
+	uint32_t trigger_time;   // [ms] of the trigger sample
+	uint32_t last_time;      // [ms] of the newest sample
+	uint16_t dropped;        // Samples lost while the previous burst waited to be written
+	uint8_t reason;
+	uint8_t pre;             // Samples before the trigger sample
+	uint8_t post;            // Samples from the trigger sample on
+	uint8_t channels;        // BURST_CHANNELS
+};
+
+struct a_burst_sample _burst_ring[BURST_BUFFER_SIZE];
+struct a_burst_trigger _burst_triggers[BURST_CHANNELS];
+struct a_burst_header burst_Header;
+volatile uint8_t _burst_state = _BURST_ARMED;
+volatile uint8_t _burst_head = 0;     // Next slot written
+volatile uint8_t _burst_filled = 0;   // Samples in the ring since armed (up to BURST_PRE_SAMPLES counted)
+volatile uint8_t _burst_remaining = 0;
+volatile uint8_t _burst_manual = 0;   // Reason from burst_Trigger(), 0 = none
+volatile uint16_t _burst_dropped = 0;
+
+void burst_Initialize(void);
+void burst_SetTrigger(uint8_t channel, uint16_t below, uint16_t above, uint16_t step);
+void burst_Sample(const uint16_t *values, uint32_t time);
+void burst_Trigger(uint8_t reason);
+bool burst_IsReady(void);
+uint8_t burst_Part(uint8_t part, const struct a_burst_sample **samples);
+void burst_Arm(void);
+
+
+// Empty ring, armed
+void burst_Initialize(void)
+{
+	_burst_head = 0;
+	_burst_dropped = 0;
+	burst_Arm();
+}
+
+
+// Fires on value < below, value > above, or a change bigger than step since the last sample. 0 turns a check off.
+void burst_SetTrigger(uint8_t channel, uint16_t below, uint16_t above, uint16_t step)
+{
+	if (channel >= BURST_CHANNELS) {return;}
+	_burst_triggers[channel].below = below;
+	_burst_triggers[channel].above = above;
+	_burst_triggers[channel].step = step;
+}
+
+
+// Which check fired (channel * 4 + BURST_REASON_x), or 0xFF. previous is the sample before this one.
+uint8_t _burst_Check(const uint16_t *values, const struct a_burst_sample *previous)
+{
+	uint8_t i;
+	uint16_t change;
+	for (i = 0; i < BURST_CHANNELS; i++) {
+		const struct a_burst_trigger *t = &_burst_triggers[i];
+		if (t->below && values[i] < t->below) {return (i << 2) | BURST_REASON_BELOW;}
+		if (t->above && values[i] > t->above) {return (i << 2) | BURST_REASON_ABOVE;}
+		if (t->step && previous) {
+			change = (values[i] > previous->value[i]) ? values[i] - previous->value[i] : previous->value[i] - values[i];
+			if (change > t->step) {return (i << 2) | BURST_REASON_STEP;}
+		}
+	}
+	return 0xFF;
+}
+
+
+// One sample, from the sampling ISR
+void burst_Sample(const uint16_t *values, uint32_t time)
+{
+	uint8_t i, reason = 0xFF;
+	const struct a_burst_sample *previous;
+
+	if (_burst_state == _BURST_READY) {
+		if (_burst_dropped < 0xFFFF) {_burst_dropped++;}
+		return;
+	}
+
+	previous = _burst_filled ? &_burst_ring[(_burst_head - 1) & (BURST_BUFFER_SIZE - 1)] : 0;
+	if (_burst_state == _BURST_ARMED) {
+		reason = _burst_manual ? _burst_manual : _burst_Check(values, previous);
+	}
+	for (i = 0; i < BURST_CHANNELS; i++) {_burst_ring[_burst_head].value[i] = values[i];}
+	_burst_head = (_burst_head + 1) & (BURST_BUFFER_SIZE - 1);
+
+	if (_burst_state == _BURST_ARMED) {
+		if (reason == 0xFF) {
+			if (_burst_filled < BURST_PRE_SAMPLES) {_burst_filled++;}
+			return;
+		}
+		burst_Header.trigger_time = time;
+		burst_Header.reason = reason;
+		burst_Header.pre = _burst_filled;
+		_burst_manual = 0;
+		_burst_remaining = BURST_POST_SAMPLES;
+		_burst_state = _BURST_TRIGGERED;
+	}
+	if (--_burst_remaining == 0) {
+		burst_Header.last_time = time;
+		burst_Header.dropped = _burst_dropped;
+		_burst_dropped = 0;
+		_burst_state = _BURST_READY;
+	}
+}
+
+
+// Fires by hand (e.g. a button) on the next sample, reason >= BURST_REASON_MANUAL
+void burst_Trigger(uint8_t reason)
+{
+	_burst_manual = reason | BURST_REASON_MANUAL;
+}
+
+
+// A burst is complete and frozen, waiting to be written
+bool burst_IsReady(void)
+{
+	return _burst_state == _BURST_READY;
+}
+
+
+// Oldest first, in up to 2 contiguous parts (the ring wraps). Returns the samples in the part, 0 if none.
+uint8_t burst_Part(uint8_t part, const struct a_burst_sample **samples)
+{
+	uint8_t count = burst_Header.pre + BURST_POST_SAMPLES;
+	uint8_t start = (_burst_head - count) & (BURST_BUFFER_SIZE - 1);
+	uint8_t first = (start + count > BURST_BUFFER_SIZE) ? BURST_BUFFER_SIZE - start : count;
+	if (!burst_IsReady()) {return 0;}
+	if (part == 0) {
+		*samples = &_burst_ring[start];
+		return first;
+	}
+	*samples = &_burst_ring[0];
+	return (part == 1) ? count - first : 0;
+}
+
+
+// Done writing, start looking for the next trigger. The pre-trigger samples build up again from here.
+void burst_Arm(void)
+{
+	uint8_t sreg = SREG;
+	cli();
+	burst_Header.channels = BURST_CHANNELS;
+	burst_Header.post = BURST_POST_SAMPLES;
+	_burst_filled = 0;
+	_burst_state = _BURST_ARMED;
+	SREG = sreg;
+}
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef _LEM_BUTTON_H
+#define _LEM_BUTTON_H 1
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Button.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Edge-driven buttons. Nothing is polled and nothing is counted every millisecond:
+ *  the pin change ISR timestamps each edge into a small queue, and the queue is only looked at
+ *  once the pins have been quiet for the debounce time (an event restarted by every edge).
+ *  Press times are the time of the first edge, held time is worked out from timestamps when asked for.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/Button.h" // Edge-driven buttons. REQUIRES: button_Initialize(); button_QueueEdge(); in the PCINT ISR
+ *  - One struct a_button per button, button_Initialize(&b, _BV(PB1), PINB); (buttons share one port, read high when pressed)
+ *  - Enable the pin change interrupt for the pins, and in the ISR:
+ *      button_QueueEdge(PINB, event_Clock);       // Timestamp now, debounce later
+ *      event_Start(&event_ButtonDebounce);        // Restarted by every edge, fires once the pins have been quiet
+ *  - When event_ButtonDebounce is ready: if (button_ProcessEdges(buttons, count)) { something was pressed or released }
+ *  - button_HeldTime(&b, now), button_IsChord(&a, &b, window) for holds and chords
+ *
+ * Definitions:
+ *  BUTTON_QUEUE_SIZE 8 // Edges held until processed, power of 2. Bounces included, so don't go too small.
+ *
+ * Functions:
+ *  void button_Initialize(struct a_button *button, uint8_t mask, uint8_t pins); // Sets the pin mask and the starting level
+ *  void button_QueueEdge(uint8_t pins, uint32_t time); // ISR: saves the port and the time of an edge
+ *  bool button_ProcessEdges(struct a_button *buttons, uint8_t count); // Takes the queued edges as settled levels, true if anything changed
+ *  uint32_t button_HeldTime(struct a_button *button, uint32_t now); // ms held so far, 0 if not pressed
+ *  bool button_IsChord(struct a_button *a, struct a_button *b, uint32_t window); // Both pressed, within window ms of each other
+ *  void button_ShiftTimes(struct a_button *buttons, uint8_t count, uint32_t since, uint32_t shift); // Moves times stamped since "since" later by "shift"
+ *
+ * Notes:
+ *  - button_ProcessEdges() takes the last level in the queue as settled, so only call it once the pins have been quiet.
+ *  - If the queue overflows, the newest level overwrites the last entry (levels stay right, a bounce time is lost) and button_QueueOverflows is counted.
+ *  - button_ShiftTimes() is for edges stamped while the clock was behind (woken from power down, time not credited yet).
+ */
+
+#ifndef BUTTON_QUEUE_SIZE
+#define BUTTON_QUEUE_SIZE 8
+#endif
+
+#if (BUTTON_QUEUE_SIZE & (BUTTON_QUEUE_SIZE - 1))
+#  error "BUTTON_QUEUE_SIZE must be a power of 2"
+#endif
+
+struct a_button {
+	uint8_t mask;           // Pin in the port, e.g. _BV(PB1)
+	bool is_pressed;        // Debounced state
+	bool raw;               // Level of the newest queued edge
+	uint32_t raw_changed_at;// First edge away from is_pressed (when the press/release really started)
+	uint32_t pressed_at, released_at; // Debounced, time of the first edge
+	uint32_t held_latest;   // Length of the last full press [ms]
+};
+
+struct a_button_edge {
+	uint32_t time;
+	uint8_t pins;
+};
+
+volatile struct a_button_edge _button_queue[BUTTON_QUEUE_SIZE];
+volatile uint8_t _button_queue_head = 0; // Written by the ISR
+volatile uint8_t _button_queue_tail = 0; // Written by button_ProcessEdges()
+volatile uint8_t button_QueueOverflows = 0;
+
+void button_Initialize(struct a_button *button, uint8_t mask, uint8_t pins);
+void button_QueueEdge(uint8_t pins, uint32_t time);
+bool button_ProcessEdges(struct a_button *buttons, uint8_t count);
+uint32_t button_HeldTime(struct a_button *button, uint32_t now);
+bool button_IsChord(struct a_button *a, struct a_button *b, uint32_t window);
+void button_ShiftTimes(struct a_button *buttons, uint8_t count, uint32_t since, uint32_t shift);
+
+
+// Sets the pin mask and the starting level
+void button_Initialize(struct a_button *button, uint8_t mask, uint8_t pins)
+{
+	button->mask = mask;
+	button->is_pressed = button->raw = (pins & mask) ? true : false;
+	button->raw_changed_at = button->pressed_at = button->released_at = 0;
+	button->held_latest = 0;
+}
+
+
+// ISR: saves the port and the time of an edge
+void button_QueueEdge(uint8_t pins, uint32_t time)
+{
+	uint8_t next = (_button_queue_head + 1) & (BUTTON_QUEUE_SIZE - 1);
+	if (next == _button_queue_tail) {
+		// Full: keep the newest level in the last entry, the time of the first edge is already queued
+		button_QueueOverflows++;
+		_button_queue[(_button_queue_head - 1) & (BUTTON_QUEUE_SIZE - 1)].pins = pins;
+		return;
+	}
+	_button_queue[_button_queue_head].time = time;
+	_button_queue[_button_queue_head].pins = pins;
+	_button_queue_head = next;
+}
+
+
+// Applies one settled level to a button at time "time"
+void _button_Apply(struct a_button *button, bool level, uint32_t time)
+{
+	if (level != button->raw) {
+		if (button->raw == button->is_pressed) {button->raw_changed_at = time;} // First edge away from the settled state
+		button->raw = level;
+	}
+}
+
+
+// Takes the queued edges as settled levels, returns true if any button was pressed or released
+bool button_ProcessEdges(struct a_button *buttons, uint8_t count)
+{
+	bool changed = false;
+	uint8_t i;
+
+	while (_button_queue_tail != _button_queue_head) {
+		struct a_button_edge edge;
+		edge.time = _button_queue[_button_queue_tail].time;
+		edge.pins = _button_queue[_button_queue_tail].pins;
+		_button_queue_tail = (_button_queue_tail + 1) & (BUTTON_QUEUE_SIZE - 1);
+		for (i = 0; i < count; i++) {
+			_button_Apply(&buttons[i], (edge.pins & buttons[i].mask) ? true : false, edge.time);
+		}
+	}
+
+	// Settled (quiet for the debounce time), so the newest level is the state
+	for (i = 0; i < count; i++) {
+		struct a_button *b = &buttons[i];
+		if (b->raw == b->is_pressed) {continue;}
+		b->is_pressed = b->raw;
+		if (b->is_pressed) {
+			b->pressed_at = b->raw_changed_at;
+		} else {
+			b->released_at = b->raw_changed_at;
+			b->held_latest = b->released_at - b->pressed_at;
+		}
+		changed = true;
+	}
+	return changed;
+}
+
+
+// ms held so far, 0 if not pressed
+uint32_t button_HeldTime(struct a_button *button, uint32_t now)
+{
+	if (!button->is_pressed) {return 0;}
+	return now - button->pressed_at;
+}
+
+
+// Both pressed, within window ms of each other
+bool button_IsChord(struct a_button *a, struct a_button *b, uint32_t window)
+{
+	uint32_t apart;
+	if (!(a->is_pressed && b->is_pressed)) {return false;}
+	apart = (a->pressed_at > b->pressed_at) ? (a->pressed_at - b->pressed_at) : (b->pressed_at - a->pressed_at);
+	return apart <= window;
+}
+
+
+// Moves times stamped since "since" later by "shift" (edges stamped while the clock was behind)
+void button_ShiftTimes(struct a_button *buttons, uint8_t count, uint32_t since, uint32_t shift)
+{
+	uint8_t i, sreg;
+	if (shift == 0) {return;}
+	sreg = SREG;
+	cli(); // The ISR writes the queue
+	for (i = 0; i < BUTTON_QUEUE_SIZE; i++) {
+		if ((int32_t)(_button_queue[i].time - since) >= 0) {_button_queue[i].time += shift;}
+	}
+	SREG = sreg;
+	for (i = 0; i < count; i++) {
+		struct a_button *b = &buttons[i];
+		if ((int32_t)(b->raw_changed_at - since) >= 0) {b->raw_changed_at += shift;}
+		if ((int32_t)(b->pressed_at - since) >= 0) {b->pressed_at += shift;}
+		if ((int32_t)(b->released_at - since) >= 0) {b->released_at += shift;}
+	}
+}
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef _LEM_CARDRATE_H
+#define _LEM_CARDRATE_H 1
+
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <stdint.h>
+
+/*
+ * CardRate.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Remembers the SPI clock rate each SD card worked at, by its CID, in a few EEPROM bytes, so the next boot
+ *  starts the rate search (SD.beginAdaptive()) where it ended instead of at full speed every time.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/CardRate.h" // SPI rate per card in EEPROM. REQUIRES: nothing
+ *  - rate = cardrate_Lookup(cid); // CARDRATE_UNKNOWN for a card not seen (or forgotten)
+ *  - cardrate_Remember(cid, rate); // After the card mounted
+ *
+ * Definitions:
+ *  CARDRATE_EEPROM_START (E2END + 1 - 16) // First EEPROM address used, CARDRATE_SLOTS * 4 bytes from there
+ *  CARDRATE_SLOTS 4        // Cards remembered
+ *  CARDRATE_UNKNOWN 0xFF
+ *
+ * Functions:
+ *  uint8_t cardrate_Lookup(const void *cid); // Rate remembered for the card with this 16 byte CID, or CARDRATE_UNKNOWN
+ *  void cardrate_Remember(const void *cid, uint8_t rate); // Writes it if it changed
+ *
+ * Notes:
+ *  - Slot: CRC-16/CCITT of the CID (2), rate (1), check byte (1). A card goes in the slot its CRC picks, so
+ *    a fifth card (or an unlucky pair) pushes one out; it then gets searched for again, nothing worse.
+ *  - The default place is the top 16 bytes of the EEPROM. On a 1KB part the sketch lays it out as Journal.h's
+ *    45 slots (0-944, JOURNAL_EEPROM_END E2END + 1 - 64), MountCache.h's record (960-1007), then these (1008-1023).
+ *  - Plain avr-libc EEPROM access: not while the journal is writing (journal_IsBusy()).
+ */
+
+#ifndef CARDRATE_EEPROM_START
+#define CARDRATE_EEPROM_START (E2END + 1 - 16)
+#endif
+#ifndef CARDRATE_SLOTS
+#define CARDRATE_SLOTS 4
+#endif
+
+#define CARDRATE_UNKNOWN 0xFF
+
+struct _a_cardrate_slot {
+	uint16_t cid_crc;
+	uint8_t rate;
+	uint8_t check;
+};
+
+uint8_t cardrate_Lookup(const void *cid);
+void cardrate_Remember(const void *cid, uint8_t rate);
+
+
+// CRC-16/CCITT of the 16 byte CID
+uint16_t _cardrate_Crc(const void *cid)
+{
+	const uint8_t *p = (const uint8_t *)cid;
+	uint16_t crc = 0xFFFF;
+	uint8_t i;
+	for (i = 0; i < 16; i++) {crc = _crc_ccitt_update(crc, p[i]);}
+	return crc;
+}
+
+
+// Check byte, so an erased (0xFF) slot doesn't pass
+uint8_t _cardrate_Check(uint16_t cid_crc, uint8_t rate)
+{
+	return (uint8_t)cid_crc ^ (uint8_t)(cid_crc >> 8) ^ rate ^ 0x5A;
+}
+
+
+// EEPROM address of the slot a card goes in
+struct _a_cardrate_slot *_cardrate_Slot(uint16_t cid_crc)
+{
+	return (struct _a_cardrate_slot *)(CARDRATE_EEPROM_START + (cid_crc % CARDRATE_SLOTS) * sizeof(struct _a_cardrate_slot));
+}
+
+
+// Rate remembered for the card with this 16 byte CID, or CARDRATE_UNKNOWN
+uint8_t cardrate_Lookup(const void *cid)
+{
+	struct _a_cardrate_slot slot;
+	uint16_t crc = _cardrate_Crc(cid);
+
+	eeprom_read_block(&slot, _cardrate_Slot(crc), sizeof(slot));
+	if (slot.cid_crc != crc || slot.check != _cardrate_Check(crc, slot.rate)) {return CARDRATE_UNKNOWN;}
+	return slot.rate;
+}
+
+
+// Writes it if it changed (only the bytes that did)
+void cardrate_Remember(const void *cid, uint8_t rate)
+{
+	struct _a_cardrate_slot slot;
+
+	slot.cid_crc = _cardrate_Crc(cid);
+	slot.rate = rate;
+	slot.check = _cardrate_Check(slot.cid_crc, rate);
+	eeprom_update_block(&slot, _cardrate_Slot(slot.cid_crc), sizeof(slot));
+}
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _LEM_DEADBAND_H
+#define _LEM_DEADBAND_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Deadband.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Change detection for logging only what's new. A value is "interesting" when it has moved more than its band
+ *  from the last value logged, or is changing faster than its slope limit between two samples.
+ *  Steady values log nothing, a heartbeat (kept by the caller) still logs now and then.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/Deadband.h" // Change detection. REQUIRES: deadband_Initialize(); per value
+ *  - struct a_deadband volts; deadband_Initialize(&volts, 20, 5); // 20 mV band, or faster than 5 mV/s
+ *  - Every sample: if (deadband_Check(&volts, mv, time) || heartbeat_due) { log it; deadband_Logged(&volts, mv); }
+ *
+ * Functions:
+ *  void deadband_Initialize(struct a_deadband *db, int32_t band, int32_t slope); // Band [units], slope [units/s], 0 turns either off
+ *  bool deadband_Check(struct a_deadband *db, int32_t value, uint32_t time); // Outside the band or too steep since the last sample
+ *  void deadband_Logged(struct a_deadband *db, int32_t value); // value was logged, the band is now centred on it
+ *
+ * Notes:
+ *  - The first sample is always outside the band (nothing logged yet).
+ *  - The band is measured from the last value logged, not the last sample, so slow drift still gets logged once it adds up.
+ *  - Slope compares the last two samples: |change| * 1000 > slope * ms between them.
+ */
+
+struct a_deadband {
+	int32_t band;            // [units], 0 = off
+	int32_t slope;           // [units/s], 0 = off
+	int32_t logged;          // Last value logged
+	int32_t previous;        // Last value checked
+	uint32_t previous_time;  // [ms]
+	bool has_logged, has_previous;
+};
+
+void deadband_Initialize(struct a_deadband *db, int32_t band, int32_t slope);
+bool deadband_Check(struct a_deadband *db, int32_t value, uint32_t time);
+void deadband_Logged(struct a_deadband *db, int32_t value);
+
+
+// Band [units], slope [units/s], 0 turns either off
+void deadband_Initialize(struct a_deadband *db, int32_t band, int32_t slope)
+{
+	db->band = band;
+	db->slope = slope;
+	db->logged = db->previous = 0;
+	db->previous_time = 0;
+	db->has_logged = db->has_previous = false;
+}
+
+
+// Outside the band or too steep since the last sample
+bool deadband_Check(struct a_deadband *db, int32_t value, uint32_t time)
+{
+	int64_t change;
+	uint32_t elapsed;
+	bool outside = !db->has_logged;
+
+	if (db->band && db->has_logged) {
+		change = (int64_t)value - db->logged;
+		if (change > db->band || change < -(int64_t)db->band) {outside = true;}
+	}
+	if (db->slope && db->has_previous) {
+		change = (int64_t)value - db->previous;
+		if (change < 0) {change = -change;}
+		elapsed = time - db->previous_time;
+		if (change * 1000 > (int64_t)db->slope * elapsed) {outside = true;}
+	}
+	db->previous = value;
+	db->previous_time = time;
+	db->has_previous = true;
+	return outside;
+}
+
+
+// value was logged, the band is now centred on it
+void deadband_Logged(struct a_deadband *db, int32_t value)
+{
+	db->logged = value;
+	db->has_logged = true;
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef _LEM_DOWNSAMPLE_H
+#define _LEM_DOWNSAMPLE_H 1
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Downsample.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Cascaded aggregates of a set of values at several resolutions (e.g. 1 minute, 15 minutes, a day) in constant RAM.
+ *  Samples go into the finest tier only. When a tier's window ends its record (count, sum, min, max, last per value)
+ *  is handed out to be logged and then merged into the next coarser tier, so each sample is only touched once.
+ *
+ * To Use:
+ *  - Define DOWNSAMPLE_VALUES (values per sample) before including if it isn't 1
+ *  - Paste: #include "lemtils/Downsample.h" // Multi-resolution aggregates. REQUIRES: downsample_Initialize(); per tier
+ *  - struct a_downsample_tier tiers[3];
+ *    downsample_Initialize(&tiers[0], 60000UL, now); downsample_Initialize(&tiers[1], 900000UL, now); downsample_Initialize(&tiers[2], 86400000UL, now);
+ *  - Every sample:
+ *      while ((i = downsample_Closing(tiers, 3, time)) != DOWNSAMPLE_NONE) { log tiers[i].record; downsample_Close(tiers, 3, i, time); }
+ *      downsample_Add(&tiers[0], values);
+ *
+ * Definitions:
+ *  DOWNSAMPLE_VALUES 1 // Values aggregated side by side per sample
+ *  DOWNSAMPLE_NONE 0xFF // downsample_Closing(): no tier has finished
+ *
+ * Functions:
+ *  void downsample_Initialize(struct a_downsample_tier *tier, uint32_t window_ms, uint32_t now); // Empty, window aligned to the one holding now
+ *  uint8_t downsample_Closing(struct a_downsample_tier *tiers, uint8_t count, uint32_t time); // Finest tier with a finished window to log, or DOWNSAMPLE_NONE
+ *  void downsample_Close(struct a_downsample_tier *tiers, uint8_t count, uint8_t tier, uint32_t time); // Merges it up a tier and starts its next window
+ *  void downsample_Add(struct a_downsample_tier *tier, const int32_t *values); // One sample into the finest tier
+ *
+ * Notes:
+ *  - Each window must be a whole multiple of the finer one, so a coarse window never ends part way through a finer one.
+ *  - Windows are aligned to multiples of their length on the ms clock, which restarts every ~49.7 days (a daily window
+ *    straddling that is cut short).
+ *  - Windows with no samples (powered off, not recording) are skipped, not logged.
+ *  - The record is written as is: start, count, then sum (8 bytes), min, max, last per value, little endian, no padding on AVR.
+ */
+
+#ifndef DOWNSAMPLE_VALUES
+#define DOWNSAMPLE_VALUES 1
+#endif
+
+#define DOWNSAMPLE_NONE 0xFF
+
+struct a_downsample_stat {
+	int64_t sum;
+	int32_t min, max, last;
+};
+
+// One window, as logged (8 + 20 bytes per value)
+struct a_downsample_record {
+	uint32_t start;          // [ms] window start
+	uint32_t count;          // Samples in the window
+	struct a_downsample_stat stat[DOWNSAMPLE_VALUES];
+};
+
+struct a_downsample_tier {
+	uint32_t window_ms;
+	struct a_downsample_record record;
+};
+
+void downsample_Initialize(struct a_downsample_tier *tier, uint32_t window_ms, uint32_t now);
+uint8_t downsample_Closing(struct a_downsample_tier *tiers, uint8_t count, uint32_t time);
+void downsample_Close(struct a_downsample_tier *tiers, uint8_t count, uint8_t tier, uint32_t time);
+void downsample_Add(struct a_downsample_tier *tier, const int32_t *values);
+
+
+// Empty window, starting at the multiple of window_ms at or before now
+void _downsample_Restart(struct a_downsample_tier *tier, uint32_t now)
+{
+	uint8_t i;
+	tier->record.start = now - (now % tier->window_ms);
+	tier->record.count = 0;
+	for (i = 0; i < DOWNSAMPLE_VALUES; i++) {
+		tier->record.stat[i].sum = 0;
+		tier->record.stat[i].min = tier->record.stat[i].max = tier->record.stat[i].last = 0;
+	}
+}
+
+
+// Empty, window aligned to the one holding now
+void downsample_Initialize(struct a_downsample_tier *tier, uint32_t window_ms, uint32_t now)
+{
+	tier->window_ms = window_ms;
+	_downsample_Restart(tier, now);
+}
+
+
+// Finest tier with a finished window to log, or DOWNSAMPLE_NONE. Finished empty windows are just restarted.
+uint8_t downsample_Closing(struct a_downsample_tier *tiers, uint8_t count, uint32_t time)
+{
+	uint8_t i;
+	for (i = 0; i < count; i++) {
+		if ((time - tiers[i].record.start) < tiers[i].window_ms) {continue;}
+		if (tiers[i].record.count) {return i;}
+		_downsample_Restart(&tiers[i], time);
+	}
+	return DOWNSAMPLE_NONE;
+}
+
+
+// Merges the finished tier into the next coarser one (if any) and starts its next window
+void downsample_Close(struct a_downsample_tier *tiers, uint8_t count, uint8_t tier, uint32_t time)
+{
+	uint8_t i;
+	struct a_downsample_record *from = &tiers[tier].record;
+	struct a_downsample_record *into;
+
+	if ((tier + 1) < count && from->count) {
+		into = &tiers[tier + 1].record;
+		for (i = 0; i < DOWNSAMPLE_VALUES; i++) {
+			if (into->count == 0 || from->stat[i].min < into->stat[i].min) {into->stat[i].min = from->stat[i].min;}
+			if (into->count == 0 || from->stat[i].max > into->stat[i].max) {into->stat[i].max = from->stat[i].max;}
+			into->stat[i].sum += from->stat[i].sum;
+			into->stat[i].last = from->stat[i].last;
+		}
+		into->count += from->count;
+	}
+	_downsample_Restart(&tiers[tier], time);
+}
+
+
+// One sample (DOWNSAMPLE_VALUES values) into the finest tier
+void downsample_Add(struct a_downsample_tier *tier, const int32_t *values)
+{
+	uint8_t i;
+	struct a_downsample_record *record = &tier->record;
+	for (i = 0; i < DOWNSAMPLE_VALUES; i++) {
+		if (record->count == 0 || values[i] < record->stat[i].min) {record->stat[i].min = values[i];}
+		if (record->count == 0 || values[i] > record->stat[i].max) {record->stat[i].max = values[i];}
+		record->stat[i].sum += values[i];
+		record->stat[i].last = values[i];
+	}
+	record->count++;
+}
+
+#endif
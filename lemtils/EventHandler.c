@@ -12,6 +12,10 @@
  */
 
 #include "EventHandler.h"
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+volatile uint32_t event_Clock = 0;
 
 void event_Start(struct an_event *event){
 	event->countdown = event->default_countdown; // Means: event.countdown = event.default_countdown;
@@ -65,4 +69,110 @@ bool event_CountdownIsZero(struct an_event *event)
 	}
 }
 
+
+void event_Advance(struct an_event *event, unsigned short ticks){
+	if (event->is_planned == true) {
+		event->countdown = (event->countdown > ticks) ? (event->countdown - ticks) : 0;
+	}
+}
+
+
+unsigned short event_TimeRemaining(struct an_event *event){
+	if (event->is_planned == true) {return event->countdown;}
+	return EVENT_NOT_PLANNED;
+}
+
+
+
+void event_ClockTick(void){
+	event_Clock++;
+}
+
+
+void event_ClockAdvance(uint32_t ms){
+	uint8_t sreg = SREG;
+	cli();
+	event_Clock += ms;
+	SREG = sreg;
+}
+
+
+uint32_t event_Now(void){
+	uint32_t now;
+	uint8_t sreg = SREG;
+	cli();
+	now = event_Clock;
+	SREG = sreg;
+	return now;
+}
+
+
+void event_PeriodicInitialize(struct a_periodic_event *event, uint32_t period, uint8_t policy){
+	event->period = period ? period : 1;
+	event->policy = policy;
+	event->missed = 0;
+	event->is_planned = false;
+}
+
+
+void event_PeriodicStartAt(struct a_periodic_event *event, uint32_t first_deadline){
+	event->next_deadline = first_deadline;
+	event->last_deadline = first_deadline;
+	event->is_planned = true;
+}
+
+
+void event_PeriodicStart(struct a_periodic_event *event){
+	event_PeriodicStartAt(event, event_Now() + event->period);
+}
+
+
+void event_PeriodicStartNow(struct a_periodic_event *event){
+	event_PeriodicStartAt(event, event_Now());
+}
+
+
+void event_PeriodicCancel(struct a_periodic_event *event){
+	event->is_planned = false;
+}
+
+
+void event_PeriodicSetPeriod(struct a_periodic_event *event, uint32_t period){
+	event->period = period ? period : 1;
+	if (event->is_planned) {event->next_deadline = event->last_deadline + event->period;} // May already be due (runs once, then in phase)
+}
+
+
+bool event_PeriodicIsReady(struct a_periodic_event *event)
+{
+	uint32_t now, late, behind;
+	if (event->is_planned == false) {return false;}
+
+	now = event_Now();
+	late = now - event->next_deadline; // Wraps, so (int32_t) < 0 means not due yet
+	if ((int32_t)late < 0) {return false;}
+
+	event->last_deadline = event->next_deadline;
+
+	if (event->policy == EVENT_SKIP_MISSED) {
+		// Jump over (and count) every later deadline already passed, so the next one is in the future
+		behind = late / event->period;
+		event->missed += behind;
+		event->next_deadline += (behind + 1) * event->period;
+	} else {
+		// EVENT_CATCH_UP: next deadline is still in the past if we are behind, so the next call runs again right away
+		if (late >= event->period) {event->missed++;} // Running a whole period (or more) late
+		event->next_deadline += event->period;
+	}
+	return true;
+}
+
+
+uint32_t event_PeriodicTimeRemaining(struct a_periodic_event *event){
+	int32_t remaining;
+	if (event->is_planned == false) {return EVENT_PERIODIC_NOT_PLANNED;}
+	remaining = (int32_t)(event->next_deadline - event_Now());
+	return (remaining > 0) ? (uint32_t)remaining : 0;
+}
+
 #endif
\ No newline at end of file
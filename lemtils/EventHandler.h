@@ -17,6 +17,15 @@
  *  3. Have an event handler function that checks if the event is "ready" (it has fully counted down)
  *  4. If "ready", do some action (use a switch/case). Restart event if desired.
  *  
+ *  Periodic events (a_periodic_event):
+ *  Restarting an_event from the handler counts from whenever the handler got to it, so handler latency adds up (drift).
+ *  A periodic event keeps an absolute next deadline on a 32-bit ms clock instead (event_Clock, good for ~49 days),
+ *  and the next deadline is always last deadline + period, so it stays phase-locked to the nominal rate.
+ *  1. Call event_ClockTick() every 1ms (same ISR as event_Tick), and event_ClockAdvance(ms) for time the ISR missed (asleep)
+ *  2. event_PeriodicInitialize(&ev, period_ms, EVENT_SKIP_MISSED or EVENT_CATCH_UP) then event_PeriodicStartNow(&ev)
+ *  3. if (event_PeriodicIsReady(&ev)) { ... } - no restart needed. ev.last_deadline is the nominal time of this run.
+ *  If the handler falls a whole period or more behind, ev.missed counts the deadlines it missed.
+ *  EVENT_SKIP_MISSED drops them (next run is the next deadline in the future), EVENT_CATCH_UP runs them late, one per call.
  *
  * 
  *  
@@ -125,12 +134,25 @@ int main()
 */
 
 #include <stdbool.h>
+#include <stdint.h>
 
 struct an_event {
 	volatile unsigned short countdown, default_countdown;
 	volatile bool is_planned;
 };
 
+#define EVENT_SKIP_MISSED 0 // A periodic event that fell behind jumps to the next deadline in the future
+#define EVENT_CATCH_UP 1    // A periodic event that fell behind runs once for every deadline it missed
+
+struct a_periodic_event {
+	uint32_t next_deadline, last_deadline, period; // Absolute times on event_Clock [ms]
+	unsigned short missed; // Deadlines run (or skipped) a full period or more late
+	uint8_t policy;        // EVENT_SKIP_MISSED or EVENT_CATCH_UP
+	bool is_planned;
+};
+
+extern volatile uint32_t event_Clock; // ms since start up, ticked by event_ClockTick()
+
 void event_Start(struct an_event *event); // Sets the countdown and activates (sets "is_planned" to true)
 
 void event_ResetCountdown(struct an_event *event); // Resets the countdown to default, does not activate/deactivate
@@ -147,4 +169,34 @@ bool event_IsReady(struct an_event *event); // Returns true if the count is zero
 
 bool event_CountdownIsZero(struct an_event *event); // Returns true if the count is zero, does not deactivate
 
+void event_Advance(struct an_event *event, unsigned short ticks); // Ticks the event's count down by "ticks" at once (e.g. time spent asleep without the clock)
+
+unsigned short event_TimeRemaining(struct an_event *event); // Returns the countdown if the event is active, EVENT_NOT_PLANNED if not
+
+#define EVENT_NOT_PLANNED 0xFFFF // event_TimeRemaining() of an inactive event (so the minimum of all events is the next deadline)
+
+void event_ClockTick(void); // Ticks event_Clock by 1ms, call from the 1ms ISR
+
+void event_ClockAdvance(uint32_t ms); // Adds ms to event_Clock at once (e.g. time spent asleep without the clock)
+
+uint32_t event_Now(void); // Reads event_Clock (atomically, it is 32 bits)
+
+void event_PeriodicInitialize(struct a_periodic_event *event, uint32_t period, uint8_t policy); // Sets the period and policy, inactive
+
+void event_PeriodicStart(struct a_periodic_event *event); // First deadline is one period from now
+
+void event_PeriodicStartNow(struct a_periodic_event *event); // First deadline is now
+
+void event_PeriodicStartAt(struct a_periodic_event *event, uint32_t first_deadline); // First deadline at an absolute time (to line up phase)
+
+void event_PeriodicCancel(struct a_periodic_event *event); // Deactivates
+
+void event_PeriodicSetPeriod(struct a_periodic_event *event, uint32_t period); // Changes the period, the next deadline is one new period after the last
+
+bool event_PeriodicIsReady(struct a_periodic_event *event); // Returns true once per deadline reached and moves to the next one. Stays active.
+
+uint32_t event_PeriodicTimeRemaining(struct a_periodic_event *event); // ms until the next deadline, 0 if due, EVENT_PERIODIC_NOT_PLANNED if inactive
+
+#define EVENT_PERIODIC_NOT_PLANNED 0xFFFFFFFF
+
 #endif
\ No newline at end of file
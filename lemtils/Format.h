@@ -0,0 +1,320 @@
+#ifndef _LEM_FORMAT_H
+#define _LEM_FORMAT_H 1
+
+#include <avr/wdt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <SD.h>
+
+/*
+ * Format.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Formats the card in place: erases all of it, then writes a FAT16 (up to 2GB) or FAT32 volume laid out the way
+ *  the SD spec's file system part wants it. The partition and the data region (cluster 2) start on an allocation
+ *  unit (AU) boundary, the FATs are padded to end on one, so every cluster sits inside a single AU and the card's
+ *  flash management never has to split a cluster write. The AU comes from the card's SD Status.
+ *  Only a handful of blocks are written (MBR, boot sectors, the start of each FAT), the erase does the rest, so
+ *  a format takes seconds whatever the card size.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/Format.h" // On-device card format. REQUIRES: the card not mounted (close every file first)
+ *  - Sd2Card *card = SD.sdCard(); if (!card->init(SD_SCK_RATE, SD_CHIP_SELECT_PIN)) { FORMAT_ERROR_INIT }
+ *  - struct a_format_layout layout;
+ *  - if (format_Card(card, serial, &layout) != FORMAT_OK) { failed, card->errorCode() has the card's side of it }
+ *  - SD.begin() again to use it
+ *
+ * Definitions:
+ *  FORMAT_ERASE_CHUNK 65536UL   // Blocks per erase command (32MB), the watchdog is fed between them
+ *  FORMAT_FAT16_MAX_BLOCKS      // Cards up to this (2GB) get FAT16, bigger ones FAT32
+ *  FORMAT_OK, FORMAT_ERROR_...  // format_Card() results
+ *
+ * Functions:
+ *  uint8_t format_Card(Sd2Card *card, uint32_t serial, struct a_format_layout *layout); // Erase and lay out the whole card, FORMAT_OK or an error
+ *  uint32_t format_AllocationUnit(Sd2Card *card); // AU in blocks from the SD Status (the usual boundary for the card's type if it can't be read)
+ *  bool format_Layout(struct a_format_layout *layout, uint32_t blocks, uint32_t au); // Works out the volume for a card, false if none fits
+ *
+ * Notes:
+ *  - Cluster size goes by card size as the SD spec has it (e.g. 32KB up to 32GB, 64KB over).
+ *  - The AU is capped at 16MB (so FAT32's reserved sector count fits) and on small cards at 1/64 of the card.
+ *  - Erased blocks read as zeros on most cards but as 0xFF on some (SCR DATA_STAT_AFTER_ERASE). The FAT is checked
+ *    after the erase and written with zeros if it isn't, with one multi-block write (slower, but still no FAT walk).
+ *    If the card won't erase at all the same write covers it, the old data clusters are left as they were.
+ *  - No volume label entry in the root directory, the boot sector's label is "S4LOGGER".
+ *  - CHS in the partition table is for 255 heads/63 sectors, nothing reads it but old BIOSes.
+ *  - The volume cache is used as the block buffer, anything in it is flushed (to the old volume) first.
+ */
+
+#ifndef FORMAT_ERASE_CHUNK
+#define FORMAT_ERASE_CHUNK 65536UL
+#endif
+
+#define FORMAT_FAT16_MAX_BLOCKS 0x400000UL
+#define FORMAT_AU_MAX 32768UL  // 16MB
+
+#define FORMAT_OK 0
+#define FORMAT_ERROR_SIZE 1    // Couldn't read the card size, or no FAT16/FAT32 volume fits it
+#define FORMAT_ERROR_WRITE 2   // A block of the volume didn't write (MBR, boot sector, FAT)
+#define FORMAT_ERROR_INIT 3    // The caller couldn't initialize the card, format_Card() wasn't run
+
+struct a_format_layout {
+	uint32_t blocks;         // Whole card
+	uint32_t au;             // Alignment used (blocks)
+	uint32_t volume_start;   // First block of the partition
+	uint32_t volume_blocks;
+	uint32_t fat_start;      // First FAT, the second follows it
+	uint32_t fat_blocks;     // One FAT
+	uint32_t data_start;     // Cluster 2, on an AU boundary
+	uint32_t clusters;
+	uint16_t reserved;       // Blocks from the partition start to the first FAT
+	uint8_t cluster_blocks;
+	uint8_t fat_type;        // 16 or 32
+};
+
+uint8_t format_Card(Sd2Card *card, uint32_t serial, struct a_format_layout *layout);
+uint32_t format_AllocationUnit(Sd2Card *card);
+bool format_Layout(struct a_format_layout *layout, uint32_t blocks, uint32_t au);
+
+
+// AU in blocks from the SD Status (AU_SIZE, bits 431:428), the usual boundary for the card's type if it can't be read
+uint32_t format_AllocationUnit(Sd2Card *card)
+{
+	uint32_t au = card->allocationUnit(SdVolume::cacheClear());
+
+	if (au) {return au;}
+	return card->type() == SD_CARD_TYPE_SDHC ? 8192UL : 128UL; // 4MB, 64KB
+}
+
+
+// Works out the volume for a card of blocks with the data region on an au boundary, false if none fits
+bool format_Layout(struct a_format_layout *layout, uint32_t blocks, uint32_t au)
+{
+	uint32_t megabytes = blocks >> 11;
+	uint32_t data, clusters, fat, needed;
+	uint8_t cluster_blocks;
+
+	if (megabytes < 8) {return false;}
+	if (megabytes <= 16) {cluster_blocks = 2;}
+	else if (megabytes <= 32) {cluster_blocks = 4;}
+	else if (megabytes <= 64) {cluster_blocks = 8;}
+	else if (megabytes <= 128) {cluster_blocks = 16;}
+	else if (megabytes <= 1024) {cluster_blocks = 32;}
+	else if (megabytes <= 32768) {cluster_blocks = 64;}
+	else {cluster_blocks = 128;}
+
+	while (au > FORMAT_AU_MAX || (au > cluster_blocks && au * 64 > blocks)) {au >>= 1;}
+	if (au < cluster_blocks) {au = cluster_blocks;}
+
+	if (blocks <= FORMAT_FAT16_MAX_BLOCKS) {
+		// Partition start floats so the one reserved block, the FATs and the 32 block root directory end on the AU
+		for (data = 2 * au;; data += au) {
+			if (data >= blocks) {return false;}
+			clusters = (blocks - data) / cluster_blocks;
+			fat = (clusters + 2 + 255) / 256;
+			needed = 1 + 2 * fat + 32;
+			if (data >= au + needed) {break;}
+		}
+		if (clusters < 4085 || clusters >= 65525) {return false;}
+		layout->fat_type = 16;
+		layout->reserved = 1;
+		layout->volume_start = data - needed;
+	} else {
+		// Partition starts on the first AU, the reserved sectors pad the FATs out to the next boundary
+		for (data = 2 * au;; data += au) {
+			if (data >= blocks) {return false;}
+			clusters = (blocks - data) / cluster_blocks;
+			fat = (clusters + 2 + 127) / 128;
+			if (data >= au + 9 + 2 * fat) {break;}
+		}
+		if (clusters < 65525) {return false;}
+		layout->fat_type = 32;
+		layout->reserved = data - au - 2 * fat;
+		layout->volume_start = au;
+	}
+	layout->blocks = blocks;
+	layout->au = au;
+	layout->cluster_blocks = cluster_blocks;
+	layout->clusters = clusters;
+	layout->fat_blocks = fat;
+	layout->fat_start = layout->volume_start + layout->reserved;
+	layout->data_start = data;
+	layout->volume_blocks = data - layout->volume_start + clusters * cluster_blocks;
+	return true;
+}
+
+
+// Empty block, with the 0x55 0xAA signature if it's a boot block
+void _format_Clear(uint8_t *block, bool signature)
+{
+	memset(block, 0, 512);
+	if (signature) {
+		block[510] = BOOTSIG0;
+		block[511] = BOOTSIG1;
+	}
+}
+
+
+// CHS of a block for the partition table: head, sector | cylinder bits 9:8, cylinder bits 7:0
+void _format_Chs(uint8_t *chs, uint32_t block)
+{
+	uint32_t cylinder = block / (255UL * 63);
+	if (cylinder > 1023) {
+		chs[0] = 254;
+		chs[1] = 0xFF;
+		chs[2] = 0xFF;
+		return;
+	}
+	chs[0] = (block / 63) % 255;
+	chs[1] = (block % 63 + 1) | ((cylinder >> 2) & 0xC0);
+	chs[2] = cylinder;
+}
+
+
+// Whether an erased block reads back as zeros
+bool _format_IsZero(Sd2Card *card, uint8_t *block, uint32_t number)
+{
+	uint16_t i;
+	if (!card->readBlock(number, block)) {return false;}
+	for (i = 0; i < 512; i++) {
+		if (block[i]) {return false;}
+	}
+	return true;
+}
+
+
+// count blocks of zeros from first, one multi-block write
+bool _format_Zero(Sd2Card *card, uint8_t *block, uint32_t first, uint32_t count)
+{
+	_format_Clear(block, false);
+	if (!card->writeStart(first, count)) {return false;}
+	while (count--) {
+		if (!card->writeData(block)) {return false;}
+		if (!(count & 0xFF)) {wdt_reset();}
+	}
+	return card->writeStop();
+}
+
+
+// Erase and lay out the whole card. FORMAT_OK or an error.
+uint8_t format_Card(Sd2Card *card, uint32_t serial, struct a_format_layout *layout)
+{
+	cache_t *cache;
+	part_t *partition;
+	bool erased = true;
+	uint32_t first, last, blocks, zero_blocks;
+
+	if (!(blocks = card->cardSize())) {return FORMAT_ERROR_SIZE;}
+	if (!format_Layout(layout, blocks, format_AllocationUnit(card))) {return FORMAT_ERROR_SIZE;}
+	cache = (cache_t *)SdVolume::cacheClear();
+
+	for (first = 0; first < blocks; first = last + 1) {
+		last = first + FORMAT_ERASE_CHUNK - 1;
+		if (last >= blocks) {last = blocks - 1;}
+		if (!card->erase(first, last)) {
+			erased = false; // Not erasable (or too slow), the FATs get written out instead
+			break;
+		}
+		wdt_reset();
+	}
+	// The FATs and root directory (FAT16) or root cluster (FAT32) have to be zeros
+	zero_blocks = layout->data_start - layout->fat_start + (layout->fat_type == 32 ? layout->cluster_blocks : 0);
+	if (!erased || !_format_IsZero(card, cache->data, layout->fat_start + 1)) {
+		if (!_format_Zero(card, cache->data, layout->fat_start, zero_blocks)) {return FORMAT_ERROR_WRITE;}
+	}
+
+	// MBR, one partition
+	_format_Clear(cache->data, true);
+	partition = &cache->mbr.part[0];
+	_format_Chs((uint8_t *)partition + 1, layout->volume_start);
+	_format_Chs((uint8_t *)partition + 5, layout->volume_start + layout->volume_blocks - 1);
+	if (layout->fat_type == 16) {
+		partition->type = layout->volume_blocks < 65536UL ? 0x04 : 0x06;
+	} else {
+		partition->type = layout->volume_start + layout->volume_blocks <= 255UL * 63 * 1024 ? 0x0B : 0x0C; // 0x0C past what CHS reaches
+	}
+	partition->firstSector = layout->volume_start;
+	partition->totalSectors = layout->volume_blocks;
+	if (!card->writeMbr(cache->data)) {return FORMAT_ERROR_WRITE;} // writeBlock() won't touch block 0
+
+	// Boot sector (FAT32: and its backup at 6, FSINFO at 1 and 7)
+	_format_Clear(cache->data, true);
+	if (layout->fat_type == 16) {
+		fbs16_t *boot = &cache->fbs16;
+		boot->jmpToBootCode[0] = 0xEB;
+		boot->jmpToBootCode[2] = 0x90;
+		memcpy(boot->oemName, "S4LOGGER", sizeof(boot->oemName));
+		boot->bytesPerSector = 512;
+		boot->sectorsPerCluster = layout->cluster_blocks;
+		boot->reservedSectorCount = layout->reserved;
+		boot->fatCount = 2;
+		boot->rootDirEntryCount = 512;
+		boot->mediaType = 0xF8;
+		boot->sectorsPerFat16 = layout->fat_blocks;
+		boot->sectorsPerTrack = 63;
+		boot->headCount = 255;
+		boot->hidddenSectors = layout->volume_start;
+		boot->totalSectors32 = layout->volume_blocks;
+		boot->driveNumber = 0x80;
+		boot->bootSignature = EXTENDED_BOOT_SIG;
+		boot->volumeSerialNumber = serial;
+		memcpy(boot->volumeLabel, "S4LOGGER   ", sizeof(boot->volumeLabel));
+		memcpy(boot->fileSystemType, "FAT16   ", sizeof(boot->fileSystemType));
+		if (!card->writeBlock(layout->volume_start, cache->data)) {return FORMAT_ERROR_WRITE;}
+	} else {
+		fbs_t *boot = &cache->fbs;
+		boot->jmpToBootCode[0] = 0xEB;
+		boot->jmpToBootCode[2] = 0x90;
+		memcpy(boot->oemName, "S4LOGGER", sizeof(boot->oemName));
+		boot->bpb.bytesPerSector = 512;
+		boot->bpb.sectorsPerCluster = layout->cluster_blocks;
+		boot->bpb.reservedSectorCount = layout->reserved;
+		boot->bpb.fatCount = 2;
+		boot->bpb.mediaType = 0xF8;
+		boot->bpb.sectorsPerTrtack = 63;
+		boot->bpb.headCount = 255;
+		boot->bpb.hidddenSectors = layout->volume_start;
+		boot->bpb.totalSectors32 = layout->volume_blocks;
+		boot->bpb.sectorsPerFat32 = layout->fat_blocks;
+		boot->bpb.fat32RootCluster = 2;
+		boot->bpb.fat32FSInfo = 1;
+		boot->bpb.fat32BackBootBlock = 6;
+		boot->driveNumber = 0x80;
+		boot->bootSignature = EXTENDED_BOOT_SIG;
+		boot->volumeSerialNumber = serial;
+		memcpy(boot->volumeLabel, "S4LOGGER   ", sizeof(boot->volumeLabel));
+		memcpy(boot->fileSystemType, "FAT32   ", sizeof(boot->fileSystemType));
+		if (!card->writeBlock(layout->volume_start, cache->data)
+			|| !card->writeBlock(layout->volume_start + 6, cache->data)) {return FORMAT_ERROR_WRITE;}
+
+		_format_Clear(cache->data, false);
+		cache->fsinfo.leadSignature = FSINFO_LEAD_SIG;
+		cache->fsinfo.structSignature = FSINFO_STRUCT_SIG;
+		cache->fsinfo.freeCount = 0xFFFFFFFFUL; // Unknown, the next desktop mount works it out
+		cache->fsinfo.nextFree = 0xFFFFFFFFUL;
+		cache->fsinfo.trailSignature = FSINFO_TRAIL_SIG;
+		if (!card->writeBlock(layout->volume_start + 1, cache->data)
+			|| !card->writeBlock(layout->volume_start + 7, cache->data)) {return FORMAT_ERROR_WRITE;}
+	}
+
+	// First block of each FAT: media byte and end of chain for the reserved clusters (FAT32: and the root directory)
+	_format_Clear(cache->data, false);
+	if (layout->fat_type == 16) {
+		cache->fat16[0] = 0xFFF8;
+		cache->fat16[1] = FAT16EOC;
+	} else {
+		cache->fat32[0] = 0x0FFFFFF8UL;
+		cache->fat32[1] = FAT32EOC;
+		cache->fat32[2] = FAT32EOC;
+	}
+	if (!card->writeBlock(layout->fat_start, cache->data)
+		|| !card->writeBlock(layout->fat_start + layout->fat_blocks, cache->data)) {return FORMAT_ERROR_WRITE;}
+	if (!card->writeCheck()) {return FORMAT_ERROR_WRITE;} // The card status of the writes above (SD_WRITE_STATUS_EVERY)
+	return FORMAT_OK;
+}
+
+#endif
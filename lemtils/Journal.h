@@ -0,0 +1,396 @@
+#ifndef _LEM_JOURNAL_H
+#define _LEM_JOURNAL_H 1
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/crc16.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Journal.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Write-ahead journal in the internal EEPROM for records that couldn't go to the card (no card, write failed,
+ *  power failing). Fixed size records with a sequence number and CRC go round the whole EEPROM as a ring, so
+ *  every cell wears the same. Once the card is back the records are replayed oldest first and marked as done.
+ *  Appending only copies into RAM, the bytes are written one per EEPROM ready interrupt. The slots about to be
+ *  used are erased ahead of time, so an append writes without erasing (~1.8ms a byte instead of ~3.4ms) and
+ *  payload bytes left at 0xFF cost nothing.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/Journal.h" // EEPROM write-ahead journal. REQUIRES: journal_Initialize(); journal_Interrupt(); in ISR(EE_READY_vect)
+ *  - journal_Initialize(); // Once at start up, finds where the ring left off and what hasn't been replayed
+ *  - ISR(EE_READY_vect) { journal_Interrupt(); }
+ *  - Card write failed: journal_Append(MY_TYPE, &record); // record is JOURNAL_PAYLOAD_SIZE bytes
+ *  - Card back: while (!journal_IsBusy() && journal_Oldest(&entry)) { write entry.payload by entry.type; journal_MarkReplayed(); }
+ *  - Power failing: journal_Drop(); journal_Append(LAST_TYPE, &record); while (journal_IsBusy()); // The last record gets in first
+ *
+ * Definitions:
+ *  JOURNAL_PAYLOAD_SIZE 16 // Bytes per record, the slot adds 5 (sequence, type, CRC)
+ *  JOURNAL_QUEUE_SIZE 2    // Appends/marks waiting for the EEPROM, power of 2
+ *  JOURNAL_ERASE_AHEAD 2   // Slots kept erased past the last append (one can be on its way in while power fails)
+ *  JOURNAL_EEPROM_START 0  // First EEPROM address used, the journal runs from here to JOURNAL_EEPROM_END (leave room for settings below)
+ *  JOURNAL_EEPROM_END (E2END + 1) // One past the last EEPROM address it may use (leave room for more above)
+ *
+ * Functions:
+ *  void journal_Initialize(); // Scans the EEPROM: next slot, next sequence number, oldest record not replayed. Starts erasing ahead.
+ *  bool journal_Append(uint8_t type, const void *payload); // Queues a record (type 1-254), false if the queue is full
+ *  bool journal_IsBusy(); // EEPROM writes queued or in progress, erasing ahead included (keep out of power down, don't read)
+ *  uint8_t journal_Pending(); // Records not replayed yet
+ *  bool journal_Oldest(struct a_journal_entry *entry); // Reads the oldest record not replayed, false if none. Not while busy.
+ *  bool journal_Newest(struct a_journal_entry *entry); // Reads the newest record (replayed or not), false if none. Not while busy.
+ *  void journal_MarkReplayed(); // The record journal_Oldest() gave is on the card, queues marking it done
+ *  void journal_Drop(); // Power failing: appends not written yet are dropped, erasing ahead stops. Marks are kept.
+ *  void journal_Interrupt(); // Call from ISR(EE_READY_vect)
+ *
+ * Notes:
+ *  - Slot: sequence (2), type (1), payload, CRC-16/CCITT of sequence and payload (2). 48 slots of 21 bytes in 1KB.
+ *  - Moving JOURNAL_EEPROM_START moves every slot and loses what wasn't replayed, moving the end only loses the
+ *    slots cut off.
+ *  - Type 0xFF is an erased slot, 0 is replayed. Marking only writes the type byte, the CRC doesn't cover it.
+ *  - A slot torn by a reset part way through its write fails its CRC and is skipped.
+ *  - When the ring is full of records not replayed, the oldest are overwritten (journal_Lost counts them).
+ *  - Wear: one erase and one write per slot per append plus one byte written per replay, spread over every slot.
+ *    Bytes that already hold the right value aren't rewritten, and a byte whose bits only go from 1 to 0 isn't erased.
+ *  - Erasing ahead stops short of slots holding records not replayed, so with the ring (nearly) full appends erase
+ *    as they write again. It starts after journal_Initialize() and after every append, and takes ~1.8ms a byte
+ *    (~76ms for 2 slots) during which journal_IsBusy() is true.
+ *  - journal_Drop() leaves an append it cut off torn (its CRC fails, it's skipped) and counts what it dropped in
+ *    journal_Lost. With JOURNAL_ERASE_AHEAD 2 the slot after it is already erased, so a last record of mostly 0xFF
+ *    (e.g. 8 bytes of payload: 13 bytes written) is in within ~25ms.
+ */
+
+#ifndef JOURNAL_PAYLOAD_SIZE
+#define JOURNAL_PAYLOAD_SIZE 16
+#endif
+#ifndef JOURNAL_QUEUE_SIZE
+#define JOURNAL_QUEUE_SIZE 2
+#endif
+#ifndef JOURNAL_ERASE_AHEAD
+#define JOURNAL_ERASE_AHEAD 2
+#endif
+#ifndef JOURNAL_EEPROM_START
+#define JOURNAL_EEPROM_START 0
+#endif
+#ifndef JOURNAL_EEPROM_END
+#define JOURNAL_EEPROM_END (E2END + 1)
+#endif
+
+#if (JOURNAL_QUEUE_SIZE & (JOURNAL_QUEUE_SIZE - 1))
+#  error "JOURNAL_QUEUE_SIZE must be a power of 2"
+#endif
+
+#define JOURNAL_TYPE_REPLAYED 0x00
+#define JOURNAL_TYPE_ERASED   0xFF
+
+#define _JOURNAL_SLOT_SIZE (JOURNAL_PAYLOAD_SIZE + 5)
+#define _JOURNAL_SLOTS ((JOURNAL_EEPROM_END - JOURNAL_EEPROM_START) / _JOURNAL_SLOT_SIZE)
+
+struct a_journal_entry {
+	uint16_t sequence;
+	uint8_t type;
+	uint8_t payload[JOURNAL_PAYLOAD_SIZE];
+};
+
+// One EEPROM write waiting for the ready interrupt
+struct _a_journal_job {
+	uint16_t address;
+	uint8_t length;
+	uint8_t data[_JOURNAL_SLOT_SIZE];
+};
+
+struct _a_journal_job _journal_queue[JOURNAL_QUEUE_SIZE];
+volatile uint8_t _journal_queue_head = 0; // Next job added
+volatile uint8_t _journal_queue_tail = 0; // Job being written
+volatile uint8_t _journal_byte = 0;       // Next byte of the job being written
+uint8_t _journal_next_slot = 0;           // Slot the next append goes in
+uint16_t _journal_next_sequence = 0;
+uint8_t _journal_oldest_slot = 0;         // Oldest record not replayed (if _journal_pending)
+uint8_t _journal_pending = 0;
+volatile bool _journal_erasing = true;    // Keeping the next slots erased (journal_Drop() stops it)
+uint8_t _journal_erase_from = 0;          // _journal_next_slot the erasing ahead is for (ISR only)
+uint8_t _journal_erase_byte = 0;          // Next byte past it to erase, over JOURNAL_ERASE_AHEAD slots (ISR only)
+uint16_t journal_Lost = 0;                // Records overwritten (or dropped) before they were replayed
+
+void journal_Initialize(void);
+bool journal_Append(uint8_t type, const void *payload);
+bool journal_IsBusy(void);
+uint8_t journal_Pending(void);
+bool journal_Oldest(struct a_journal_entry *entry);
+bool journal_Newest(struct a_journal_entry *entry);
+void journal_MarkReplayed(void);
+void journal_Drop(void);
+void journal_Interrupt(void);
+
+
+// Direct EEPROM read, only when nothing is being written
+uint8_t _journal_ReadByte(uint16_t address)
+{
+	EEAR = address;
+	EECR |= _BV(EERE);
+	return EEDR;
+}
+
+
+// Reads a slot, true if its CRC checks out and it isn't erased
+bool _journal_ReadSlot(uint8_t slot, struct a_journal_entry *entry)
+{
+	uint16_t address = JOURNAL_EEPROM_START + (uint16_t)slot * _JOURNAL_SLOT_SIZE;
+	uint16_t crc = 0xFFFF;
+	uint8_t i, b;
+
+	b = _journal_ReadByte(address++); crc = _crc_ccitt_update(crc, b); entry->sequence = b;
+	b = _journal_ReadByte(address++); crc = _crc_ccitt_update(crc, b); entry->sequence |= (uint16_t)b << 8;
+	entry->type = _journal_ReadByte(address++);
+	for (i = 0; i < JOURNAL_PAYLOAD_SIZE; i++) {
+		entry->payload[i] = _journal_ReadByte(address++);
+		crc = _crc_ccitt_update(crc, entry->payload[i]);
+	}
+	crc ^= _journal_ReadByte(address++);
+	crc ^= (uint16_t)_journal_ReadByte(address) << 8;
+	return (crc == 0) && (entry->type != JOURNAL_TYPE_ERASED);
+}
+
+
+// Counts the records not replayed from slot "from" up to the newest, and where the oldest of them is
+void _journal_FindOldest(uint8_t from)
+{
+	struct a_journal_entry entry;
+	uint8_t slot = from;
+	uint8_t count = (_journal_next_slot + _JOURNAL_SLOTS - from) % _JOURNAL_SLOTS;
+	if (count == 0) {count = _JOURNAL_SLOTS;} // From the next slot: the whole ring
+	_journal_pending = 0;
+	while (count--) {
+		if (_journal_ReadSlot(slot, &entry) && entry.type != JOURNAL_TYPE_REPLAYED) {
+			if (_journal_pending == 0) {_journal_oldest_slot = slot;}
+			_journal_pending++;
+		}
+		if (++slot >= _JOURNAL_SLOTS) {slot = 0;}
+	}
+}
+
+
+// Scans the EEPROM: next slot (after the newest record), next sequence number, oldest record not replayed
+void journal_Initialize(void)
+{
+	struct a_journal_entry entry;
+	uint8_t slot, newest = 0;
+	bool found = false;
+
+	_journal_queue_head = _journal_queue_tail = 0;
+	_journal_byte = 0;
+	while (EECR & _BV(EEPE)); // A write from before a reset
+	for (slot = 0; slot < _JOURNAL_SLOTS; slot++) {
+		if (!_journal_ReadSlot(slot, &entry)) {continue;}
+		if (!found || (int16_t)(entry.sequence - _journal_next_sequence) >= 0) {
+			newest = slot;
+			_journal_next_sequence = entry.sequence + 1;
+			found = true;
+		}
+	}
+	_journal_next_slot = found ? (newest + 1) % _JOURNAL_SLOTS : 0;
+	_journal_FindOldest(_journal_next_slot); // The slot after the newest is the oldest, so this is the whole ring in order
+	_journal_erasing = true;
+	_journal_erase_from = _journal_next_slot;
+	_journal_erase_byte = 0;
+	EECR |= _BV(EERIE); // Erase ahead
+}
+
+
+// Queues a record (type 1-254), false if the queue is full. Safe to call with the EEPROM busy.
+bool journal_Append(uint8_t type, const void *payload)
+{
+	struct _a_journal_job *job;
+	uint16_t crc = 0xFFFF;
+	uint8_t i, next;
+	uint8_t sreg;
+
+	next = (_journal_queue_head + 1) & (JOURNAL_QUEUE_SIZE - 1);
+	if (next == _journal_queue_tail) {return false;}
+
+	job = &_journal_queue[_journal_queue_head];
+	job->address = JOURNAL_EEPROM_START + (uint16_t)_journal_next_slot * _JOURNAL_SLOT_SIZE;
+	job->length = _JOURNAL_SLOT_SIZE;
+	job->data[0] = (uint8_t)_journal_next_sequence;
+	job->data[1] = (uint8_t)(_journal_next_sequence >> 8);
+	job->data[2] = type;
+	memcpy(&job->data[3], payload, JOURNAL_PAYLOAD_SIZE);
+	crc = _crc_ccitt_update(crc, job->data[0]);
+	crc = _crc_ccitt_update(crc, job->data[1]);
+	for (i = 0; i < JOURNAL_PAYLOAD_SIZE; i++) {crc = _crc_ccitt_update(crc, job->data[3 + i]);}
+	job->data[3 + JOURNAL_PAYLOAD_SIZE] = (uint8_t)crc;
+	job->data[4 + JOURNAL_PAYLOAD_SIZE] = (uint8_t)(crc >> 8);
+
+	if (_journal_pending == 0) {
+		_journal_oldest_slot = _journal_next_slot;
+	} else if (_journal_next_slot == _journal_oldest_slot) {
+		journal_Lost++; // Ring full of records not replayed, the oldest goes
+		_journal_pending--;
+		if (++_journal_oldest_slot >= _JOURNAL_SLOTS) {_journal_oldest_slot = 0;}
+	}
+	_journal_pending++;
+	if (++_journal_next_slot >= _JOURNAL_SLOTS) {_journal_next_slot = 0;}
+	_journal_next_sequence++;
+
+	sreg = SREG;
+	cli();
+	_journal_queue_head = next;
+	EECR |= _BV(EERIE); // Fires as soon as the EEPROM is ready
+	SREG = sreg;
+	return true;
+}
+
+
+// EEPROM writes queued or in progress, erasing ahead included (keep out of power down, don't read)
+bool journal_IsBusy(void)
+{
+	return (_journal_queue_head != _journal_queue_tail) || (EECR & (_BV(EEPE) | _BV(EERIE)));
+}
+
+
+// Records not replayed yet
+uint8_t journal_Pending(void)
+{
+	return _journal_pending;
+}
+
+
+// Reads the oldest record not replayed, false if none (or the EEPROM is busy)
+bool journal_Oldest(struct a_journal_entry *entry)
+{
+	if (_journal_pending == 0 || journal_IsBusy()) {return false;}
+	if (_journal_ReadSlot(_journal_oldest_slot, entry)) {return true;}
+	_journal_FindOldest(_journal_oldest_slot); // Torn or overwritten, look further on
+	return _journal_pending && _journal_ReadSlot(_journal_oldest_slot, entry);
+}
+
+
+// Reads the newest record, replayed or not, false if none (torn, or the EEPROM is busy). E.g. where a count left off.
+bool journal_Newest(struct a_journal_entry *entry)
+{
+	if (journal_IsBusy()) {return false;}
+	return _journal_ReadSlot((_journal_next_slot + _JOURNAL_SLOTS - 1) % _JOURNAL_SLOTS, entry);
+}
+
+
+// The record journal_Oldest() gave is on the card: queues marking it replayed (one byte) and moves on
+void journal_MarkReplayed(void)
+{
+	struct _a_journal_job *job;
+	uint8_t next, sreg;
+
+	if (_journal_pending == 0) {return;}
+	next = (_journal_queue_head + 1) & (JOURNAL_QUEUE_SIZE - 1);
+	if (next == _journal_queue_tail) {return;} // Can't be, journal_Oldest() needs the queue empty
+	job = &_journal_queue[_journal_queue_head];
+	job->address = JOURNAL_EEPROM_START + (uint16_t)_journal_oldest_slot * _JOURNAL_SLOT_SIZE + 2;
+	job->length = 1;
+	job->data[0] = JOURNAL_TYPE_REPLAYED;
+
+	_journal_pending--;
+	if (++_journal_oldest_slot >= _JOURNAL_SLOTS) {_journal_oldest_slot = 0;}
+
+	sreg = SREG;
+	cli();
+	_journal_queue_head = next;
+	EECR |= _BV(EERIE);
+	SREG = sreg;
+}
+
+
+// Power failing: drops the appends not written yet, so a last record goes in straight away. One being written is cut
+// off (left torn). Marks are kept, they're one byte and dropping one would replay its record twice. Stops erasing ahead.
+void journal_Drop(void)
+{
+	uint8_t i, kept, sreg;
+
+	sreg = SREG;
+	cli();
+	_journal_erasing = false;
+	kept = _journal_queue_tail;
+	for (i = _journal_queue_tail; i != _journal_queue_head; i = (i + 1) & (JOURNAL_QUEUE_SIZE - 1)) {
+		if (_journal_queue[i].length == 1) {
+			if (i != kept) {_journal_queue[kept] = _journal_queue[i];}
+			kept = (kept + 1) & (JOURNAL_QUEUE_SIZE - 1);
+			continue;
+		}
+		if (i == _journal_queue_tail) {_journal_byte = 0;} // The byte in progress finishes on its own
+		journal_Lost++;
+	}
+	_journal_queue_head = kept;
+	SREG = sreg;
+}
+
+
+// Next byte of the slots past _journal_next_slot to keep erased, false when they are (or would hold records not replayed)
+bool _journal_NextToErase(uint16_t *address)
+{
+	uint8_t ahead, slot;
+
+	if (_journal_erase_from != _journal_next_slot) { // Appended since, start over from the new next slot
+		_journal_erase_from = _journal_next_slot;
+		_journal_erase_byte = 0;
+	}
+	if (!_journal_erasing || _journal_erase_byte >= JOURNAL_ERASE_AHEAD * _JOURNAL_SLOT_SIZE) {return false;}
+	ahead = _journal_erase_byte / _JOURNAL_SLOT_SIZE;
+	if (ahead >= _JOURNAL_SLOTS - _journal_pending) {return false;} // Ring (nearly) full: that slot holds the oldest records
+	slot = (_journal_erase_from + ahead) % _JOURNAL_SLOTS;
+	*address = JOURNAL_EEPROM_START + (uint16_t)slot * _JOURNAL_SLOT_SIZE + _journal_erase_byte % _JOURNAL_SLOT_SIZE;
+	_journal_erase_byte++;
+	return true;
+}
+
+
+// Starts writing a byte, false if it already holds the value. Erases only if a bit has to go from 0 to 1, and 0xFF is
+// only an erase (~1.8ms each, both together ~3.4ms).
+bool _journal_WriteByte(uint16_t address, uint8_t data)
+{
+	uint8_t old = _journal_ReadByte(address);
+	uint8_t mode;
+
+	if (old == data) {return false;}
+	if (data == 0xFF) {
+		mode = _BV(EEPM0); // Erase only
+	} else if ((old & data) == data) {
+		mode = _BV(EEPM1); // Write only
+	} else {
+		mode = 0; // Erase and write in one go
+	}
+	EEAR = address;
+	EEDR = data;
+	EECR = (EECR & ~(_BV(EEPM1) | _BV(EEPM0))) | mode | _BV(EEMPE);
+	EECR |= _BV(EEPE);  // Within 4 cycles of EEMPE
+	return true;
+}
+
+
+// Call from ISR(EE_READY_vect). Starts the next byte write, skipping bytes that already hold their value. With
+// nothing queued, erases the next slots ahead.
+void journal_Interrupt(void)
+{
+	struct _a_journal_job *job;
+	uint16_t address;
+
+	while (_journal_queue_tail != _journal_queue_head) {
+		job = &_journal_queue[_journal_queue_tail];
+		if (_journal_byte >= job->length) {
+			_journal_byte = 0;
+			_journal_queue_tail = (_journal_queue_tail + 1) & (JOURNAL_QUEUE_SIZE - 1);
+			continue;
+		}
+		address = job->address + _journal_byte;
+		if (_journal_WriteByte(address, job->data[_journal_byte++])) {return;}
+	}
+	while (_journal_NextToErase(&address)) {
+		if (_journal_WriteByte(address, 0xFF)) {return;}
+	}
+	EECR &= ~_BV(EERIE); // Nothing left
+}
+
+#endif
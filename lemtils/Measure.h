@@ -0,0 +1,102 @@
+#ifndef _LEM_MEASURE_H
+#define _LEM_MEASURE_H 1
+
+#include <stdint.h>
+
+/*
+ * Measure.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Fixed-point conversion of ADC readings to engineering units (mV, mA, uW) without floats.
+ *  Each channel has a 16-bit gain in Q(shift) format worked out at compile time from the full scale
+ *  (e.g. VREF in mV, or VREF / shunt resistance in mA), plus a calibrated offset and gain trim.
+ *  A conversion is a subtract, one 16x16->32 multiply and a shift.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/Measure.h" // Fixed-point measurements. REQUIRES: measure_Initialize(); per channel
+ *  - struct a_measure_channel battery;
+ *    measure_Initialize(&battery, MEASURE_GAIN(VREF * 1000UL, 12, 14), 14); // mV, 12-bit readings
+ *    measure_Calibrate(&battery, 3, -1200); // Optional: reads 3 counts high, gain 0.12% high
+ *    int32_t mv = measure_Convert(&battery, raw);
+ *
+ * Definitions:
+ *  MEASURE_GAIN(full_scale, adc_bits, shift) // Gain for units = raw * full_scale / 2^adc_bits, in Q(shift). Constant folded, must be < 65536.
+ *
+ * Functions:
+ *  void measure_Initialize(struct a_measure_channel *channel, uint16_t gain, uint8_t shift); // Nominal gain, no offset
+ *  void measure_Calibrate(struct a_measure_channel *channel, int16_t offset, int16_t trim_ppm); // Offset [counts] and gain trim [ppm] from the nominal gain
+ *  int32_t measure_Convert(const struct a_measure_channel *channel, uint16_t raw); // Raw reading to units, rounded
+ *  int32_t measure_Power(int32_t millivolts, int32_t milliamps); // Power in uW
+ *
+ * Notes:
+ *  - Pick the largest shift that keeps the gain under 65536, that's the best resolution.
+ *  - Readings can be up to 15 bits (13 bits from the oversampling ADC sampler is plenty of room).
+ *  - Rounding is half up, using only integer ops with defined results, so the same code on a PC gives the same numbers.
+ *  - measure_Power() is good for |mV * mA| < 2^31, e.g. 5V at 400A.
+ */
+
+#define MEASURE_GAIN(full_scale, adc_bits, shift) \
+	((uint16_t)((double)(full_scale) * (double)(1UL << (shift)) / (double)(1UL << (adc_bits)) + 0.5))
+
+struct a_measure_channel {
+	uint16_t gain;          // Calibrated, Q(shift) units per count
+	uint16_t nominal_gain;  // From MEASURE_GAIN, kept so calibrating twice doesn't compound
+	int16_t offset;         // Counts read at zero input
+	uint8_t shift;
+};
+
+void measure_Initialize(struct a_measure_channel *channel, uint16_t gain, uint8_t shift);
+void measure_Calibrate(struct a_measure_channel *channel, int16_t offset, int16_t trim_ppm);
+int32_t measure_Convert(const struct a_measure_channel *channel, uint16_t raw);
+int32_t measure_Power(int32_t millivolts, int32_t milliamps);
+
+
+// Nominal gain, no offset
+void measure_Initialize(struct a_measure_channel *channel, uint16_t gain, uint8_t shift)
+{
+	channel->gain = gain;
+	channel->nominal_gain = gain;
+	channel->offset = 0;
+	channel->shift = shift;
+}
+
+
+// Offset [counts] and gain trim [ppm] from the nominal gain. Divides, so do it at start up, not per reading.
+void measure_Calibrate(struct a_measure_channel *channel, int16_t offset, int16_t trim_ppm)
+{
+	int32_t delta = (int32_t)channel->nominal_gain * trim_ppm; // Fits: 65535 * 32767 < 2^31
+	int32_t gain;
+	delta = (delta >= 0) ? (delta + 500000L) / 1000000L : (delta - 500000L) / 1000000L; // Rounded half away from zero
+	gain = (int32_t)channel->nominal_gain + delta;
+	if (gain > 0xFFFF) {gain = 0xFFFF;}
+	if (gain < 0) {gain = 0;}
+	channel->gain = (uint16_t)gain;
+	channel->offset = offset;
+}
+
+
+// Raw reading to units, rounded half up
+int32_t measure_Convert(const struct a_measure_channel *channel, uint16_t raw)
+{
+	int16_t counts = (int16_t)raw - channel->offset;
+	int32_t scaled = (int32_t)counts * channel->gain; // 16x16->32
+	const uint32_t bias = (uint32_t)1 << 31;
+	uint32_t biased;
+	if (channel->shift) {scaled += (int32_t)1 << (channel->shift - 1);}
+	// Shift as unsigned after biasing so negative values round the same way without relying on >> of a negative
+	biased = (uint32_t)scaled + bias;
+	return (int32_t)(biased >> channel->shift) - (int32_t)(bias >> channel->shift);
+}
+
+
+// Power in uW (mV * mA)
+int32_t measure_Power(int32_t millivolts, int32_t milliamps)
+{
+	return millivolts * milliamps;
+}
+
+#endif
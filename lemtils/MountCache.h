@@ -0,0 +1,95 @@
+#ifndef _LEM_MOUNTCACHE_H
+#define _LEM_MOUNTCACHE_H 1
+
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * MountCache.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Keeps one record (what SD.beginWarm() needs: card CID, type, SCK rate, volume geometry) in EEPROM with a CRC,
+ *  so a remount after sleep or a reset can skip the card init and the MBR/BPB reads.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/MountCache.h" // Card mount record in EEPROM. REQUIRES: nothing
+ *  - if (mountcache_Load(&record, sizeof(record))) { try the warm mount with it }
+ *  - After a full mount: mountcache_Save(&record, sizeof(record));
+ *  - The volume changed under it (formatted): mountcache_Forget(sizeof(record));
+ *
+ * Definitions:
+ *  MOUNTCACHE_EEPROM_START (E2END + 1 - 64) // First EEPROM address used
+ *  MOUNTCACHE_SIZE 48      // EEPROM bytes, the record and its CRC (2) must fit
+ *
+ * Functions:
+ *  bool mountcache_Load(void *record, uint8_t size); // Reads the record, false if there isn't a good one of that size
+ *  void mountcache_Save(const void *record, uint8_t size); // Writes it (only the bytes that changed)
+ *  void mountcache_Forget(uint8_t size); // Spoils the CRC, loads of that size fail until the next save
+ *
+ * Notes:
+ *  - The default place is the 48 bytes below CardRate.h's 16 at the top of the EEPROM.
+ *  - The CRC covers the size too, so a record from a build with another layout doesn't load.
+ *  - Plain avr-libc EEPROM access: not while the journal is writing (journal_IsBusy()).
+ */
+
+#ifndef MOUNTCACHE_EEPROM_START
+#define MOUNTCACHE_EEPROM_START (E2END + 1 - 64)
+#endif
+#ifndef MOUNTCACHE_SIZE
+#define MOUNTCACHE_SIZE 48
+#endif
+
+bool mountcache_Load(void *record, uint8_t size);
+void mountcache_Save(const void *record, uint8_t size);
+void mountcache_Forget(uint8_t size);
+
+
+// CRC-16/CCITT of the size and the record
+uint16_t _mountcache_Crc(const void *record, uint8_t size)
+{
+	const uint8_t *p = (const uint8_t *)record;
+	uint16_t crc = _crc_ccitt_update(0xFFFF, size);
+	while (size--) {crc = _crc_ccitt_update(crc, *p++);}
+	return crc;
+}
+
+
+// Reads the record, false if there isn't a good one of that size
+bool mountcache_Load(void *record, uint8_t size)
+{
+	uint16_t crc;
+
+	if (size + 2 > MOUNTCACHE_SIZE) {return false;}
+	eeprom_read_block(record, (const void *)MOUNTCACHE_EEPROM_START, size);
+	crc = eeprom_read_word((const uint16_t *)(MOUNTCACHE_EEPROM_START + size));
+	return crc == _mountcache_Crc(record, size);
+}
+
+
+// Writes it (only the bytes that changed)
+void mountcache_Save(const void *record, uint8_t size)
+{
+	if (size + 2 > MOUNTCACHE_SIZE) {return;}
+	eeprom_update_block(record, (void *)MOUNTCACHE_EEPROM_START, size);
+	eeprom_update_word((uint16_t *)(MOUNTCACHE_EEPROM_START + size), _mountcache_Crc(record, size));
+}
+
+
+// Spoils the CRC: stores the complement of the one the record needs, so it stays
+// spoiled however often it's called (a repeat writes nothing).
+void mountcache_Forget(uint8_t size)
+{
+	uint8_t record[MOUNTCACHE_SIZE - 2];
+
+	if (size + 2 > MOUNTCACHE_SIZE) {return;}
+	eeprom_read_block(record, (const void *)MOUNTCACHE_EEPROM_START, size);
+	eeprom_update_word((uint16_t *)(MOUNTCACHE_EEPROM_START + size), ~_mountcache_Crc(record, size));
+}
+
+#endif
@@ -0,0 +1,185 @@
+#ifndef _LEM_OFFLOAD_H
+#define _LEM_OFFLOAD_H 1
+
+#include <util/crc16.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Offload.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Framing for pulling files off the logger over a serial line. Every frame carries a type, a sequence number,
+ *  a file offset, a length and a CRC, so the host can tell a lost or damaged chunk and ask again from the last
+ *  good offset instead of starting over. The same frame goes both ways: small requests from the host, data
+ *  (up to a whole 512 byte block per frame) from the logger.
+ *  Only bytes are built and parsed here, the caller moves them (UART, and the card for the payload).
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/Offload.h" // Serial offload framing. REQUIRES: offload_Initialize(); for each parser
+ *  - struct an_offload_parser host; offload_Initialize(&host);
+ *  - Every byte received: if (offload_Receive(&host, byte)) { act on host.frame }
+ *  - Sending: crc = offload_Header(header, OFFLOAD_DATA, sequence, offset, length); crc = offload_Crc(crc, data, length);
+ *    then send header, data, crc (low byte first)
+ *
+ * Definitions:
+ *  OFFLOAD_REQUEST_SIZE 16 // Payload bytes kept from a received frame, longer ones are dropped
+ *  OFFLOAD_HEADER_SIZE 11  // Sync (2), type, sequence (2), offset (4), length (2)
+ *  OFFLOAD_HELLO 'H' ... // Frame types, see below
+ *
+ * Functions:
+ *  void offload_Initialize(struct an_offload_parser *parser); // Waiting for a sync
+ *  bool offload_Receive(struct an_offload_parser *parser, uint8_t byte); // True when a whole frame with a good CRC is in parser->frame
+ *  uint16_t offload_Header(uint8_t *header, uint8_t type, uint16_t sequence, uint32_t offset, uint16_t length); // Fills OFFLOAD_HEADER_SIZE bytes, returns the CRC so far
+ *  uint16_t offload_Crc(uint16_t crc, const uint8_t *data, uint16_t length); // Carries the CRC on over data
+ *
+ * Notes:
+ *  - Frame: 0xA5 0x5A, type, sequence, offset, length, payload, CRC-16 CCITT (0xFFFF start) of everything after the
+ *    sync up to the end of the payload. Little endian.
+ *  - Host -> logger: HELLO (enter offload mode), LIST, READ (payload: file name, offset: where to start), QUIT,
+ *    STATS (card timing as DATA frames then END, offset 1: and clear it, what the payloads hold is up to the caller),
+ *    RANGE (offset: from time, payload: to time, uint32_t: the records of a time indexed log with from <= time <= to).
+ *    Logger -> host: HELLO (payload: version), ENTRY (payload: name, offset: size), DATA (offset: of the payload in
+ *    the file, sequence from 0 per READ; for RANGE whole records, offset: time of the first), END (offset: file size;
+ *    for RANGE records sent), ERROR (payload: what failed).
+ *  - Resume: the host sends READ again from the last good offset (RANGE from the last good time + 1). Anything it
+ *    sends stops a stream in progress.
+ *  - The CRC costs ~0.5ms per 512 bytes on a 16MHz AVR, about a tenth of sending them at 1Mbaud.
+ */
+
+#ifndef OFFLOAD_REQUEST_SIZE
+#define OFFLOAD_REQUEST_SIZE 16
+#endif
+
+#define OFFLOAD_SYNC_0 0xA5
+#define OFFLOAD_SYNC_1 0x5A
+#define OFFLOAD_HEADER_SIZE 11
+#define OFFLOAD_MAX_PAYLOAD 512
+
+#define OFFLOAD_HELLO 'H'
+#define OFFLOAD_LIST  'L'
+#define OFFLOAD_ENTRY 'N'
+#define OFFLOAD_READ  'R'
+#define OFFLOAD_DATA  'D'
+#define OFFLOAD_END   'E'
+#define OFFLOAD_ERROR 'X'
+#define OFFLOAD_QUIT  'Q'
+#define OFFLOAD_STATS 'S'
+#define OFFLOAD_RANGE 'T'
+
+struct an_offload_frame {
+	uint8_t type;
+	uint16_t sequence;
+	uint32_t offset;
+	uint16_t length;
+	uint8_t payload[OFFLOAD_REQUEST_SIZE + 1]; // Zero terminated, for names
+};
+
+struct an_offload_parser {
+	struct an_offload_frame frame;
+	uint8_t header[OFFLOAD_HEADER_SIZE];
+	uint16_t count;          // Bytes of the frame so far
+	uint16_t crc;            // Over what's been received
+	uint16_t received_crc;
+};
+
+void offload_Initialize(struct an_offload_parser *parser);
+bool offload_Receive(struct an_offload_parser *parser, uint8_t byte);
+uint16_t offload_Header(uint8_t *header, uint8_t type, uint16_t sequence, uint32_t offset, uint16_t length);
+uint16_t offload_Crc(uint16_t crc, const uint8_t *data, uint16_t length);
+
+
+// Waiting for a sync
+void offload_Initialize(struct an_offload_parser *parser)
+{
+	parser->count = 0;
+}
+
+
+// Takes the header apart once it's all in
+void _offload_Decode(struct an_offload_parser *parser)
+{
+	const uint8_t *h = parser->header;
+	parser->frame.type = h[2];
+	parser->frame.sequence = h[3] | ((uint16_t)h[4] << 8);
+	parser->frame.offset = h[5] | ((uint32_t)h[6] << 8) | ((uint32_t)h[7] << 16) | ((uint32_t)h[8] << 24);
+	parser->frame.length = h[9] | ((uint16_t)h[10] << 8);
+}
+
+
+// True when a whole frame with a good CRC is in parser->frame. Anything else just resynchronizes.
+bool offload_Receive(struct an_offload_parser *parser, uint8_t byte)
+{
+	uint16_t end;
+
+	if (parser->count == 0) {
+		if (byte == OFFLOAD_SYNC_0) {parser->count = 1;}
+		return false;
+	}
+	if (parser->count == 1) {
+		if (byte == OFFLOAD_SYNC_1) {
+			parser->count = 2;
+			parser->crc = 0xFFFF;
+		} else if (byte != OFFLOAD_SYNC_0) {
+			parser->count = 0;
+		}
+		return false;
+	}
+	if (parser->count < OFFLOAD_HEADER_SIZE) {
+		parser->header[parser->count++] = byte;
+		parser->crc = _crc_ccitt_update(parser->crc, byte);
+		if (parser->count == OFFLOAD_HEADER_SIZE) {
+			_offload_Decode(parser);
+			if (parser->frame.length > OFFLOAD_REQUEST_SIZE) {parser->count = 0;} // Not a request, wait for the next sync
+		}
+		return false;
+	}
+	end = OFFLOAD_HEADER_SIZE + parser->frame.length;
+	if (parser->count < end) {
+		parser->frame.payload[parser->count - OFFLOAD_HEADER_SIZE] = byte;
+		parser->crc = _crc_ccitt_update(parser->crc, byte);
+		parser->count++;
+		return false;
+	}
+	if (parser->count == end) {
+		parser->received_crc = byte;
+		parser->count++;
+		return false;
+	}
+	parser->received_crc |= (uint16_t)byte << 8;
+	parser->count = 0;
+	parser->frame.payload[parser->frame.length] = 0;
+	return parser->received_crc == parser->crc;
+}
+
+
+// Fills OFFLOAD_HEADER_SIZE bytes, returns the CRC so far (carry it on over the payload with offload_Crc())
+uint16_t offload_Header(uint8_t *header, uint8_t type, uint16_t sequence, uint32_t offset, uint16_t length)
+{
+	header[0] = OFFLOAD_SYNC_0;
+	header[1] = OFFLOAD_SYNC_1;
+	header[2] = type;
+	header[3] = sequence;
+	header[4] = sequence >> 8;
+	header[5] = offset;
+	header[6] = offset >> 8;
+	header[7] = offset >> 16;
+	header[8] = offset >> 24;
+	header[9] = length;
+	header[10] = length >> 8;
+	return offload_Crc(0xFFFF, header + 2, OFFLOAD_HEADER_SIZE - 2);
+}
+
+
+// Carries the CRC on over data
+uint16_t offload_Crc(uint16_t crc, const uint8_t *data, uint16_t length)
+{
+	while (length--) {crc = _crc_ccitt_update(crc, *data++);}
+	return crc;
+}
+
+#endif
@@ -0,0 +1,166 @@
+#ifndef _LEM_POWERFAIL_H
+#define _LEM_POWERFAIL_H 1
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * PowerFail.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Early warning of a supply outage from the analog comparator, so there's time (on the supercap) to stop,
+ *  get the card into a consistent state and leave a marker before the brown-out reset.
+ *  The internal 1.1V bandgap is the + input, the supply rail through a divider is the - input (AIN1, PD7).
+ *  When the divided rail drops under 1.1V the comparator output goes high and the ISR fires once.
+ *  Or, with POWERFAIL_INT0, a supply supervisor's power-fail output on INT0, which (unlike the comparator) also wakes
+ *  the CPU from power down.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/PowerFail.h" // Supply outage warning. REQUIRES: powerfail_Initialize(); powerfail_Interrupt(); in ISR(ANALOG_COMP_vect)
+ *  - powerfail_Initialize();
+ *  - ISR(ANALOG_COMP_vect) { powerfail_Interrupt(micros()); stop acquisition; } (ISR(INT0_vect) with POWERFAIL_INT0)
+ *  - Main loop: if (powerfail_IsPending()) { finish the write in progress, flush, write a marker, powerfail_Elapsed(micros()) }
+ *  - After a power down: if (slept && powerfail_IsPending() && !powerfail_WakesFromPowerDown()) powerfail_Backdate(slept * 1000UL);
+ *
+ * Pins Used:
+ *  PD7 (AIN1) - Divided supply rail, digital input buffer turned off
+ *  PD2 (INT0) - With POWERFAIL_INT0 instead: supervisor power-fail output, active low, pulled up
+ *
+ * Definitions:
+ *  POWERFAIL_INT0 // Define if the warning is a supervisor's power-fail output on INT0 rather than the divider on AIN1
+ *
+ * Functions:
+ *  void powerfail_Initialize(); // Comparator on, bandgap vs AIN1, interrupt on the supply dropping
+ *  void powerfail_Interrupt(uint32_t now); // Call from ISR(ANALOG_COMP_vect) (or INT0_vect) with a us (or ms) clock, fires once
+ *  bool powerfail_IsPending(); // The supply dropped, shut down
+ *  bool powerfail_SupplyIsLow(); // Right now (comparator output), e.g. to tell a glitch from an outage after shutting down
+ *  uint32_t powerfail_Elapsed(uint32_t now); // Since the comparator fired, same clock as powerfail_Interrupt()
+ *  void powerfail_Backdate(uint32_t by); // The trip may have come up to "by" before the interrupt ran (the CPU was powered down)
+ *  bool powerfail_WakesFromPowerDown(); // True with POWERFAIL_INT0: a trip while powered down is seen straight away
+ *
+ * Notes:
+ *  - Pick the divider so the rail crosses 1.1V with enough hold-up left for the worst case shutdown, e.g. at ~4.4V: 30k over 10k.
+ *  - The comparator doesn't wake the CPU from power down, the flag is seen at the next wake, and the us clock stood still
+ *    meanwhile. Keep power downs short while there is something to shut down (the budget has to cover the lag too), and
+ *    powerfail_Backdate() the trip by the time slept so powerfail_Elapsed() is the worst case, not the time since the ISR.
+ *  - INT0 is level triggered (the only sense that wakes from power down), so its interrupt is turned off when it fires.
+ *  - Changing the comparator's inputs or edge can set its flag, so it's cleared before the interrupt is enabled.
+ */
+
+volatile bool _powerfail_pending = false;
+volatile uint32_t _powerfail_at = 0;
+
+void powerfail_Initialize(void);
+void powerfail_Interrupt(uint32_t now);
+bool powerfail_IsPending(void);
+bool powerfail_SupplyIsLow(void);
+uint32_t powerfail_Elapsed(uint32_t now);
+
+
+void powerfail_Backdate(uint32_t by);
+bool powerfail_WakesFromPowerDown(void);
+
+
+#ifdef POWERFAIL_INT0
+
+// Supervisor output on INT0, interrupt while it's low (the supply is failing)
+void powerfail_Initialize(void)
+{
+	DDRD &= ~_BV(PD2);
+	PORTD |= _BV(PD2); // Pull up, supervisor outputs are usually open drain
+	EICRA &= ~(_BV(ISC01) | _BV(ISC00)); // Low level: the only INT0 sense that wakes from power down
+	EIFR = _BV(INTF0);
+	_powerfail_pending = false;
+	EIMSK |= _BV(INT0);
+}
+
+
+// Call from ISR(INT0_vect) with a us (or ms) clock. Fires once, INT0 is turned off (a level would keep firing).
+void powerfail_Interrupt(uint32_t now)
+{
+	EIMSK &= ~_BV(INT0);
+	if (_powerfail_pending) {return;}
+	_powerfail_at = now;
+	_powerfail_pending = true;
+}
+
+
+// Right now (supervisor output low)
+bool powerfail_SupplyIsLow(void)
+{
+	return (PIND & _BV(PD2)) == 0;
+}
+
+#else
+
+// Comparator on, bandgap (+) vs AIN1 (-), interrupt on the rising output (the divided supply fell under 1.1V)
+void powerfail_Initialize(void)
+{
+	DDRD &= ~_BV(PD7);
+	PORTD &= ~_BV(PD7); // No pull up, it would hold the rail divider up
+	DIDR1 |= _BV(AIN1D); // Analog only, saves power and noise
+	ADCSRB &= ~_BV(ACME); // - input is AIN1, not the ADC mux (the ADC sampler needs the mux)
+	ACSR = _BV(ACBG) | _BV(ACIS1) | _BV(ACIS0); // Bandgap +, interrupt on rising edge, interrupt still off
+	ACSR |= _BV(ACI); // Clear anything the mode change flagged
+	_powerfail_pending = false;
+	ACSR |= _BV(ACIE);
+}
+
+
+// Call from ISR(ANALOG_COMP_vect) with a us (or ms) clock. Fires once, the comparator interrupt is turned off.
+void powerfail_Interrupt(uint32_t now)
+{
+	ACSR &= ~_BV(ACIE);
+	if (_powerfail_pending) {return;}
+	_powerfail_at = now;
+	_powerfail_pending = true;
+}
+
+
+// Right now (comparator output high: the divided rail is under the bandgap)
+bool powerfail_SupplyIsLow(void)
+{
+	return (ACSR & _BV(ACO)) != 0;
+}
+
+#endif
+
+
+// The supply dropped, shut down
+bool powerfail_IsPending(void)
+{
+	return _powerfail_pending;
+}
+
+
+// Since the comparator fired, same clock as powerfail_Interrupt()
+uint32_t powerfail_Elapsed(uint32_t now)
+{
+	return now - _powerfail_at;
+}
+
+
+// The trip may have come up to "by" before the interrupt ran (the CPU was powered down), count from then
+void powerfail_Backdate(uint32_t by)
+{
+	_powerfail_at -= by;
+}
+
+
+// True with POWERFAIL_INT0: a trip while powered down wakes the CPU, so it's seen straight away
+bool powerfail_WakesFromPowerDown(void)
+{
+#ifdef POWERFAIL_INT0
+	return true;
+#else
+	return false;
+#endif
+}
+
+#endif
@@ -0,0 +1,229 @@
+#ifndef _LEM_SLEEP_H
+#define _LEM_SLEEP_H 1
+
+#include <avr/io.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <avr/interrupt.h>
+#include <stdbool.h>
+
+#ifndef F_CPU
+#  error "Define F_CPU before including lemtils/Sleep.h"
+#endif
+
+/*
+ * Sleep.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Tickless idle for the ATmega328P. Instead of busy waiting between events, sleep until the next deadline.
+ *  - Short waits idle with the 1ms timer running (each tick wakes us, so nothing is missed).
+ *  - Long waits power down on the watchdog (deepest mode, ~0.1 mA vs ~15 mA awake), then credit the slept time.
+ *  - Any enabled interrupt (e.g. a button pin change) wakes the MCU early.
+ *
+ * To Use:
+ *  - Paste: #include "lemtils/Sleep.h" // Tickless idle. REQUIRES: sleep_Tick(); in the 1ms ISR, sleep_WatchdogInterrupt(); in ISR(WDT_vect)
+ *  - Call sleep_Tick(); first thing in your 1ms timer ISR
+ *  - Call sleep_WatchdogInterrupt(); from your ISR(WDT_vect)
+ *  - Call sleep_WakeUp(); from any ISR that schedules new work (so we don't go back to sleep on it)
+ *  - In the main loop, replace the delay with something like:
+ *      events_Advance(sleep_UntilDeadline(events_NextDeadline())); // Sleep, then credit the events for the time powered down
+ *  - Optionally sleep_CalibrateWatchdog(); once at start up (uses Timer1) for better accuracy on long sleeps.
+ *
+ * Definitions:
+ *  SLEEP_POWER_DOWN_MIN_MS  30    // Waits shorter than this only idle (power down costs a watchdog period, min 16ms)
+ *  SLEEP_POWER_DOWN_MAX_MS  1000  // Longest single power down. Keeps the system watchdog (which we borrow) from being off for long.
+ *
+ * Functions:
+ *  unsigned short sleep_UntilDeadline(unsigned short ms); // Sleeps until ms from now at most. Returns ms powered down to be credited to events.
+ *  void sleep_Tick(); // Counts time (and idle time), call every 1ms from the timer ISR
+ *  void sleep_WatchdogInterrupt(); // Call from ISR(WDT_vect)
+ *  void sleep_WakeUp(); // From an ISR: the next sleep_UntilDeadline() returns immediately
+ *  void sleep_CalibrateWatchdog(); // Measures the watchdog oscillator with Timer1 (the watchdog is ~10% off nominal)
+ *  unsigned short sleep_IdlePermille(); // Fraction of time spent asleep, in 1/1000ths
+ *
+ * Notes:
+ *  - The 1ms timer does not run while powered down, so events must be credited with what sleep_UntilDeadline() returns.
+ *  - If woken early from power down (a button press), the watchdog's count can't be read: half the period is credited,
+ *    so the clock is off by at most half a period (~0.5s) either way for that wake.
+ *  - The watchdog settings (reset mode and all) are saved before power down and put back as soon as it wakes, early or
+ *    not, so the main loop's wdt_reset() and the reset protection work again straight away.
+ *  - Short waits idle on the 1ms tick rather than reprogramming Timer2 to the deadline: the tick also runs the event
+ *    clock and the ADC/UART interrupts wake the CPU anyway, so a longer Timer2 period would save little.
+ *  - Serial output in flight is lost in power down (UART clock stops). Flush it first if it matters.
+ */
+
+#ifndef SLEEP_POWER_DOWN_MIN_MS
+#define SLEEP_POWER_DOWN_MIN_MS 30
+#endif
+#ifndef SLEEP_POWER_DOWN_MAX_MS
+#define SLEEP_POWER_DOWN_MAX_MS 1000
+#endif
+
+volatile uint32_t sleep_TotalMs = 0;      // ms counted by sleep_Tick() plus ms credited from power down
+volatile uint32_t sleep_AsleepMs = 0;     // Of those, how many were spent asleep
+volatile bool _sleep_is_idle = false;     // True while the CPU is idling, so the tick knows it woke us
+volatile bool _sleep_wake_requested = false;
+volatile bool _sleep_watchdog_fired = false;
+uint8_t _sleep_saved_wdtcsr = 0;
+uint16_t _sleep_watchdog_scale = 256;      // Actual/nominal watchdog period, 8.8 fixed point (256 = exact)
+
+void sleep_Tick(void);
+void sleep_WatchdogInterrupt(void);
+void sleep_WakeUp(void);
+void sleep_CalibrateWatchdog(void);
+unsigned short sleep_UntilDeadline(unsigned short ms);
+unsigned short sleep_IdlePermille(void);
+
+
+// Counts time (and idle time), call every 1ms from the timer ISR
+void sleep_Tick(void)
+{
+	sleep_TotalMs++;
+	if (_sleep_is_idle) {sleep_AsleepMs++;}
+}
+
+
+// Call from ISR(WDT_vect)
+void sleep_WatchdogInterrupt(void)
+{
+	_sleep_watchdog_fired = true;
+}
+
+
+// From an ISR: the next sleep_UntilDeadline() returns immediately
+void sleep_WakeUp(void)
+{
+	_sleep_wake_requested = true;
+}
+
+
+// Sets the watchdog to interrupt only (no reset) with prescaler wdp (0-9 => 16ms * 2^wdp)
+void _sleep_WatchdogInterruptMode(uint8_t wdp)
+{
+	uint8_t wdpbits = (wdp & 0x07) | ((wdp & 0x08) ? _BV(WDP3) : 0);
+	wdt_reset();
+	MCUSR &= ~_BV(WDRF); // WDE can't be cleared while WDRF is set
+	WDTCSR |= _BV(WDCE) | _BV(WDE); // Timed sequence, next write within 4 cycles
+	WDTCSR = _BV(WDIE) | wdpbits;
+}
+
+
+// Puts the watchdog back the way we found it
+void _sleep_WatchdogRestore(void)
+{
+	wdt_reset();
+	WDTCSR |= _BV(WDCE) | _BV(WDE);
+	WDTCSR = _sleep_saved_wdtcsr & ~_BV(WDIF);
+}
+
+
+// Returns the calibrated ms of watchdog prescaler wdp
+unsigned short _sleep_WatchdogPeriod(uint8_t wdp)
+{
+	return (unsigned short)(((uint32_t)(16UL << wdp) * _sleep_watchdog_scale) >> 8);
+}
+
+
+// Sleeps until ms from now at most. Returns ms powered down, which the 1ms tick did not see and events must be credited.
+unsigned short sleep_UntilDeadline(unsigned short ms)
+{
+	uint8_t wdp;
+	unsigned short period;
+
+	if (ms == 0) {return 0;}
+
+	if (ms < SLEEP_POWER_DOWN_MIN_MS) {
+		// Idle: the 1ms tick (and everything else) keeps running and wakes us up
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		cli();
+		if (_sleep_wake_requested) {_sleep_wake_requested = false; sei(); return 0;}
+		_sleep_is_idle = true;
+		sleep_enable();
+		sei(); // The instruction after sei() always runs, so a pending interrupt can't be missed before sleeping
+		sleep_cpu();
+		sleep_disable();
+		_sleep_is_idle = false;
+		return 0;
+	}
+
+	// Power down: largest watchdog period that fits the wait
+	if (ms > SLEEP_POWER_DOWN_MAX_MS) {ms = SLEEP_POWER_DOWN_MAX_MS;}
+	for (wdp = 9; wdp > 0; wdp--) {
+		if (_sleep_WatchdogPeriod(wdp) <= ms) {break;}
+	}
+	period = _sleep_WatchdogPeriod(wdp);
+
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	cli();
+	if (_sleep_wake_requested) {_sleep_wake_requested = false; sei(); return 0;}
+	_sleep_saved_wdtcsr = WDTCSR;
+	_sleep_watchdog_fired = false;
+	_sleep_WatchdogInterruptMode(wdp);
+	sleep_enable();
+	sleep_bod_disable(); // Brown-out detector off while asleep, must be right before sleep_cpu()
+	sei();
+	sleep_cpu();
+	sleep_disable();
+
+	// Woken early by something else: how far the watchdog got can't be read, credit half the period
+	cli();
+	if (!_sleep_watchdog_fired) {period /= 2;}
+	_sleep_WatchdogRestore();
+	sleep_TotalMs += period;
+	sleep_AsleepMs += period;
+	sei();
+	return period;
+}
+
+
+// Measures the watchdog oscillator with Timer1 (the watchdog is ~10% off nominal). Takes about half a second.
+void sleep_CalibrateWatchdog(void)
+{
+	uint8_t tccr1a = TCCR1A, tccr1b = TCCR1B, timsk1 = TIMSK1;
+	uint16_t ticks;
+
+	cli();
+	_sleep_saved_wdtcsr = WDTCSR;
+	_sleep_WatchdogInterruptMode(4); // 256ms nominal
+	sei();
+
+	TIMSK1 = 0;
+	TCCR1A = 0;
+	TCCR1B = _BV(CS12) | _BV(CS10); // Prescaler 1024, 64us per tick at 16MHz (range 4.19s)
+
+	_sleep_watchdog_fired = false;
+	while (!_sleep_watchdog_fired) ; // Line up with a watchdog period
+	TCNT1 = 0;
+	_sleep_watchdog_fired = false;
+	while (!_sleep_watchdog_fired) ;
+	ticks = TCNT1;
+
+	cli();
+	_sleep_WatchdogRestore();
+	sei();
+	TCCR1B = tccr1b; TCCR1A = tccr1a; TIMSK1 = timsk1;
+
+	// scale = actual/nominal * 256 = (ticks * 1024/F_CPU) / 0.256s * 256 = ticks * 1024000 / F_CPU
+	_sleep_watchdog_scale = (uint16_t)(((uint32_t)ticks * 64000UL) / (F_CPU / 16UL));
+	if (_sleep_watchdog_scale == 0) {_sleep_watchdog_scale = 256;}
+}
+
+
+// Fraction of time spent asleep, in 1/1000ths
+unsigned short sleep_IdlePermille(void)
+{
+	uint32_t total, asleep;
+	cli();
+	total = sleep_TotalMs;
+	asleep = sleep_AsleepMs;
+	sei();
+	while (total > 4000000UL) {total >>= 1; asleep >>= 1;} // Keep asleep*1000 in 32 bits
+	if (total == 0) {return 0;}
+	return (unsigned short)((asleep * 1000UL) / total);
+}
+
+#endif
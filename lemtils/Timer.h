@@ -274,8 +274,8 @@ int timer2_ctc(double period, bool enable_compare_A) {
 		cycles/=prescales[prescaler-1];
 		prescaler++;
 	}
-	// Set cycle limit
-	OCR2A = cycles;
+	// Set cycle limit (CTC period is OCR2A+1 counts, so 1ms was really 1.004ms and drifted ~6 min a day)
+	OCR2A = cycles ? cycles - 1 : 0;
 	// Set prescaler
 	TCCR2B = prescaler;
 	// reset the counter
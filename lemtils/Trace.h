@@ -0,0 +1,263 @@
+#ifndef _LEM_TRACE_H
+#define _LEM_TRACE_H 1
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Trace.h
+ *
+ * Created: 10/19/2026
+ *  Author: Patrick McCarthy
+ *  Part of Patrick's "lemtils" utility package
+ *
+ * Purpose:
+ *  Diagnostic log that doesn't block. A trace is a message ID (strings live in flash) and a value,
+ *  pushed into a small RAM ring buffer in a few cycles. The buffer is drained a byte at a time,
+ *  only as fast as the UART can take it, as text ("12 - State 'none' -> 'recording'.") or as binary frames
+ *  for the host to expand with the same message table.
+ *
+ * To Use:
+ *  - List the messages before including, X-macro style:
+ *      #define TRACE_MESSAGES(X) \
+ *        X(trace_Hello, "Hello") \
+ *        X(trace_Held, "Held ms =")
+ *  - Paste: #include "lemtils/Trace.h" // Buffered diagnostics. REQUIRES: TRACE_MESSAGES defined before, trace_NextByte() drained to the UART
+ *  - TRACE_INFO(trace_Hello); TRACE_INFO_VALUE(trace_Held, ms); (also _ERROR and _DEBUG)
+ *  - In the main loop: while (Serial.availableForWrite() > 0 && (c = trace_NextByte()) >= 0) Serial.write(c);
+ *
+ * Definitions:
+ *  TRACE_LEVEL 2         // 0 off, 1 errors, 2 info, 3 debug. Traces above the level compile to nothing.
+ *  TRACE_BUFFER_SIZE 16  // Entries (5 bytes each), power of 2
+ *  TRACE_BINARY          // Define to send frames instead of text: 0xA5, id (bit 7 set if it has a value), value (4 bytes, LSB first). tools/s4_offload.py --trace expands them.
+ *
+ * Functions:
+ *  void trace_Push(uint8_t id, uint32_t value, bool has_value); // Queues a trace, safe from ISRs. Use the TRACE_ macros instead.
+ *  int trace_NextByte(); // Next byte to send, -1 if there's nothing to send
+ *  bool trace_IsPending(); // Something queued or half sent
+ *
+ * Notes:
+ *  - When the buffer is full new traces are dropped and counted. A "Trace entries dropped" line follows once the buffer empties.
+ *  - The text line number counts lines sent (dropped lines are not numbered).
+ *  - ID 0 is trace_Dropped, the first listed message is ID 1 (for the host table).
+ */
+
+#ifndef TRACE_MESSAGES
+#  error "Define TRACE_MESSAGES(X) before including lemtils/Trace.h"
+#endif
+
+#define TRACE_LEVEL_OFF   0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_LEVEL_INFO
+#endif
+#ifndef TRACE_BUFFER_SIZE
+#define TRACE_BUFFER_SIZE 16
+#endif
+
+#if (TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1))
+#  error "TRACE_BUFFER_SIZE must be a power of 2"
+#endif
+
+#define TRACE_FRAME_START 0xA5
+#define TRACE_HAS_VALUE   0x80
+
+// Message IDs and their text in flash
+#define _TRACE_ENUM(id, text) id,
+#define _TRACE_TEXT(id, text) const char _trace_text_##id[] PROGMEM = text;
+#define _TRACE_TABLE(id, text) _trace_text_##id,
+
+enum { trace_Dropped, TRACE_MESSAGES(_TRACE_ENUM) TRACE_MESSAGE_COUNT };
+const char _trace_text_trace_Dropped[] PROGMEM = "Trace entries dropped:";
+TRACE_MESSAGES(_TRACE_TEXT)
+const char * const _trace_text[TRACE_MESSAGE_COUNT] PROGMEM = { _trace_text_trace_Dropped, TRACE_MESSAGES(_TRACE_TABLE) };
+
+#if (TRACE_LEVEL >= TRACE_LEVEL_ERROR)
+#  define TRACE_ERROR(id)            trace_Push((id), 0, false)
+#  define TRACE_ERROR_VALUE(id, v)   trace_Push((id), (uint32_t)(v), true)
+#else
+#  define TRACE_ERROR(id)            do {} while (0)
+#  define TRACE_ERROR_VALUE(id, v)   do {} while (0)
+#endif
+#if (TRACE_LEVEL >= TRACE_LEVEL_INFO)
+#  define TRACE_INFO(id)             trace_Push((id), 0, false)
+#  define TRACE_INFO_VALUE(id, v)    trace_Push((id), (uint32_t)(v), true)
+#else
+#  define TRACE_INFO(id)             do {} while (0)
+#  define TRACE_INFO_VALUE(id, v)    do {} while (0)
+#endif
+#if (TRACE_LEVEL >= TRACE_LEVEL_DEBUG)
+#  define TRACE_DEBUG(id)            trace_Push((id), 0, false)
+#  define TRACE_DEBUG_VALUE(id, v)   trace_Push((id), (uint32_t)(v), true)
+#else
+#  define TRACE_DEBUG(id)            do {} while (0)
+#  define TRACE_DEBUG_VALUE(id, v)   do {} while (0)
+#endif
+
+struct a_trace_entry {
+	uint8_t id;      // Message ID, TRACE_HAS_VALUE set if value is printed
+	uint32_t value;
+};
+
+volatile struct a_trace_entry _trace_buffer[TRACE_BUFFER_SIZE];
+volatile uint8_t _trace_head = 0;
+volatile uint8_t _trace_tail = 0;
+volatile uint8_t _trace_dropped = 0;
+
+// Send side, only used from the main loop
+struct a_trace_entry _trace_current;
+uint8_t _trace_phase = 0;   // Where we are in the current line / frame, 0 = nothing loaded
+uint8_t _trace_pos = 0;
+PGM_P _trace_text_at;
+char _trace_digits[10];     // Reversed decimal digits of a number being sent
+uint32_t trace_Lines = 0;   // Text lines sent
+
+void trace_Push(uint8_t id, uint32_t value, bool has_value);
+int trace_NextByte(void);
+bool trace_IsPending(void);
+
+
+// Queues a trace, safe from ISRs. Use the TRACE_ macros instead.
+void trace_Push(uint8_t id, uint32_t value, bool has_value)
+{
+	uint8_t sreg = SREG;
+	uint8_t next;
+	cli();
+	next = (_trace_head + 1) & (TRACE_BUFFER_SIZE - 1);
+	if (next == _trace_tail) {
+		if (_trace_dropped < 0xFF) {_trace_dropped++;}
+	} else {
+		_trace_buffer[_trace_head].id = has_value ? (id | TRACE_HAS_VALUE) : id;
+		_trace_buffer[_trace_head].value = value;
+		_trace_head = next;
+	}
+	SREG = sreg;
+}
+
+
+// Something queued or half sent
+bool trace_IsPending(void)
+{
+	return (_trace_phase != 0) || (_trace_head != _trace_tail) || (_trace_dropped != 0);
+}
+
+
+// Loads the next entry to send, the dropped count once the buffer is empty. False if there's nothing.
+bool _trace_Load(void)
+{
+	bool loaded = true;
+	uint8_t sreg = SREG;
+	cli();
+	if (_trace_tail != _trace_head) {
+		_trace_current.id = _trace_buffer[_trace_tail].id;
+		_trace_current.value = _trace_buffer[_trace_tail].value;
+		_trace_tail = (_trace_tail + 1) & (TRACE_BUFFER_SIZE - 1);
+	} else if (_trace_dropped) {
+		_trace_current.id = trace_Dropped | TRACE_HAS_VALUE;
+		_trace_current.value = _trace_dropped;
+		_trace_dropped = 0;
+	} else {
+		loaded = false;
+	}
+	SREG = sreg;
+	return loaded;
+}
+
+
+// Puts value in _trace_digits (reversed), returns the number of digits
+uint8_t _trace_Digits(uint32_t value)
+{
+	uint8_t n = 0;
+	do {
+		_trace_digits[n++] = '0' + (value % 10);
+		value /= 10;
+	} while (value);
+	return n;
+}
+
+
+#ifdef TRACE_BINARY
+
+// Next byte to send, -1 if there's nothing to send
+int trace_NextByte(void)
+{
+	uint8_t b;
+	if (_trace_phase == 0) {
+		if (!_trace_Load()) {return -1;}
+		_trace_phase = 1;
+	}
+	switch (_trace_phase++) {
+		case 1: return TRACE_FRAME_START;
+		case 2: return _trace_current.id;
+		default:
+			b = (uint8_t)(_trace_current.value >> (8 * (_trace_phase - 4)));
+			if (_trace_phase == 7) {_trace_phase = 0;}
+			return b;
+	}
+}
+
+#else
+
+// Line phases: number, " - ", text, " " value, "\r\n"
+#define _TRACE_NUMBER 1
+#define _TRACE_DASH   2
+#define _TRACE_TEXT_PHASE 3
+#define _TRACE_VALUE  4
+#define _TRACE_CR     5
+#define _TRACE_LF     6
+
+// Next byte to send, -1 if there's nothing to send
+int trace_NextByte(void)
+{
+	char c;
+	for (;;) {
+		switch (_trace_phase) {
+			case 0:
+				if (!_trace_Load()) {return -1;}
+				trace_Lines++;
+				_trace_pos = _trace_Digits(trace_Lines);
+				_trace_phase = _TRACE_NUMBER;
+				break;
+			case _TRACE_NUMBER:
+				if (_trace_pos) {return _trace_digits[--_trace_pos];}
+				_trace_pos = 0;
+				_trace_phase = _TRACE_DASH;
+				break;
+			case _TRACE_DASH:
+				if (_trace_pos < 3) {return " - "[_trace_pos++];}
+				_trace_text_at = (PGM_P)pgm_read_ptr(&_trace_text[_trace_current.id & ~TRACE_HAS_VALUE]);
+				_trace_phase = _TRACE_TEXT_PHASE;
+				break;
+			case _TRACE_TEXT_PHASE:
+				c = pgm_read_byte(_trace_text_at);
+				if (c) {_trace_text_at++; return c;}
+				if (_trace_current.id & TRACE_HAS_VALUE) {
+					_trace_pos = _trace_Digits(_trace_current.value);
+					_trace_phase = _TRACE_VALUE;
+					return ' ';
+				}
+				_trace_phase = _TRACE_CR;
+				break;
+			case _TRACE_VALUE:
+				if (_trace_pos) {return _trace_digits[--_trace_pos];}
+				_trace_phase = _TRACE_CR;
+				break;
+			case _TRACE_CR:
+				_trace_phase = _TRACE_LF;
+				return '\r';
+			default:
+				_trace_phase = 0;
+				return '\n';
+		}
+	}
+}
+
+#endif
+
+#endif
@@ -0,0 +1,272 @@
+#!/usr/bin/env python3
+"""
+s4_allocsim.py - simulates the card's cluster allocation for the logger's files.
+
+Runs the same first fit search as SdVolume::allocContiguous(), and the
+allocation unit policy files opened with O_ALLOC_AU get (SdVolume::allocUnit()
+and allocAligned()), over a FAT of the given geometry while the logger's files
+grow side by side. Then reports, per file, how its clusters ended up against
+the card's allocation units (AUs): a file sharing an AU with another one makes
+the card copy that one's data out before it can erase the AU, the garbage
+collection that stalls a write for hundreds of ms.
+
+Each run is done twice, first fit for every file and then with the policy for
+the files marked au, on the same volume and the same writes.
+
+  python3 s4_allocsim.py                             # 8GB card, 32KB clusters, 4MB AU, 30 days of the default files
+  python3 s4_allocsim.py --days 90 --fragment 200    # start from a volume with 200 files written and half deleted
+  python3 s4_allocsim.py --raw-grow                  # RAW.LOG grows a cluster at a time instead of made in one piece
+  python3 s4_allocsim.py --file LOG.CSV:20000:au     # add a file (name:bytes per hour[:au])
+
+Only the allocation is modelled: no directory clusters, no truncation.
+"""
+
+import argparse
+import random
+
+BLOCK = 512
+
+# name, bytes per hour, O_ALLOC_AU; roughly the sketch at 1 second readings
+FILES = [
+    ("SUMMARY.BIN", 84 * 60, False),
+    ("MIN15.BIN", 68 * 4, False),
+    ("DAY.BIN", 68 / 24, False),
+    ("RAW.IDX", 4 * 3600 / 31, False),
+    ("BURST.BIN", 2048, False),
+]
+RAW = ("RAW.LOG", 512 * 3600 / 31, True)  # BlockLog: 31 records of 16 bytes per block
+RAW_BLOCKS = 65536  # RAW_LOG_BLOCKS, made in one piece by createContiguous()
+
+AU_LARGE_MB = [8, 12, 16, 24, 32, 64]  # AU_SIZE 0xA-0xF
+
+
+def au_blocks(code):
+    """AU in blocks for an SD Status AU_SIZE code, as Sd2Card::allocationUnit()."""
+    if 1 <= code <= 9:
+        return 32 << (code - 1)
+    if code >= 0xA:
+        return AU_LARGE_MB[code - 0xA] << 11
+    return 0
+
+
+class Volume:
+    """A FAT: entry 0 free, -1 end of chain, else the next cluster."""
+
+    def __init__(self, blocks, cluster_blocks, data_start, au):
+        self.cluster_shift = cluster_blocks.bit_length() - 1
+        self.cluster_blocks = cluster_blocks
+        self.data_start = data_start
+        self.cluster_count = (blocks - data_start) >> self.cluster_shift
+        self.fat = [0] * (self.cluster_count + 2)
+        self.fat[0] = self.fat[1] = -1
+        self.search_start = 2
+        # SdVolume::allocUnit()
+        au &= -au
+        self.au_shift = 0
+        self.au_first = 2
+        if au > cluster_blocks:
+            offset = (au - (data_start & (au - 1))) & (au - 1)
+            if offset & (cluster_blocks - 1) == 0:
+                self.au_first = 2 + (offset >> self.cluster_shift)
+                self.au_shift = (au // cluster_blocks).bit_length() - 1
+
+    def au_of(self, cluster):
+        """AU index of a cluster on the card (from block 0)."""
+        block = self.data_start + ((cluster - 2) << self.cluster_shift)
+        return block >> (self.cluster_shift + self.au_shift) if self.au_shift else None
+
+    def link(self, bgn, end, cur):
+        for c in range(bgn, end):
+            self.fat[c] = c + 1
+        self.fat[end] = -1
+        if cur:
+            self.fat[cur] = bgn
+        return bgn
+
+    def alloc_aligned(self, count, cur):
+        mask = (1 << self.au_shift) - 1
+        count = ((count - 1) | mask) + 1
+        fat_end = self.cluster_count + 1
+        start = self.au_first
+        if self.search_start > self.au_first:
+            start += ((self.search_start - self.au_first - 1) | mask) + 1
+        bgn = end = start
+        while True:
+            if bgn + count - 1 > fat_end:
+                if start == self.au_first:
+                    return None
+                bgn = end = start = self.au_first
+            if self.fat[end]:
+                bgn = self.au_first + ((end - self.au_first) | mask) + 1
+                end = bgn
+                continue
+            if end - bgn + 1 == count:
+                return self.link(bgn, end, cur)
+            end += 1
+
+    def alloc(self, count, cur, align):
+        """SdVolume::allocContiguous(): first cluster of the new run, None if there's no room."""
+        if align and self.au_shift:
+            nxt = cur + 1
+            if cur == 0 or (nxt >= self.au_first and (nxt - self.au_first) & ((1 << self.au_shift) - 1) == 0):
+                got = self.alloc_aligned(count, cur)
+                if got is not None:
+                    return got
+        if cur:
+            bgn, set_start = cur + 1, False
+        else:
+            bgn, set_start = self.search_start, count == 1
+        end = bgn
+        fat_end = self.cluster_count + 1
+        n = 0
+        while True:
+            if n >= self.cluster_count:
+                return None
+            if end > fat_end:
+                bgn = end = 2
+            if self.fat[end]:
+                bgn = end + 1
+            elif end - bgn + 1 == count:
+                break
+            n += 1
+            end += 1
+        self.link(bgn, end, cur)
+        if set_start:
+            self.search_start = bgn + 1
+        return bgn
+
+    def free(self, first):
+        self.search_start = 2
+        c = first
+        while c != -1:
+            nxt = self.fat[c]
+            self.fat[c] = 0
+            c = nxt
+
+
+class File:
+    def __init__(self, volume, name, rate, align):
+        self.volume, self.name, self.rate, self.align = volume, name, rate, align
+        self.chain = []  # clusters in file order
+        self.size = 0.0
+        self.full = False
+
+    def create(self, size):
+        """SdFile::createContiguous()."""
+        count = ((size - 1) >> (self.volume.cluster_shift + 9)) + 1
+        first = self.volume.alloc(count, 0, self.align)
+        if first is None:
+            return False
+        c = first
+        while c != -1:
+            self.chain.append(c)
+            c = self.volume.fat[c]
+        self.limit = size
+        return True
+
+    def grow(self, nbytes):
+        """SdFile::write(): a cluster added each time the data runs past the end of the chain."""
+        if self.full:
+            return
+        if hasattr(self, "limit"):
+            self.size = min(self.size + nbytes, self.limit)
+            return
+        cluster_bytes = self.volume.cluster_blocks * BLOCK
+        self.size += nbytes
+        while self.size > len(self.chain) * cluster_bytes:
+            cur = self.chain[-1] if self.chain else 0
+            got = self.volume.alloc(1, cur, self.align)
+            if got is None:
+                self.full = True
+                return
+            c = got
+            while c != -1:
+                self.chain.append(c)
+                c = self.volume.fat[c]
+
+
+def fragment(volume, files, seed):
+    """Writes files of random sizes first fit, then deletes every other one. Returns the ones left."""
+    rnd = random.Random(seed)
+    made = []
+    for i in range(files):
+        f = File(volume, "OLD%04d" % i, 0, False)
+        f.grow(rnd.choice([4, 40, 400, 4000]) * 1024 * rnd.random() + 1)
+        made.append(f)
+    for f in made[::2]:
+        if f.chain:
+            volume.free(f.chain[0])
+    return made[1::2]
+
+
+def report(volume, files, others):
+    owner = {}
+    for f in files + others:
+        for c in f.chain:
+            owner.setdefault(volume.au_of(c), set()).add(f.name)
+    print("  %-12s %10s %8s %8s %8s %8s %10s" % ("file", "bytes", "clusters", "extents", "AUs", "shared", "mid-AU"))
+    for f in files:
+        extents = sum(1 for i, c in enumerate(f.chain) if i == 0 or c != f.chain[i - 1] + 1)
+        aus = {volume.au_of(c) for c in f.chain}
+        shared = sum(1 for a in aus if len(owner[a]) > 1)
+        # extents that don't start on an AU boundary
+        mid = sum(1 for i, c in enumerate(f.chain) if (i == 0 or c != f.chain[i - 1] + 1) and
+                  (c - volume.au_first) & ((1 << volume.au_shift) - 1))
+        print("  %-12s %10d %8d %8d %8d %8d %10d%s" % (f.name, f.size, len(f.chain), extents, len(aus), shared, mid,
+                                                       "  (card full)" if f.full else ""))
+
+
+def run(args, policy):
+    blocks = args.card_mb << 11
+    au = au_blocks(args.au_code) if args.au_code is not None else args.au_kb * 2
+    volume = Volume(blocks, args.cluster_kb * 2, args.data_start, au)
+    others = fragment(volume, args.fragment, args.seed) if args.fragment else []
+
+    specs = list(FILES) + [(n, r, a) for n, r, a in args.file]
+    if not args.no_raw:
+        specs.insert(0, RAW)
+    files = [File(volume, name, rate, align and policy) for name, rate, align in specs]
+    if not args.no_raw and not args.raw_grow:
+        if not files[0].create(RAW_BLOCKS * BLOCK):
+            print("  no room for RAW.LOG")
+
+    # an hour at a time, each file's writes in the order the logger makes them
+    for hour in range(args.days * 24):
+        for f in files:
+            f.grow(f.rate)
+
+    print("%s: AU %d clusters (%s), first boundary at cluster %d" % (
+        "O_ALLOC_AU" if policy else "first fit", 1 << volume.au_shift if volume.au_shift else 0,
+        "on" if volume.au_shift else "off for this volume", volume.au_first))
+    report(volume, [f for f in files if f.chain], others)
+
+
+def file_spec(text):
+    parts = text.split(":")
+    if len(parts) not in (2, 3) or (len(parts) == 3 and parts[2] != "au"):
+        raise argparse.ArgumentTypeError("NAME:BYTES_PER_HOUR[:au]")
+    return parts[0], float(parts[1]), len(parts) == 3
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulate S4-Logger cluster allocation against the card's AUs")
+    parser.add_argument("--card-mb", type=int, default=7600, help="volume size")
+    parser.add_argument("--cluster-kb", type=int, default=32, help="cluster size (a power of two, 0.5 to 64)")
+    parser.add_argument("--data-start", type=int, default=16384, help="block of the first cluster on the card")
+    parser.add_argument("--au-kb", type=int, default=4096, help="card allocation unit")
+    parser.add_argument("--au-code", type=lambda s: int(s, 0), help="AU_SIZE from the SD Status instead of --au-kb")
+    parser.add_argument("--days", type=int, default=30, help="logging time")
+    parser.add_argument("--fragment", type=int, default=0, help="files written and half deleted before logging")
+    parser.add_argument("--seed", type=int, default=1, help="for --fragment")
+    parser.add_argument("--raw-grow", action="store_true", help="RAW.LOG grows as written instead of made in one piece")
+    parser.add_argument("--no-raw", action="store_true", help="leave RAW.LOG out")
+    parser.add_argument("--file", type=file_spec, action="append", default=[], help="NAME:BYTES_PER_HOUR[:au], repeatable")
+    args = parser.parse_args()
+
+    run(args, False)
+    print()
+    run(args, True)
+
+
+if __name__ == "__main__":
+    main()
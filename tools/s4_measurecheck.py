@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+"""
+s4_measurecheck.py - checks lemtils/Measure.h on the PC against exact arithmetic.
+
+Compiles Measure.h with the host C compiler into a small program that converts
+every reading of a 13-bit range through the sketch's channels (battery mV and
+load mA), at a few calibration offsets and gain trims, and compares each result
+bit for bit with the same formula done in exact rationals:
+
+  gain  = nominal + round_half_away(nominal * trim_ppm / 10^6), clamped to 16 bits
+  value = floor((raw - offset) * gain / 2^shift + 1/2)
+
+Also prints the largest error against the ideal (unquantized gain) value, so a
+gain constant that lost too much resolution shows up. Exits non-zero on any
+mismatch.
+
+  python3 s4_measurecheck.py               # uses cc
+  python3 s4_measurecheck.py --cc clang
+
+Only the integer paths are checked here: MEASURE_GAIN's double arithmetic is
+folded by the compiler on the AVR too, and its value is checked against the
+exact rounding.
+"""
+
+import argparse
+import os
+import subprocess
+import sys
+import tempfile
+from fractions import Fraction
+
+REPO = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir)
+
+VREF_MV = 5000  # VREF in the sketch
+LOAD_RESISTANCE = Fraction(10, 1000)  # LoadResistance [Ohms]
+ADC_BITS = 12  # 10 + ADC_OVERSAMPLE_BITS
+RAW_RANGE = 1 << 13  # a bit beyond the readings the sampler gives
+
+# name, full scale, shift: as MILLIVOLTS_GAIN and MILLIAMPS_GAIN
+CHANNELS = [
+    ("mV", Fraction(VREF_MV), 14),
+    ("mA", Fraction(VREF_MV) / LOAD_RESISTANCE, 8),
+]
+OFFSETS = [-5, 0, 3, 5]
+TRIMS = [-1200, 0, 350]
+
+HARNESS = r"""
+#include <stdio.h>
+#include "lemtils/Measure.h"
+int main(void)
+{
+	static const double full[] = {%(full)s};
+	static const uint8_t shift[] = {%(shift)s};
+	static const int16_t offsets[] = {%(offsets)s};
+	static const int16_t trims[] = {%(trims)s};
+	struct a_measure_channel channel;
+	unsigned c, o, t, raw;
+	for (c = 0; c < sizeof(shift); c++) {
+		measure_Initialize(&channel, MEASURE_GAIN(full[c], %(bits)d, shift[c]), shift[c]);
+		printf("gain %%u %%u\n", c, channel.gain);
+		for (o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++) {
+			for (t = 0; t < sizeof(trims) / sizeof(trims[0]); t++) {
+				measure_Calibrate(&channel, offsets[o], trims[t]);
+				printf("trim %%u %%d %%d %%u\n", c, offsets[o], trims[t], channel.gain);
+				for (raw = 0; raw < %(range)d; raw++) {printf("%%ld\n", (long)measure_Convert(&channel, raw));}
+			}
+		}
+	}
+	return 0;
+}
+"""
+
+
+def round_half_up(x):
+    return (x.numerator * 2 + x.denominator) // (x.denominator * 2)
+
+
+def round_half_away(x):
+    return round_half_up(x) if x >= 0 else -round_half_up(-x)
+
+
+def run_harness(cc):
+    source = HARNESS % {
+        "full": ", ".join("%.17g" % float(full) for _, full, _ in CHANNELS),
+        "shift": ", ".join(str(shift) for _, _, shift in CHANNELS),
+        "offsets": ", ".join(map(str, OFFSETS)),
+        "trims": ", ".join(map(str, TRIMS)),
+        "bits": ADC_BITS,
+        "range": RAW_RANGE,
+    }
+    with tempfile.TemporaryDirectory() as tmp:
+        c_file = os.path.join(tmp, "measure.c")
+        exe = os.path.join(tmp, "measure")
+        with open(c_file, "w") as f:
+            f.write(source)
+        subprocess.run([cc, "-std=c99", "-O2", "-Wall", "-I", REPO, c_file, "-o", exe], check=True)
+        return iter(subprocess.run([exe], check=True, capture_output=True, text=True).stdout.split("\n"))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check Measure.h's fixed-point conversions bit for bit")
+    parser.add_argument("--cc", default="cc", help="host C compiler")
+    args = parser.parse_args()
+
+    out = run_harness(args.cc)
+    mismatches = 0
+    for c, (name, full, shift) in enumerate(CHANNELS):
+        nominal = round_half_up(full * (1 << shift) / (1 << ADC_BITS))
+        gain_line = next(out).split()
+        if int(gain_line[2]) != nominal:
+            print("%s: MEASURE_GAIN %s, exact %d" % (name, gain_line[2], nominal))
+            mismatches += 1
+        worst = Fraction(0)
+        for offset in OFFSETS:
+            for trim in TRIMS:
+                gain = min(max(nominal + round_half_away(Fraction(nominal * trim, 1000000)), 0), 0xFFFF)
+                trim_line = next(out).split()
+                if int(trim_line[4]) != gain:
+                    print("%s offset %d trim %d: gain %s, exact %d" % (name, offset, trim, trim_line[4], gain))
+                    mismatches += 1
+                for raw in range(RAW_RANGE):
+                    got = int(next(out))
+                    counts = raw - offset
+                    want = round_half_up(Fraction(counts * gain, 1 << shift))
+                    if got != want:
+                        if mismatches < 20:
+                            print("%s offset %d trim %d raw %d: %d, exact %d" % (name, offset, trim, raw, got, want))
+                        mismatches += 1
+                    ideal = counts * full / (1 << ADC_BITS) * (1 + Fraction(trim, 1000000))
+                    worst = max(worst, abs(got - ideal))
+        print("%s: gain %d Q%d, %d readings x %d calibrations, worst error against ideal %.3f %s" % (
+            name, nominal, shift, RAW_RANGE, len(OFFSETS) * len(TRIMS), float(worst), name))
+    if mismatches:
+        sys.exit("%d mismatches" % mismatches)
+    print("bit exact")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,331 @@
+#!/usr/bin/env python3
+"""
+s4_offload.py - pulls files off an S4-Logger over its serial port.
+
+Speaks the framing in lemtils/Offload.h. Sends HELLO at 9600 baud until the
+logger answers, then switches both ends to 1 Mbaud, lists the card and
+streams each file a block per frame. Every frame is checked (CRC, sequence,
+offset). A bad or missing frame means asking again from the last good byte.
+Files already partly on disk are resumed from their size.
+
+  python3 s4_offload.py /dev/ttyUSB0                 # every file into ./s4_data
+  python3 s4_offload.py /dev/ttyUSB0 RAW.LOG RAW.IDX # just these
+  python3 s4_offload.py /dev/ttyUSB0 --list
+  python3 s4_offload.py /dev/ttyUSB0 --button        # offload started by holding button 2 (already at 1 Mbaud)
+  python3 s4_offload.py /dev/ttyUSB0 --stats         # card timing histograms (needs SD_LATENCY_STATS in Sd2Card.h)
+  python3 s4_offload.py /dev/ttyUSB0 --range 3600000 7200000  # raw records with log times in [from, to] ms, found through RAW.IDX
+  python3 s4_offload.py /dev/ttyUSB0 --trace         # expand the diagnostics of a TRACE_BINARY build into text
+
+Needs pyserial (pip install pyserial).
+"""
+
+import argparse
+import os
+import re
+import struct
+import sys
+import time
+
+import serial
+
+SERIAL_BAUD = 9600
+OFFLOAD_BAUD = 1000000
+
+SYNC = b"\xa5\x5a"
+HEADER = struct.Struct("<BHIH")  # type, sequence, offset, length (after the sync)
+
+HELLO, LIST, ENTRY, READ, DATA, END, ERROR, QUIT, STATS, RANGE = (ord(c) for c in "HLNRDEXQST")
+
+LATENCY = struct.Struct("<III16H")  # sd_latency_t: count, worst us, worst block, log2 us bins
+LATENCY_KINDS = ["read CMD17", "write CMD24", "write CMD25", "status CMD13", "busy wait"]
+
+RAW_RECORD = struct.Struct("<I3i")  # struct a_raw_record: time [ms], battery mV, load mA, load uW
+
+SKETCH = os.path.join(os.path.dirname(os.path.abspath(__file__)), os.pardir, "S4-Logger.ino")
+TRACE_FRAME_START = 0xA5  # lemtils/Trace.h: start, id (bit 7: has a value), value (4 bytes, LSB first)
+TRACE_HAS_VALUE = 0x80
+
+
+def crc16(data, crc=0xFFFF):
+    """CRC-16 CCITT as avr-libc's _crc_ccitt_update() (reflected 0x8408, no final xor)."""
+    for b in data:
+        b ^= crc & 0xFF
+        b = (b ^ (b << 4)) & 0xFF
+        crc = ((b << 8) | (crc >> 8)) ^ (b >> 4) ^ (b << 3)
+        crc &= 0xFFFF
+    return crc
+
+
+def frame(kind, sequence=0, offset=0, payload=b""):
+    body = HEADER.pack(kind, sequence, offset, len(payload)) + payload
+    return SYNC + body + struct.pack("<H", crc16(body))
+
+
+class Link:
+    def __init__(self, port, baud):
+        self.port = serial.Serial(port, baud, timeout=0.5)
+
+    def send(self, kind, sequence=0, offset=0, payload=b""):
+        self.port.write(frame(kind, sequence, offset, payload))
+
+    def receive(self, timeout=2.0):
+        """Next frame with a good CRC as (type, sequence, offset, payload), None on timeout.
+        Trace text and damaged frames are skipped."""
+        deadline = time.monotonic() + timeout
+        previous = b""
+        while time.monotonic() < deadline:
+            b = self.port.read(1)
+            if not b:
+                continue
+            if previous + b != SYNC:
+                previous = b
+                continue
+            previous = b""
+            head = self.port.read(HEADER.size)
+            if len(head) != HEADER.size:
+                return None
+            kind, sequence, offset, length = HEADER.unpack(head)
+            if length > 512:
+                continue
+            rest = self.port.read(length + 2)
+            if len(rest) != length + 2:
+                return None
+            payload = rest[:length]
+            if struct.unpack("<H", rest[length:])[0] != crc16(head + payload):
+                continue
+            return kind, sequence, offset, payload
+        return None
+
+    def drain(self):
+        time.sleep(0.05)
+        self.port.reset_input_buffer()
+
+
+def connect(port, button):
+    if button:
+        return Link(port, OFFLOAD_BAUD)
+    link = Link(port, SERIAL_BAUD)
+    for _ in range(40):  # The first tries may only wake it from power down
+        link.send(HELLO)
+        reply = link.receive(0.3)
+        if reply and reply[0] == HELLO:
+            print("logger version", reply[3].decode(errors="replace"))
+            time.sleep(0.1)  # Let it switch over
+            link.port.baudrate = OFFLOAD_BAUD
+            link.drain()
+            return link
+    sys.exit("no answer from the logger (recording? it only offloads from the idle state)")
+
+
+def list_files(link):
+    for attempt in range(3):
+        link.send(LIST)
+        files, expected = [], 0
+        while True:
+            reply = link.receive()
+            if reply is None or reply[1] != expected:
+                break
+            kind, _, offset, payload = reply
+            if kind == END:
+                return files
+            if kind == ERROR:
+                sys.exit("logger: " + payload.decode(errors="replace"))
+            files.append((payload.decode(errors="replace"), offset))
+            expected += 1
+        link.drain()
+    sys.exit("couldn't list the card")
+
+
+def pull(link, name, size, directory, retries):
+    path = os.path.join(directory, name)
+    have = os.path.getsize(path) if os.path.exists(path) else 0
+    if have > size:
+        have = 0  # Card file was remade, start over
+    mode = "r+b" if have else "wb"
+    with open(path, mode) as out:
+        out.truncate(have)
+        out.seek(have)
+        started = time.monotonic()
+        first = have
+        failures = 0
+        while True:
+            link.send(READ, 0, have, name.encode())
+            expected = 0
+            while True:
+                reply = link.receive()
+                if reply is None:
+                    break
+                kind, sequence, offset, payload = reply
+                if sequence != expected or offset != have:
+                    break  # Lost one (or a leftover from before the resume)
+                if kind == END:
+                    elapsed = max(time.monotonic() - started, 1e-3)
+                    print("%-12s %9d bytes  %6.1f kB/s" % (name, have, (have - first) / elapsed / 1000))
+                    return True
+                if kind == ERROR:
+                    print("%-12s logger couldn't read it at %d" % (name, have))
+                    return False
+                out.write(payload)
+                have += len(payload)
+                expected += 1
+                failures = 0
+            out.flush()
+            failures += 1
+            if failures > retries:
+                print("%-12s gave up at %d of %d bytes (run again to resume)" % (name, have, size))
+                return False
+            link.drain()
+
+
+def stats(link, clear):
+    for attempt in range(3):
+        link.send(STATS, 0, 1 if clear else 0)
+        kinds = []
+        while True:
+            reply = link.receive()
+            if reply is None or reply[1] != len(kinds):
+                break
+            kind, _, offset, payload = reply
+            if kind == ERROR:
+                sys.exit("logger: " + payload.decode(errors="replace"))
+            if kind == END:
+                break
+            kinds.append(LATENCY.unpack(payload))
+        if kinds and reply is not None and reply[0] == END:
+            break
+        link.drain()
+    else:
+        sys.exit("couldn't read the card timing")
+    top = max((i for count, _, _, *bins in kinds for i, n in enumerate(bins) if n), default=0)
+    print("%-13s %9s %10s %10s  " % ("", "count", "worst us", "at block") +
+          " ".join("%6s" % ("<%d" % (2 << i) if i < 15 else ">=32k") for i in range(top + 1)))
+    for name, (count, worst, block, *bins) in zip(LATENCY_KINDS, kinds):
+        print("%-13s %9d %10d %10d  " % (name, count, worst, block) + " ".join("%6d" % n for n in bins[:top + 1]))
+
+
+def pull_range(link, first, last, directory, retries):
+    """Raw records with first <= time <= last into RAW_<first>_<last>.BIN (as RAW_RECORD), resuming after the
+    newest record already in it."""
+    path = os.path.join(directory, "RAW_%d_%d.BIN" % (first, last))
+    have = os.path.getsize(path) // RAW_RECORD.size if os.path.exists(path) else 0
+    with open(path, "r+b" if have else "wb") as out:
+        out.truncate(have * RAW_RECORD.size)
+        start = first
+        if have:
+            out.seek((have - 1) * RAW_RECORD.size)
+            start = RAW_RECORD.unpack(out.read(RAW_RECORD.size))[0] + 1
+        out.seek(have * RAW_RECORD.size)
+        failures = 0
+        while start <= last:
+            link.send(RANGE, 0, start, struct.pack("<I", last))
+            expected = 0
+            while True:
+                reply = link.receive()
+                if reply is None:
+                    break
+                kind, sequence, offset, payload = reply
+                if sequence != expected:
+                    break  # Lost one (or a leftover from before the resume)
+                if kind == END:
+                    print("%d records with times %d to %d in %s" % (have, first, last, path))
+                    return True
+                if kind == ERROR:
+                    print("logger couldn't read %s" % payload.decode(errors="replace"))
+                    return False
+                if len(payload) % RAW_RECORD.size or offset < start:
+                    break
+                out.write(payload)
+                have += len(payload) // RAW_RECORD.size
+                start = RAW_RECORD.unpack_from(payload, len(payload) - RAW_RECORD.size)[0] + 1
+                expected += 1
+                failures = 0
+            out.flush()
+            failures += 1
+            if failures > retries:
+                print("gave up after %d records (run again to resume)" % have)
+                return False
+            link.drain()
+    print("%d records with times %d to %d in %s" % (have, first, last, path))
+    return True
+
+
+def trace_table(sketch):
+    """Message texts by id, from the sketch's TRACE_MESSAGES list (id 0 is Trace.h's dropped count)."""
+    with open(sketch) as f:
+        source = f.read()
+    strings = dict(re.findall(r'^#define\s+(\w+)\s+"([^"]*)"', source, re.M))
+    body = re.search(r"#define TRACE_MESSAGES\(X\)(.*?)\n#include", source, re.S).group(1)
+    table = ["Trace entries dropped:"]
+    for text in re.findall(r"X\(\s*\w+\s*,\s*(.*?)\)\s*\\?\s*$", body, re.M):
+        # adjacent literals and string macros (RAW_FILE " blocks written:")
+        parts = re.findall(r'"([^"]*)"|(\w+)', text)
+        table.append("".join(literal or strings.get(name, name) for literal, name in parts))
+    return table
+
+
+def trace(port, sketch):
+    """Prints the TRACE_BINARY frames as the text build would, until interrupted."""
+    table = trace_table(sketch)
+    link = serial.Serial(port, SERIAL_BAUD, timeout=0.5)
+    lines = 0
+    while True:
+        b = link.read(1)
+        if not b or b[0] != TRACE_FRAME_START:
+            continue
+        frame = link.read(5)
+        if len(frame) != 5 or (frame[0] & ~TRACE_HAS_VALUE) >= len(table):
+            continue  # not a frame (or a build with more messages than this sketch)
+        lines += 1
+        line = "%d - %s" % (lines, table[frame[0] & ~TRACE_HAS_VALUE])
+        if frame[0] & TRACE_HAS_VALUE:
+            line += " %d" % struct.unpack("<I", frame[1:])[0]
+        print(line, flush=True)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Pull files off an S4-Logger over serial")
+    parser.add_argument("port")
+    parser.add_argument("files", nargs="*", help="8.3 names on the card (default: all)")
+    parser.add_argument("--out", default="s4_data", help="directory to write into")
+    parser.add_argument("--list", action="store_true", help="only list the card")
+    parser.add_argument("--button", action="store_true", help="offload was started with button 2, skip the HELLO")
+    parser.add_argument("--stats", action="store_true", help="print the card timing histograms (us, log2 bins)")
+    parser.add_argument("--clear-stats", action="store_true", help="with --stats: zero them after reading")
+    parser.add_argument("--range", type=int, nargs=2, metavar=("FROM", "TO"),
+                        help="only the raw records with log times [ms] from FROM to TO (inclusive)")
+    parser.add_argument("--retries", type=int, default=10, help="resumes in a row without progress before giving up")
+    parser.add_argument("--trace", action="store_true", help="only listen, expanding TRACE_BINARY diagnostics to text")
+    parser.add_argument("--sketch", default=SKETCH, help="with --trace: the S4-Logger.ino the build was made from")
+    args = parser.parse_args()
+
+    if args.trace:
+        try:
+            trace(args.port, args.sketch)
+        except KeyboardInterrupt:
+            pass
+        return
+    link = connect(args.port, args.button)
+    if args.stats:
+        stats(link, args.clear_stats)
+        link.send(QUIT)
+        return
+    if args.range:
+        os.makedirs(args.out, exist_ok=True)
+        pull_range(link, args.range[0], args.range[1], args.out, args.retries)
+        link.send(QUIT)
+        return
+    files = list_files(link)
+    if args.list:
+        for name, size in files:
+            print("%-12s %9d" % (name, size))
+    else:
+        os.makedirs(args.out, exist_ok=True)
+        wanted = set(n.upper() for n in args.files)
+        for name, size in files:
+            if not wanted or name.upper() in wanted:
+                pull(link, name, size, args.out, args.retries)
+    link.send(QUIT)
+
+
+if __name__ == "__main__":
+    main()